@@ -1,6 +1,7 @@
 TEMPLATE = subdirs
 
-SUBDIRS += QVaultLib QVaultLibTests
+SUBDIRS += QVaultLib QVaultLibTests QVaultLibBenchmarks
 
 QVaultLibTests.depends = QVaultLib
+QVaultLibBenchmarks.depends = QVaultLib
 
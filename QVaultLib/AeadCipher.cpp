@@ -0,0 +1,89 @@
+#include "AeadCipher.h"
+
+#include <openssl/evp.h>
+#include <openssl/crypto.h>
+#include <openssl/rand.h>
+
+const int KEY_SIZE = 32;
+const int NONCE_SIZE = 12;
+const int TAG_SIZE = 16;
+
+const int AeadCipher::Overhead = NONCE_SIZE + TAG_SIZE;
+
+typedef const unsigned char* cpbytes;
+
+AeadCipher::AeadCipher(Algorithm algorithm, const QByteArray &key)
+    : _encryptCtx(EVP_CIPHER_CTX_new())
+    , _decryptCtx(EVP_CIPHER_CTX_new())
+{
+    Q_ASSERT(_encryptCtx);
+    Q_ASSERT(_decryptCtx);
+    Q_ASSERT(key.size() == KEY_SIZE);
+
+    const EVP_CIPHER *cipher = algorithm == ChaCha20Poly1305 ? EVP_chacha20_poly1305() : EVP_aes_256_gcm();
+
+    EVP_EncryptInit_ex(_encryptCtx, cipher, NULL, (cpbytes)key.constData(), NULL);
+    EVP_DecryptInit_ex(_decryptCtx, cipher, NULL, (cpbytes)key.constData(), NULL);
+}
+
+AeadCipher::~AeadCipher()
+{
+    EVP_CIPHER_CTX_free(_encryptCtx);
+    EVP_CIPHER_CTX_free(_decryptCtx);
+}
+
+QByteArray AeadCipher::encrypt(const QByteArray &data, const QByteArray &associatedData)
+{
+    QByteArray buffer(NONCE_SIZE + data.size() + TAG_SIZE, '\0');
+    unsigned char *nonce = (unsigned char*)buffer.data();
+    unsigned char *dest = nonce + NONCE_SIZE;
+    int len = 0, finalLen = 0;
+
+    // a NULL cipher and key keep the expanded key schedule, only the nonce is set.
+    if (1 == RAND_bytes(nonce, NONCE_SIZE) &&
+            1 == EVP_EncryptInit_ex(_encryptCtx, NULL, NULL, NULL, nonce) &&
+            1 == EVP_EncryptUpdate(_encryptCtx, NULL, &len, (cpbytes)associatedData.constData(), associatedData.size()) &&
+            1 == EVP_EncryptUpdate(_encryptCtx, dest, &len, (cpbytes)data.constData(), data.size()) &&
+            1 == EVP_EncryptFinal_ex(_encryptCtx, dest + len, &finalLen) &&
+            1 == EVP_CIPHER_CTX_ctrl(_encryptCtx, EVP_CTRL_AEAD_GET_TAG, TAG_SIZE, dest + data.size())) {
+        return buffer;
+    }
+
+    return QByteArray();
+}
+
+QByteArray AeadCipher::decrypt(const QByteArray &data, const QByteArray &associatedData)
+{
+    QByteArray buffer;
+    if (!decrypt(data.constData(), data.size(), associatedData, &buffer)) {
+        return QByteArray();
+    }
+
+    return buffer;
+}
+
+bool AeadCipher::decrypt(const char *data, int size, const QByteArray &associatedData, QByteArray *output)
+{
+    if (size < Overhead) {
+        return false;
+    }
+
+    const unsigned char *nonce = (cpbytes)data;
+    const int textSize = size - Overhead;
+    output->resize(textSize);
+    unsigned char *dest = (unsigned char*)output->data();
+    int len = 0, finalLen = 0;
+
+    // the tag is checked by the final call, so nothing is returned before it passes.
+    if (1 == EVP_DecryptInit_ex(_decryptCtx, NULL, NULL, NULL, nonce) &&
+            1 == EVP_DecryptUpdate(_decryptCtx, NULL, &len, (cpbytes)associatedData.constData(), associatedData.size()) &&
+            1 == EVP_DecryptUpdate(_decryptCtx, dest, &len, nonce + NONCE_SIZE, textSize) &&
+            1 == EVP_CIPHER_CTX_ctrl(_decryptCtx, EVP_CTRL_AEAD_SET_TAG, TAG_SIZE, (void*)(nonce + NONCE_SIZE + textSize)) &&
+            1 == EVP_DecryptFinal_ex(_decryptCtx, dest + len, &finalLen)) {
+        return true;
+    }
+
+    OPENSSL_cleanse(output->data(), output->size());
+    output->resize(0);
+    return false;
+}
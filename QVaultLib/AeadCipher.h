@@ -0,0 +1,59 @@
+#ifndef AEADCIPHER_H
+#define AEADCIPHER_H
+
+#include <QByteArray>
+
+struct evp_cipher_ctx_st;
+
+/**
+ * @brief AeadCipher encrypts and authenticates data with a random nonce per call.
+ * @details
+ * Encrypted data is laid out as nonce, ciphertext and tag, so every piece of
+ * data is verified on decryption without a separate MAC. Associated data is
+ * authenticated but not encrypted, it binds the ciphertext to its context.
+ * Nonces are random 96-bit values, so a key must not encrypt more than
+ * about 2^32 pieces of data.
+ */
+class AeadCipher
+{
+public:
+    enum Algorithm {
+        AesGcm,
+        ChaCha20Poly1305
+    };
+
+    /**
+     * @brief Size of the nonce and the tag added to encrypted data.
+     */
+    static const int Overhead;
+
+    /**
+     * @param algorithm.
+     * @param key - 32 bytes key.
+     */
+    AeadCipher(Algorithm algorithm, const QByteArray &key);
+    virtual ~AeadCipher();
+
+    QByteArray encrypt(const QByteArray &data, const QByteArray &associatedData);
+
+    /**
+     * @brief Decrypts data encrypted by encrypt().
+     * @return empty array if the data or the associated data have been modified.
+     */
+    QByteArray decrypt(const QByteArray &data, const QByteArray &associatedData);
+
+    /**
+     * @brief Decrypts data into the output, reusing its buffer.
+     * @return false if the data or the associated data have been modified.
+     */
+    bool decrypt(const char *data, int size, const QByteArray &associatedData, QByteArray *output);
+
+private:
+    Q_DISABLE_COPY(AeadCipher)
+
+    // contexts are keyed once, every operation only sets the nonce.
+    evp_cipher_ctx_st *_encryptCtx;
+    evp_cipher_ctx_st *_decryptCtx;
+};
+
+#endif // AEADCIPHER_H
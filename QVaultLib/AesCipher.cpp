@@ -1,26 +1,42 @@
 #include "AesCipher.h"
 
+#include <SecureArena.h>
+
+#include <cstring>
+
 #include <openssl/evp.h>
 #include <openssl/crypto.h>
 
 const int AES_KEY_SIZE = 16;
 const int IV_SIZE = 16;
+const int WRAP_KEY_SIZE = 32;
+const int WRAP_BLOCK_SIZE = 8;
 
 typedef const unsigned char* cpbytes;
 
 AesCipher::AesCipher(const QByteArray &key, const QByteArray &iv)
-    : _ctx(EVP_CIPHER_CTX_new())
-    , _key(key)
+    : _encryptCtx(EVP_CIPHER_CTX_new())
+    , _decryptCtx(EVP_CIPHER_CTX_new())
     , _iv(iv)
 {
-    Q_ASSERT(_ctx);
+    Q_ASSERT(_encryptCtx);
+    Q_ASSERT(_decryptCtx);
     Q_ASSERT(key.size() == AES_KEY_SIZE);
     Q_ASSERT(iv.size() == IV_SIZE);
+
+    // AES-256 takes a longer key than the derived one, so the key is zero-padded
+    // rather than letting OpenSSL read past the end of the buffer.
+    SecureArena::Buffer cipherKey(EVP_CIPHER_key_length(EVP_aes_256_cbc()));
+    memcpy(cipherKey.data(), key.constData(), size_t(qMin(key.size(), cipherKey.size())));
+
+    EVP_EncryptInit_ex(_encryptCtx, EVP_aes_256_cbc(), NULL, (cpbytes)cipherKey.constData(), (cpbytes)_iv.constData());
+    EVP_DecryptInit_ex(_decryptCtx, EVP_aes_256_cbc(), NULL, (cpbytes)cipherKey.constData(), (cpbytes)_iv.constData());
 }
 
 AesCipher::~AesCipher()
 {
-    EVP_CIPHER_CTX_free(_ctx);
+    EVP_CIPHER_CTX_free(_encryptCtx);
+    EVP_CIPHER_CTX_free(_decryptCtx);
 }
 
 QByteArray AesCipher::encrypt(const QByteArray &data)
@@ -30,13 +46,15 @@ QByteArray AesCipher::encrypt(const QByteArray &data)
     QByteArray buffer(data.size() + AES_KEY_SIZE, '\0');
     unsigned char *dest = (unsigned char*)buffer.data();
 
-    if (1 == EVP_EncryptInit_ex(_ctx, EVP_aes_256_cbc(), NULL, (cpbytes)_key.data(), (cpbytes)_iv.data())) {
+    // a NULL cipher and key keep the expanded key schedule, only the IV is reset.
+    if (1 == EVP_EncryptInit_ex(_encryptCtx, NULL, NULL, NULL, (cpbytes)_iv.constData())) {
         int len = 0;
-        if (1 == EVP_EncryptUpdate(_ctx, dest, &len, (cpbytes)data.data(), data.size())) {
+        if (1 == EVP_EncryptUpdate(_encryptCtx, dest, &len, (cpbytes)data.data(), data.size())) {
             int buffer_size = len;
-            if (1 == EVP_EncryptFinal_ex(_ctx, dest + len, &len)) {
+            if (1 == EVP_EncryptFinal_ex(_encryptCtx, dest + len, &len)) {
                 buffer_size += len;
-                return buffer.left(buffer_size);
+                buffer.resize(buffer_size);
+                return buffer;
             }
         }
     }
@@ -46,20 +64,73 @@ QByteArray AesCipher::encrypt(const QByteArray &data)
 
 QByteArray AesCipher::decrypt(const QByteArray &data)
 {
-    Q_ASSERT(data.size() > 0);
+    QByteArray buffer;
+    if (!decrypt(data.constData(), data.size(), &buffer)) {
+        return QByteArray();
+    }
 
-    QByteArray buffer(data.size(), '\0');
-    unsigned char *dest = (unsigned char*)buffer.data();
+    return buffer;
+}
+
+bool AesCipher::decrypt(const char *data, int size, QByteArray *output)
+{
+    Q_ASSERT(size > 0);
+
+    output->resize(size);
+    unsigned char *dest = (unsigned char*)output->data();
     int outlen = 0, tmplen = 0;
 
-    if (1 == EVP_DecryptInit_ex(_ctx, EVP_aes_256_cbc(), NULL, (cpbytes)_key.data(), (cpbytes)_iv.data())) {
-        if (1 == EVP_DecryptUpdate(_ctx, dest, &outlen, (cpbytes)data.data(), data.length())) {
-            if (1 == EVP_DecryptFinal_ex(_ctx, dest + outlen, &tmplen)) {
+    if (1 == EVP_DecryptInit_ex(_decryptCtx, NULL, NULL, NULL, (cpbytes)_iv.constData())) {
+        if (1 == EVP_DecryptUpdate(_decryptCtx, dest, &outlen, (cpbytes)data, size)) {
+            if (1 == EVP_DecryptFinal_ex(_decryptCtx, dest + outlen, &tmplen)) {
                 outlen += tmplen;
-                return buffer.left(outlen);
+                output->resize(outlen);
+                return true;
             }
         }
     }
 
-    return QByteArray();
+    OPENSSL_cleanse(output->data(), output->size());
+    output->resize(0);
+    return false;
+}
+
+static QByteArray wrapCipher(bool wrap, const QByteArray &kek, const QByteArray &data)
+{
+    Q_ASSERT(kek.size() == WRAP_KEY_SIZE);
+
+    if (data.isEmpty() || data.size() % WRAP_BLOCK_SIZE != 0) {
+        return QByteArray();
+    }
+
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    EVP_CIPHER_CTX_set_flags(ctx, EVP_CIPHER_CTX_FLAG_WRAP_ALLOW);
+
+    QByteArray buffer(data.size() + WRAP_BLOCK_SIZE, '\0');
+    unsigned char *dest = (unsigned char*)buffer.data();
+    int len = 0, finalLen = 0;
+
+    const bool success =
+            1 == EVP_CipherInit_ex(ctx, EVP_aes_256_wrap(), NULL, (cpbytes)kek.constData(), NULL, wrap ? 1 : 0) &&
+            1 == EVP_CipherUpdate(ctx, dest, &len, (cpbytes)data.constData(), data.size()) &&
+            1 == EVP_CipherFinal_ex(ctx, dest + len, &finalLen);
+    EVP_CIPHER_CTX_free(ctx);
+
+    if (!success) {
+        OPENSSL_cleanse(buffer.data(), buffer.size());
+        return QByteArray();
+    }
+
+    buffer.resize(len + finalLen);
+    return buffer;
+}
+
+QByteArray AesCipher::wrap(const QByteArray &kek, const QByteArray &key)
+{
+    return wrapCipher(true, kek, key);
+}
+
+QByteArray AesCipher::unwrap(const QByteArray &kek, const QByteArray &wrappedKey)
+{
+    return wrapCipher(false, kek, wrappedKey);
 }
@@ -14,9 +14,32 @@ public:
     QByteArray encrypt(const QByteArray& data);
     QByteArray decrypt(const QByteArray& data);
 
+    /**
+     * @brief Decrypts data into the output, reusing its buffer.
+     * @return false if the data cannot be decrypted.
+     */
+    bool decrypt(const char *data, int size, QByteArray *output);
+
+    /**
+     * @brief Wraps a key with AES-256 key wrap (RFC 3394).
+     * @param kek - 32 bytes key-encryption key.
+     * @param key - key to wrap, a multiple of 8 bytes.
+     * @return wrapped key, 8 bytes longer than the key, or empty array on failure.
+     */
+    static QByteArray wrap(const QByteArray &kek, const QByteArray &key);
+
+    /**
+     * @brief Unwraps a key wrapped by wrap().
+     * @return empty array if the key-encryption key is wrong or the data is corrupted.
+     */
+    static QByteArray unwrap(const QByteArray &kek, const QByteArray &wrappedKey);
+
 private:
-    evp_cipher_ctx_st *_ctx;
-    QByteArray _key;
+    Q_DISABLE_COPY(AesCipher)
+
+    // contexts are keyed once, every operation only resets the IV.
+    evp_cipher_ctx_st *_encryptCtx;
+    evp_cipher_ctx_st *_decryptCtx;
     QByteArray _iv;
 };
 
@@ -0,0 +1,87 @@
+#include "CipherPool.h"
+
+#include <AesCipher.h>
+#include <CryptoContext.h>
+#include <Hmac.h>
+
+#include <QMutexLocker>
+#include <QScopedPointer>
+#include <QtAlgorithms>
+
+struct CipherPool::Entry
+{
+    explicit Entry(const CryptoContext *context)
+        : keyMac(new Hmac(context->keyMacKey()))
+    {
+    }
+
+    QScopedPointer<AesCipher> cipher;
+    QScopedPointer<AeadCipher> aead;
+    QScopedPointer<Hmac> keyMac;
+};
+
+CipherPool::CipherPool(const CryptoContext *context, AeadCipher::Algorithm algorithm)
+    : _context(context)
+    , _algorithm(algorithm)
+{
+    Q_ASSERT(context);
+}
+
+CipherPool::~CipherPool()
+{
+    qDeleteAll(_free);
+}
+
+CipherPool::Entry *CipherPool::acquire()
+{
+    {
+        QMutexLocker locker(&_mutex);
+        if (!_free.isEmpty()) {
+            return _free.takeLast();
+        }
+    }
+
+    // keying a new context is the slow path, so it is done outside of the mutex.
+    return new Entry(_context);
+}
+
+void CipherPool::release(Entry *entry)
+{
+    QMutexLocker locker(&_mutex);
+    _free.append(entry);
+}
+
+CipherPool::Lease::Lease(CipherPool *pool)
+    : _pool(pool)
+    , _entry(pool->acquire())
+{
+}
+
+CipherPool::Lease::~Lease()
+{
+    _pool->release(_entry);
+}
+
+AesCipher *CipherPool::Lease::cipher() const
+{
+    if (!_entry->cipher) {
+        _entry->cipher.reset(new AesCipher(_pool->_context->aesKey(), _pool->_context->iv()));
+    }
+
+    return _entry->cipher.data();
+}
+
+AeadCipher *CipherPool::Lease::aead() const
+{
+    // the IV is not used by authenticated ciphers, so it extends the key to 256 bits
+    if (!_entry->aead) {
+        _entry->aead.reset(new AeadCipher(_pool->_algorithm, _pool->_context->aeadKey()));
+    }
+
+    return _entry->aead.data();
+}
+
+Hmac *CipherPool::Lease::keyMac() const
+{
+    return _entry->keyMac.data();
+}
@@ -0,0 +1,67 @@
+#ifndef CIPHERPOOL_H
+#define CIPHERPOOL_H
+
+#include <QList>
+#include <QMutex>
+
+#include <AeadCipher.h>
+
+class AesCipher;
+class CryptoContext;
+class Hmac;
+
+/**
+ * @brief CipherPool hands out keyed cipher contexts to concurrent callers.
+ * @details
+ * Cipher contexts keep per-operation state, so they cannot be shared between
+ * threads. The pool keeps the contexts created so far and leases each of them
+ * to one caller at a time, so the number of contexts grows with the number of
+ * concurrent callers rather than with the number of operations.
+ * Ciphers are keyed on first use, so a vault only pays for the ones it uses.
+ */
+class CipherPool
+{
+private:
+    struct Entry;
+
+public:
+    /**
+     * @param context - keys of the vault.
+     * @param algorithm - algorithm of the authenticated ciphers handed out.
+     */
+    CipherPool(const CryptoContext *context, AeadCipher::Algorithm algorithm);
+    virtual ~CipherPool();
+
+    /**
+     * @brief Lease holds pooled contexts for the lifetime of the lease.
+     */
+    class Lease
+    {
+    public:
+        explicit Lease(CipherPool *pool);
+        ~Lease();
+
+        AesCipher *cipher() const;
+        AeadCipher *aead() const;
+        Hmac *keyMac() const;
+
+    private:
+        Q_DISABLE_COPY(Lease)
+
+        CipherPool *_pool;
+        Entry *_entry;
+    };
+
+private:
+    Q_DISABLE_COPY(CipherPool)
+
+    Entry *acquire();
+    void release(Entry *entry);
+
+    const CryptoContext *_context;
+    const AeadCipher::Algorithm _algorithm;
+    QMutex _mutex;
+    QList<Entry*> _free;
+};
+
+#endif // CIPHERPOOL_H
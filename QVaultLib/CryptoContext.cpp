@@ -1,16 +1,53 @@
 #include "CryptoContext.h"
 
+#include <Hmac.h>
+
+#include <cstring>
+
+const int KEY_MAC_KEY_SIZE = 32;
+const char KEY_MAC_KEY_INFO[] = "qvault record keys";
+
+// HKDF-SHA256 (RFC 5869) with no salt and a single block of output
+static bool deriveKeyMacKey(const QByteArray &macKey, char *key)
+{
+    QByteArray prk;
+    QByteArray okm;
+    const bool derived = Hmac(QByteArray(KEY_MAC_KEY_SIZE, '\0')).digest(macKey, &prk) &&
+            Hmac(prk).digest(QByteArray(KEY_MAC_KEY_INFO) + char(1), &okm) &&
+            okm.size() == KEY_MAC_KEY_SIZE;
+    if (derived) {
+        memcpy(key, okm.constData(), size_t(KEY_MAC_KEY_SIZE));
+    }
+
+    prk.fill('\0');
+    okm.fill('\0');
+
+    return derived;
+}
+
 CryptoContext::CryptoContext(const QByteArray &aesKey,
                              const QByteArray &iv,
                              const QByteArray &macKey,
-                             const QByteArray &salt,
-                             qint32 iterations)
-    : _aesKey(aesKey)
-    , _iv(iv)
-    , _macKey(macKey)
-    , _salt(salt)
-    , _iterations(iterations)
+                             const QVariantMap &keySlot,
+                             bool separateKeyMac)
+    : _keys(aesKey.size() + iv.size() + macKey.size() + (separateKeyMac ? KEY_MAC_KEY_SIZE : 0))
+    , _aesKeySize(aesKey.size())
+    , _ivSize(iv.size())
+    , _macKeySize(macKey.size())
+    , _separateKeyMac(separateKeyMac)
+    , _keySlot(keySlot)
 {
+    const int secretKeySize = _aesKeySize + _ivSize + _macKeySize;
+    if (_keys.size() == secretKeySize + (separateKeyMac ? KEY_MAC_KEY_SIZE : 0)) {
+        memcpy(_keys.data(), aesKey.constData(), size_t(_aesKeySize));
+        memcpy(_keys.data() + _aesKeySize, iv.constData(), size_t(_ivSize));
+        memcpy(_keys.data() + _aesKeySize + _ivSize, macKey.constData(), size_t(_macKeySize));
+
+        // the derived key follows the secret key in the same block
+        if (separateKeyMac && !deriveKeyMacKey(macKey, _keys.data() + secretKeySize)) {
+            _keys.wipe();
+        }
+    }
 }
 
 CryptoContext::~CryptoContext()
@@ -20,44 +57,50 @@ CryptoContext::~CryptoContext()
 
 QByteArray CryptoContext::secretKey() const
 {
-    return _aesKey + _iv + _macKey;
+    return _keys.isEmpty() ? QByteArray() : _keys.view(0, _aesKeySize + _ivSize + _macKeySize);
 }
 
 QByteArray CryptoContext::aesKey() const
 {
-    return _aesKey;
+    return _keys.isEmpty() ? QByteArray() : _keys.view(0, _aesKeySize);
 }
 
 QByteArray CryptoContext::iv() const
 {
-    return _iv;
+    return _keys.isEmpty() ? QByteArray() : _keys.view(_aesKeySize, _ivSize);
 }
 
 QByteArray CryptoContext::macKey() const
 {
-    return _macKey;
+    return _keys.isEmpty() ? QByteArray() : _keys.view(_aesKeySize + _ivSize, _macKeySize);
 }
 
-QByteArray CryptoContext::salt() const
+QByteArray CryptoContext::aeadKey() const
 {
-    return _salt;
+    return _keys.isEmpty() ? QByteArray() : _keys.view(0, _aesKeySize + _ivSize);
 }
 
-int CryptoContext::iterations() const
+QByteArray CryptoContext::keyMacKey() const
 {
-    return _iterations;
+    if (!_separateKeyMac) {
+        return macKey();
+    }
+
+    return _keys.isEmpty() ? QByteArray() : _keys.view(_aesKeySize + _ivSize + _macKeySize, KEY_MAC_KEY_SIZE);
 }
 
-void CryptoContext::wipe()
+bool CryptoContext::hasSeparateKeyMac() const
+{
+    return _separateKeyMac;
+}
+
+QVariantMap CryptoContext::keySlot() const
 {
-    _aesKey.fill('\0');
-    _iv.fill('\0');
-    _macKey.fill('\0');
-    _salt.fill('\0');
-    _aesKey.clear();
-    _iv.clear();
-    _macKey.clear();
-    _salt.clear();
+    return _keySlot;
+}
 
-    _iterations = 0;
+void CryptoContext::wipe()
+{
+    _keys.wipe();
+    _keySlot.clear();
 }
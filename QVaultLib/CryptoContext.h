@@ -1,33 +1,78 @@
 #ifndef CRYPTOCONTEXT_H
 #define CRYPTOCONTEXT_H
 
+#include <SecureArena.h>
+
 #include <QByteArray>
+#include <QVariantMap>
 
+/**
+ * @brief CryptoContext holds the keys of an unlocked vault.
+ * @details
+ * The AES key, IV and MAC key are kept together in one block of the
+ * SecureArena, so they are never swapped out and all of them are zeroed at
+ * once by wipe(). Keys are returned without copying, so no copy is left
+ * behind in the heap.
+ */
 class CryptoContext
 {
 public:
+    /**
+     * @param separateKeyMac - derives the key of record key HMACs from the MAC key,
+     *        otherwise record keys are HMACs under the MAC key itself, as in older vaults.
+     */
     explicit CryptoContext(const QByteArray &aesKey,
                            const QByteArray &iv,
                            const QByteArray &macKey,
-                           const QByteArray &salt,
-                           int iterations);
+                           const QVariantMap &keySlot,
+                           bool separateKeyMac = false);
     virtual ~CryptoContext();
 
     void wipe();
 
+    /**
+     * @note Keys are not copied and are valid until the context is wiped or destroyed.
+     */
     QByteArray secretKey() const;
     QByteArray aesKey() const;
     QByteArray iv() const;
     QByteArray macKey() const;
-    QByteArray salt() const;
-    int iterations() const;
+
+    /**
+     * @brief Gets the AES key and IV as one key of authenticated ciphers.
+     * @note The key is not copied and is valid until the context is wiped or destroyed.
+     */
+    QByteArray aeadKey() const;
+
+    /**
+     * @brief Gets the key of HMACs identifying records by their plain keys.
+     * @details
+     * Vaults with a separate key derive it from the MAC key with HKDF-SHA256,
+     * so record keys never share a key with MACs of the header, the journal
+     * and shard files.
+     * @note The key is not copied and is valid until the context is wiped or destroyed.
+     */
+    QByteArray keyMacKey() const;
+
+    /**
+     * @brief Gets whether the key of record key HMACs is derived, see keyMacKey().
+     */
+    bool hasSeparateKeyMac() const;
+
+    /**
+     * @brief Gets the key slot of the vault header the keys were unlocked with.
+     */
+    QVariantMap keySlot() const;
 
 private:
-    QByteArray _aesKey;
-    QByteArray _iv;
-    QByteArray _macKey;
-    QByteArray _salt;
-    int _iterations;
+    Q_DISABLE_COPY(CryptoContext)
+
+    SecureArena::Buffer _keys;
+    int _aesKeySize;
+    int _ivSize;
+    int _macKeySize;
+    bool _separateKeyMac;
+    QVariantMap _keySlot;
 };
 
 #endif // CRYPTOCONTEXT_H
@@ -0,0 +1,91 @@
+#include "Hmac.h"
+
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/opensslv.h>
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#include <openssl/params.h>
+#endif
+
+const int HMAC_SIZE = 32;
+
+typedef const unsigned char* cpbytes;
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+
+Hmac::Hmac(const QByteArray &key)
+{
+    EVP_MAC *mac = EVP_MAC_fetch(NULL, OSSL_MAC_NAME_HMAC, NULL);
+    EVP_MAC_CTX *ctx = EVP_MAC_CTX_new(mac);
+    EVP_MAC_free(mac);
+    Q_ASSERT(ctx);
+
+    char digestName[] = OSSL_DIGEST_NAME_SHA2_256;
+    OSSL_PARAM params[] = {
+        OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, digestName, 0),
+        OSSL_PARAM_construct_end()
+    };
+    EVP_MAC_init(ctx, (cpbytes)key.constData(), key.size(), params);
+
+    _ctx = ctx;
+}
+
+Hmac::~Hmac()
+{
+    EVP_MAC_CTX_free(static_cast<EVP_MAC_CTX*>(_ctx));
+}
+
+bool Hmac::digest(const QByteArray &data, QByteArray *result)
+{
+    EVP_MAC_CTX *ctx = static_cast<EVP_MAC_CTX*>(_ctx);
+    result->resize(HMAC_SIZE);
+    size_t length = 0;
+
+    // a NULL key restarts from the precomputed key pads
+    return 1 == EVP_MAC_init(ctx, NULL, 0, NULL) &&
+            1 == EVP_MAC_update(ctx, (cpbytes)data.constData(), data.size()) &&
+            1 == EVP_MAC_final(ctx, reinterpret_cast<unsigned char*>(result->data()), &length, result->size());
+}
+
+#else
+
+Hmac::Hmac(const QByteArray &key)
+{
+    HMAC_CTX *ctx = HMAC_CTX_new();
+    Q_ASSERT(ctx);
+
+    HMAC_Init_ex(ctx, key.constData(), key.size(), EVP_sha256(), NULL);
+
+    _ctx = ctx;
+}
+
+Hmac::~Hmac()
+{
+    HMAC_CTX_free(static_cast<HMAC_CTX*>(_ctx));
+}
+
+bool Hmac::digest(const QByteArray &data, QByteArray *result)
+{
+    HMAC_CTX *ctx = static_cast<HMAC_CTX*>(_ctx);
+    result->resize(HMAC_SIZE);
+    unsigned int length = 0;
+
+    // a NULL key restarts from the precomputed key pads
+    return 1 == HMAC_Init_ex(ctx, NULL, 0, NULL, NULL) &&
+            1 == HMAC_Update(ctx, (cpbytes)data.constData(), data.size()) &&
+            1 == HMAC_Final(ctx, reinterpret_cast<unsigned char*>(result->data()), &length);
+}
+
+#endif
+
+QByteArray Hmac::digest(const QByteArray &data)
+{
+    QByteArray result;
+    if (!digest(data, &result)) {
+        return QByteArray();
+    }
+
+    return result;
+}
@@ -0,0 +1,32 @@
+#ifndef HMAC_H
+#define HMAC_H
+
+#include <QByteArray>
+
+/**
+ * @brief Hmac computes HMAC-SHA256 digests under a fixed key.
+ * @details
+ * The context is keyed once, so every digest reuses the precomputed
+ * inner and outer key pads instead of hashing the key again.
+ */
+class Hmac
+{
+public:
+    explicit Hmac(const QByteArray &key);
+    virtual ~Hmac();
+
+    QByteArray digest(const QByteArray &data);
+
+    /**
+     * @brief Computes a digest into the result, reusing its buffer.
+     * @return false on failure.
+     */
+    bool digest(const QByteArray &data, QByteArray *result);
+
+private:
+    Q_DISABLE_COPY(Hmac)
+
+    void *_ctx;
+};
+
+#endif // HMAC_H
@@ -0,0 +1,468 @@
+#include "Kdf.h"
+
+#include <QDebug>
+#include <QElapsedTimer>
+#include <QHash>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QPair>
+#include <QScopedPointer>
+#include <QVector>
+
+#include <algorithm>
+#include <limits>
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/opensslv.h>
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+#define QVAULT_HAS_SCRYPT
+#endif
+
+#if OPENSSL_VERSION_NUMBER >= 0x30200000L
+#include <openssl/core_names.h>
+#include <openssl/kdf.h>
+#include <openssl/params.h>
+#define QVAULT_HAS_ARGON2
+#endif
+
+const char PARAMETER_ALGORITHM[] = "algorithm";
+const char PARAMETER_ITERATIONS[] = "iterations";
+const char PARAMETER_MEMORY[] = "memory";
+const char PARAMETER_LANES[] = "lanes";
+const char PARAMETER_N[] = "n";
+const char PARAMETER_R[] = "r";
+const char PARAMETER_P[] = "p";
+
+const char *const ALGORITHM_NAMES[] = {
+    "pbkdf2-sha1",
+    "pbkdf2-sha256",
+    "pbkdf2-sha512",
+    "scrypt",
+    "argon2id"
+};
+
+const int MIN_ITERATIONS = 100;
+const int BENCHMARK_ITERATIONS = 1000;
+const quint64 MIN_SCRYPT_N = 1 << 14;
+const quint32 SCRYPT_R = 8;
+const quint32 SCRYPT_P = 1;
+const quint64 SCRYPT_MAX_MEMORY = 1024 * 1024 * 1024;
+const quint32 MIN_ARGON2_MEMORY_KIB = 8 * 1024;
+const quint32 ARGON2_MEMORY_KIB = 64 * 1024;
+const quint32 MAX_ARGON2_MEMORY_KIB = 1024 * 1024;
+const quint32 ARGON2_LANES = 1;
+const int CALIBRATION_SAMPLES = 5;
+const int BENCHMARK_KEY_SIZE = 64;
+const int BENCHMARK_SALT_SIZE = 16;
+const char BENCHMARK_PASSWORD[] = "benchmark";
+
+typedef const unsigned char* cpbytes;
+
+class Pbkdf2Kdf : public Kdf
+{
+public:
+    explicit Pbkdf2Kdf(Algorithm algorithm)
+        : Kdf(algorithm)
+        , _iterations(MIN_ITERATIONS)
+    {
+    }
+
+    QVariantMap parameters() const override
+    {
+        QVariantMap result;
+        result.insert(PARAMETER_ALGORITHM, ALGORITHM_NAMES[algorithm()]);
+        result.insert(PARAMETER_ITERATIONS, _iterations);
+        return result;
+    }
+
+    QByteArray derive(const QString &password, const QByteArray &salt, int size) const override
+    {
+        QByteArray passwordData = password.toUtf8();
+        QByteArray key(size, '\0');
+
+        // vaults with SHA1 keys were created passing the password length in
+        // characters rather than in bytes, which has to be kept to unlock them.
+        const int passwordSize = algorithm() == Pbkdf2Sha1 ? password.size() : passwordData.size();
+
+        const bool derived = PKCS5_PBKDF2_HMAC(passwordData.constData(), passwordSize,
+                                               (cpbytes)salt.constData(), salt.size(),
+                                               _iterations, digest(),
+                                               key.size(), reinterpret_cast<unsigned char*>(key.data())) == 1;
+        OPENSSL_cleanse(passwordData.data(), passwordData.size());
+
+        if (!derived) {
+            qDebug() << "Failed to derive key with" << ALGORITHM_NAMES[algorithm()];
+            return QByteArray();
+        }
+
+        return key;
+    }
+
+    void calibrate(qint64 targetMillis) override
+    {
+        _iterations = BENCHMARK_ITERATIONS;
+        const qint64 iterations = targetMillis * 1000000 * BENCHMARK_ITERATIONS / benchmark();
+        _iterations = int(qBound<qint64>(MIN_ITERATIONS, iterations, std::numeric_limits<int>::max()));
+    }
+
+protected:
+    bool setParameters(const QVariantMap &parameters) override
+    {
+        bool ok = false;
+        const int iterations = parameters.value(PARAMETER_ITERATIONS).toInt(&ok);
+        if (!ok || iterations < 1) {
+            return false;
+        }
+
+        _iterations = iterations;
+        return true;
+    }
+
+private:
+    const EVP_MD *digest() const
+    {
+        switch (algorithm()) {
+        case Pbkdf2Sha256:
+            return EVP_sha256();
+        case Pbkdf2Sha512:
+            return EVP_sha512();
+        default:
+            return EVP_sha1();
+        }
+    }
+
+    int _iterations;
+};
+
+#ifdef QVAULT_HAS_SCRYPT
+class ScryptKdf : public Kdf
+{
+public:
+    ScryptKdf()
+        : Kdf(Scrypt)
+        , _n(MIN_SCRYPT_N)
+        , _r(SCRYPT_R)
+        , _p(SCRYPT_P)
+    {
+    }
+
+    QVariantMap parameters() const override
+    {
+        QVariantMap result;
+        result.insert(PARAMETER_ALGORITHM, ALGORITHM_NAMES[algorithm()]);
+        result.insert(PARAMETER_N, _n);
+        result.insert(PARAMETER_R, _r);
+        result.insert(PARAMETER_P, _p);
+        return result;
+    }
+
+    QByteArray derive(const QString &password, const QByteArray &salt, int size) const override
+    {
+        QByteArray passwordData = password.toUtf8();
+        QByteArray key(size, '\0');
+
+        const bool derived = EVP_PBE_scrypt(passwordData.constData(), passwordData.size(),
+                                            (cpbytes)salt.constData(), salt.size(),
+                                            _n, _r, _p, SCRYPT_MAX_MEMORY,
+                                            reinterpret_cast<unsigned char*>(key.data()), key.size()) == 1;
+        OPENSSL_cleanse(passwordData.data(), passwordData.size());
+
+        if (!derived) {
+            qDebug() << "Failed to derive key with" << ALGORITHM_NAMES[algorithm()];
+            return QByteArray();
+        }
+
+        return key;
+    }
+
+    void calibrate(qint64 targetMillis) override
+    {
+        // the cost must be a power of two and the time grows linearly with it,
+        // so it is doubled as long as the estimated time fits the target.
+        _n = MIN_SCRYPT_N;
+        qint64 nanoseconds = benchmark();
+        while (nanoseconds * 2 <= targetMillis * 1000000 && memory(_n * 2, _r, _p) <= SCRYPT_MAX_MEMORY) {
+            _n *= 2;
+            nanoseconds *= 2;
+        }
+    }
+
+protected:
+    bool setParameters(const QVariantMap &parameters) override
+    {
+        const quint64 n = parameters.value(PARAMETER_N).toULongLong();
+        const quint32 r = parameters.value(PARAMETER_R).toUInt();
+        const quint32 p = parameters.value(PARAMETER_P).toUInt();
+        if (n < 2 || (n & (n - 1)) != 0 || r == 0 || p == 0 || memory(n, r, p) > SCRYPT_MAX_MEMORY) {
+            return false;
+        }
+
+        _n = n;
+        _r = r;
+        _p = p;
+        return true;
+    }
+
+private:
+    // the memory OpenSSL checks against the limit before deriving
+    static quint64 memory(quint64 n, quint32 r, quint32 p)
+    {
+        return 128 * quint64(r) * (n + 2) + 128 * quint64(r) * quint64(p);
+    }
+
+    quint64 _n;
+    quint32 _r;
+    quint32 _p;
+};
+#endif
+
+#ifdef QVAULT_HAS_ARGON2
+class Argon2Kdf : public Kdf
+{
+public:
+    Argon2Kdf()
+        : Kdf(Argon2id)
+        , _iterations(1)
+        , _memory(MIN_ARGON2_MEMORY_KIB)
+        , _lanes(ARGON2_LANES)
+    {
+    }
+
+    QVariantMap parameters() const override
+    {
+        QVariantMap result;
+        result.insert(PARAMETER_ALGORITHM, ALGORITHM_NAMES[algorithm()]);
+        result.insert(PARAMETER_ITERATIONS, _iterations);
+        result.insert(PARAMETER_MEMORY, _memory);
+        result.insert(PARAMETER_LANES, _lanes);
+        return result;
+    }
+
+    QByteArray derive(const QString &password, const QByteArray &salt, int size) const override
+    {
+        EVP_KDF *kdf = EVP_KDF_fetch(NULL, "ARGON2ID", NULL);
+        EVP_KDF_CTX *ctx = kdf ? EVP_KDF_CTX_new(kdf) : NULL;
+        EVP_KDF_free(kdf);
+        if (!ctx) {
+            qDebug() << "Failed to derive key with" << ALGORITHM_NAMES[algorithm()];
+            return QByteArray();
+        }
+
+        QByteArray passwordData = password.toUtf8();
+        QByteArray saltData = salt;
+        QByteArray key(size, '\0');
+        uint32_t iterations = _iterations;
+        uint32_t memory = _memory;
+        uint32_t lanes = _lanes;
+        uint32_t threads = 1;
+
+        OSSL_PARAM parameters[] = {
+            OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_PASSWORD, passwordData.data(), passwordData.size()),
+            OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_SALT, saltData.data(), saltData.size()),
+            OSSL_PARAM_construct_uint32(OSSL_KDF_PARAM_ITER, &iterations),
+            OSSL_PARAM_construct_uint32(OSSL_KDF_PARAM_ARGON2_MEMCOST, &memory),
+            OSSL_PARAM_construct_uint32(OSSL_KDF_PARAM_ARGON2_LANES, &lanes),
+            OSSL_PARAM_construct_uint32(OSSL_KDF_PARAM_THREADS, &threads),
+            OSSL_PARAM_construct_end()
+        };
+
+        const bool derived = EVP_KDF_derive(ctx, reinterpret_cast<unsigned char*>(key.data()), key.size(), parameters) == 1;
+        EVP_KDF_CTX_free(ctx);
+        OPENSSL_cleanse(passwordData.data(), passwordData.size());
+
+        if (!derived) {
+            qDebug() << "Failed to derive key with" << ALGORITHM_NAMES[algorithm()];
+            return QByteArray();
+        }
+
+        return key;
+    }
+
+    void calibrate(qint64 targetMillis) override
+    {
+        // memory is the main cost, it is lowered only if a single pass is too slow,
+        // the remaining time is spent on more passes over the memory.
+        _iterations = 1;
+        _memory = ARGON2_MEMORY_KIB;
+        qint64 nanoseconds = benchmark();
+        while (nanoseconds > targetMillis * 1000000 && _memory > MIN_ARGON2_MEMORY_KIB) {
+            _memory /= 2;
+            nanoseconds = benchmark();
+        }
+
+        _iterations = quint32(qBound<qint64>(1, targetMillis * 1000000 / nanoseconds, 1000));
+    }
+
+protected:
+    bool setParameters(const QVariantMap &parameters) override
+    {
+        const quint32 iterations = parameters.value(PARAMETER_ITERATIONS).toUInt();
+        const quint32 memory = parameters.value(PARAMETER_MEMORY).toUInt();
+        const quint32 lanes = parameters.value(PARAMETER_LANES).toUInt();
+        if (iterations == 0 || lanes == 0 || memory < 8 * lanes || memory > MAX_ARGON2_MEMORY_KIB) {
+            return false;
+        }
+
+        _iterations = iterations;
+        _memory = memory;
+        _lanes = lanes;
+        return true;
+    }
+
+private:
+    quint32 _iterations;
+    quint32 _memory;
+    quint32 _lanes;
+};
+#endif
+
+const qint64 Kdf::DefaultTargetMillis = 50;
+
+Kdf::Kdf(Algorithm algorithm)
+    : _algorithm(algorithm)
+{
+}
+
+Kdf::~Kdf()
+{
+}
+
+Kdf *Kdf::create(Algorithm algorithm)
+{
+    switch (algorithm) {
+    case Pbkdf2Sha1:
+    case Pbkdf2Sha256:
+    case Pbkdf2Sha512:
+        return new Pbkdf2Kdf(algorithm);
+    case Scrypt:
+#ifdef QVAULT_HAS_SCRYPT
+        return new ScryptKdf();
+#else
+        break;
+#endif
+    case Argon2id:
+#ifdef QVAULT_HAS_ARGON2
+    {
+        // the algorithm may still be missing from the loaded providers
+        EVP_KDF *kdf = EVP_KDF_fetch(NULL, "ARGON2ID", NULL);
+        if (kdf) {
+            EVP_KDF_free(kdf);
+            return new Argon2Kdf();
+        }
+    }
+#endif
+        break;
+    }
+
+    return nullptr;
+}
+
+Kdf *Kdf::create(const QVariantMap &parameters)
+{
+    const QString name = parameters.value(PARAMETER_ALGORITHM).toString();
+
+    for (int algorithm = Pbkdf2Sha1; algorithm <= Argon2id; ++algorithm) {
+        if (name != QLatin1String(ALGORITHM_NAMES[algorithm])) {
+            continue;
+        }
+
+        QScopedPointer<Kdf> kdf(create(Algorithm(algorithm)));
+        if (!kdf) {
+            qDebug() << "KDF is not supported by OpenSSL" << name;
+            return nullptr;
+        }
+
+        if (!kdf->setParameters(parameters)) {
+            qDebug() << "KDF parameters are invalid" << name;
+            return nullptr;
+        }
+
+        return kdf.take();
+    }
+
+    qDebug() << "KDF is unknown" << name;
+    return nullptr;
+}
+
+QVariantMap Kdf::legacyParameters(int iterations)
+{
+    QVariantMap result;
+    result.insert(PARAMETER_ALGORITHM, ALGORITHM_NAMES[Pbkdf2Sha1]);
+    result.insert(PARAMETER_ITERATIONS, iterations);
+    return result;
+}
+
+QVariantMap Kdf::calibratedParameters(Algorithm algorithm, qint64 targetMillis)
+{
+    // calibration is serialized, so concurrent callers neither repeat it
+    // nor slow down each other's measurements.
+    static QMutex mutex;
+    static QHash<QPair<int, qint64>, QVariantMap> cache;
+
+    QMutexLocker locker(&mutex);
+
+    const QPair<int, qint64> key(algorithm, targetMillis);
+    const auto cached = cache.constFind(key);
+    if (cached != cache.constEnd()) {
+        return cached.value();
+    }
+
+    QScopedPointer<Kdf> kdf(create(algorithm));
+    if (!kdf) {
+        qDebug() << "KDF is not supported by OpenSSL" << ALGORITHM_NAMES[algorithm];
+        return QVariantMap();
+    }
+
+    kdf->calibrate(targetMillis);
+    const QVariantMap parameters = kdf->parameters();
+    cache.insert(key, parameters);
+
+    return parameters;
+}
+
+bool Kdf::isSupported(Algorithm algorithm)
+{
+    return !QScopedPointer<Kdf>(create(algorithm)).isNull();
+}
+
+Kdf::Algorithm Kdf::defaultAlgorithm()
+{
+    if (isSupported(Argon2id)) {
+        return Argon2id;
+    }
+
+    if (isSupported(Scrypt)) {
+        return Scrypt;
+    }
+
+    return Pbkdf2Sha256;
+}
+
+Kdf::Algorithm Kdf::algorithm() const
+{
+    return _algorithm;
+}
+
+qint64 Kdf::benchmark() const
+{
+    const QByteArray salt(BENCHMARK_SALT_SIZE, '\0');
+
+    // the first derivation warms up caches and allocations and is not counted,
+    // the median of the others is robust to preemption and frequency changes.
+    derive(BENCHMARK_PASSWORD, salt, BENCHMARK_KEY_SIZE);
+
+    QVector<qint64> samples;
+    QElapsedTimer timer;
+    for (int i = 0; i < CALIBRATION_SAMPLES; ++i) {
+        timer.start();
+        derive(BENCHMARK_PASSWORD, salt, BENCHMARK_KEY_SIZE);
+        samples.append(timer.nsecsElapsed());
+    }
+
+    std::nth_element(samples.begin(), samples.begin() + samples.size() / 2, samples.end());
+
+    // a zero measurement on a coarse clock must not be divided by
+    return qMax<qint64>(1, samples.at(samples.size() / 2));
+}
@@ -0,0 +1,103 @@
+#ifndef KDF_H
+#define KDF_H
+
+#include <QByteArray>
+#include <QString>
+#include <QVariantMap>
+
+/**
+ * @brief Kdf derives vault keys from the password.
+ * @details
+ * An algorithm and its cost are described by parameters stored in the vault
+ * header, so vaults created with different algorithms can be unlocked by the
+ * same code. calibrate() tunes the cost so a derivation takes about the given
+ * time on this machine; each algorithm has its own way to spend that time.
+ * calibratedParameters() caches calibration results for the process, so
+ * creating many vaults pays for calibration once.
+ */
+class Kdf
+{
+public:
+    enum Algorithm {
+        Pbkdf2Sha1,
+        Pbkdf2Sha256,
+        Pbkdf2Sha512,
+        Scrypt,
+        Argon2id
+    };
+
+    /**
+     * @brief Time a key derivation takes with calibrated parameters by default.
+     */
+    static const qint64 DefaultTargetMillis;
+
+    virtual ~Kdf();
+
+    /**
+     * @brief Creates a KDF with the minimal cost, use calibrate() to tune it.
+     * @return nullptr if the algorithm is not provided by OpenSSL.
+     */
+    static Kdf *create(Algorithm algorithm);
+
+    /**
+     * @brief Creates a KDF from parameters stored in a vault header.
+     * @return nullptr if the algorithm is unknown or parameters are out of range.
+     */
+    static Kdf *create(const QVariantMap &parameters);
+
+    /**
+     * @brief Gets parameters of vaults created before the KDF became configurable.
+     */
+    static QVariantMap legacyParameters(int iterations);
+
+    /**
+     * @brief Gets parameters calibrated to the target time on this machine.
+     * @return empty map if the algorithm is not provided by OpenSSL.
+     * @note The algorithm is calibrated once per process and target time,
+     *       later calls return the same parameters.
+     */
+    static QVariantMap calibratedParameters(Algorithm algorithm, qint64 targetMillis = DefaultTargetMillis);
+
+    static bool isSupported(Algorithm algorithm);
+
+    /**
+     * @brief Gets the strongest algorithm provided by OpenSSL.
+     */
+    static Algorithm defaultAlgorithm();
+
+    Algorithm algorithm() const;
+
+    /**
+     * @brief Gets the algorithm and cost parameters to store in the vault header.
+     */
+    virtual QVariantMap parameters() const = 0;
+
+    /**
+     * @brief Derives a key from the password.
+     * @return empty array if the key cannot be derived.
+     */
+    virtual QByteArray derive(const QString &password, const QByteArray &salt, int size) const = 0;
+
+    /**
+     * @brief Sets the cost so a derivation takes about the target time.
+     */
+    virtual void calibrate(qint64 targetMillis) = 0;
+
+protected:
+    explicit Kdf(Algorithm algorithm);
+
+    virtual bool setParameters(const QVariantMap &parameters) = 0;
+
+    /**
+     * @brief Measures a derivation with the current cost in nanoseconds.
+     * @return median of several samples, at least 1.
+     */
+    qint64 benchmark() const;
+
+private:
+    Q_DISABLE_COPY(Kdf)
+
+    const Algorithm _algorithm;
+};
+
+#endif // KDF_H
@@ -0,0 +1,144 @@
+#include "MerkleTree.h"
+
+#include <QtConcurrent>
+#include <QtEndian>
+
+#include <cstring>
+
+#include <openssl/evp.h>
+
+const int MerkleTree::HashSize = 32;
+
+const unsigned char LEAF_PREFIX = 0;
+const unsigned char NODE_PREFIX = 1;
+// smaller levels are hashed on the calling thread, the pool would cost more than it saves
+const int MIN_PARALLEL_NODES = 4096;
+
+typedef const unsigned char* cpbytes;
+
+// calls hash(ctx, begin, end) over [0, count) in chunks, each one with its own digest context
+template <typename Hash>
+static bool hashChunks(int count, const Hash &hash)
+{
+    const auto hashChunk = [&hash](int begin, int end) {
+        EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+        const bool hashed = ctx && hash(ctx, begin, end);
+        EVP_MD_CTX_free(ctx);
+        return hashed;
+    };
+
+    if (count < MIN_PARALLEL_NODES) {
+        return hashChunk(0, count);
+    }
+
+    const int chunkSize = count / (QThread::idealThreadCount() * 4) + 1;
+    QList<QFuture<bool>> futures;
+    for (int begin = 0; begin < count; begin += chunkSize) {
+        const int end = qMin(count, begin + chunkSize);
+        futures.append(QtConcurrent::run([&hashChunk, begin, end]() {
+            return hashChunk(begin, end);
+        }));
+    }
+
+    bool hashed = true;
+    for (QFuture<bool> &future : futures) {
+        hashed = future.result() && hashed;
+    }
+
+    return hashed;
+}
+
+static bool hashLeaf(EVP_MD_CTX *ctx, const VaultSnapshot::Record &record, unsigned char *leaf)
+{
+    // the key size separates the key from the value
+    unsigned char keySize[sizeof(quint32)];
+    qToBigEndian<quint32>(quint32(record.first.size()), keySize);
+
+    return 1 == EVP_DigestInit_ex(ctx, EVP_sha256(), NULL) &&
+            1 == EVP_DigestUpdate(ctx, &LEAF_PREFIX, sizeof(LEAF_PREFIX)) &&
+            1 == EVP_DigestUpdate(ctx, keySize, sizeof(keySize)) &&
+            1 == EVP_DigestUpdate(ctx, (cpbytes)record.first.constData(), size_t(record.first.size())) &&
+            1 == EVP_DigestUpdate(ctx, (cpbytes)record.second.constData(), size_t(record.second.size())) &&
+            1 == EVP_DigestFinal_ex(ctx, leaf, NULL);
+}
+
+QByteArray MerkleTree::root(const QVector<VaultSnapshot::Record> &records)
+{
+    QByteArray leaves(records.size() * HashSize, '\0');
+    unsigned char *data = reinterpret_cast<unsigned char*>(leaves.data());
+
+    const bool hashed = hashChunks(records.size(), [&records, data](EVP_MD_CTX *ctx, int begin, int end) {
+        for (int i = begin; i < end; ++i) {
+            if (!hashLeaf(ctx, records.at(i), data + i * HashSize)) {
+                return false;
+            }
+        }
+        return true;
+    });
+
+    return hashed ? reduce(leaves, records.size()) : QByteArray();
+}
+
+QByteArray MerkleTree::root(const VaultSnapshot &snapshot)
+{
+    const int count = int(snapshot.count());
+    QByteArray leaves(count * HashSize, '\0');
+    unsigned char *data = reinterpret_cast<unsigned char*>(leaves.data());
+
+    const bool hashed = hashChunks(count, [&snapshot, data](EVP_MD_CTX *ctx, int begin, int end) {
+        for (int i = begin; i < end; ++i) {
+            if (!hashLeaf(ctx, snapshot.record(quint32(i)), data + i * HashSize)) {
+                return false;
+            }
+        }
+        return true;
+    });
+
+    return hashed ? reduce(leaves, count) : QByteArray();
+}
+
+QByteArray MerkleTree::reduce(const QByteArray &leaves, int count)
+{
+    // the root of no records is the hash of nothing
+    if (count == 0) {
+        QByteArray empty(HashSize, '\0');
+        if (1 != EVP_Digest(NULL, 0, reinterpret_cast<unsigned char*>(empty.data()), NULL, EVP_sha256(), NULL)) {
+            return QByteArray();
+        }
+        return empty;
+    }
+
+    // every level is hashed from the one below until a single node is left
+    QByteArray level = leaves;
+    while (count > 1) {
+        const int parents = (count + 1) / 2;
+        QByteArray next(parents * HashSize, '\0');
+        const unsigned char *children = reinterpret_cast<const unsigned char*>(level.constData());
+        unsigned char *data = reinterpret_cast<unsigned char*>(next.data());
+
+        const bool hashed = hashChunks(count / 2, [children, data](EVP_MD_CTX *ctx, int begin, int end) {
+            for (int i = begin; i < end; ++i) {
+                if (1 != EVP_DigestInit_ex(ctx, EVP_sha256(), NULL) ||
+                        1 != EVP_DigestUpdate(ctx, &NODE_PREFIX, sizeof(NODE_PREFIX)) ||
+                        1 != EVP_DigestUpdate(ctx, children + 2 * i * HashSize, 2 * HashSize) ||
+                        1 != EVP_DigestFinal_ex(ctx, data + i * HashSize, NULL)) {
+                    return false;
+                }
+            }
+            return true;
+        });
+
+        if (!hashed) {
+            return QByteArray();
+        }
+
+        if (count % 2 != 0) {
+            memcpy(data + (parents - 1) * HashSize, children + (count - 1) * HashSize, HashSize);
+        }
+
+        level = next;
+        count = parents;
+    }
+
+    return level;
+}
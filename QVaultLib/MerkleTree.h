@@ -0,0 +1,46 @@
+#ifndef MERKLETREE_H
+#define MERKLETREE_H
+
+#include <VaultSnapshot.h>
+
+#include <QByteArray>
+#include <QVector>
+
+/**
+ * @brief MerkleTree computes root hashes of Merkle trees over vault records.
+ * @details
+ * Leaves are SHA-256 hashes of the encrypted key and value of each record,
+ * in the order of the offset table, and every inner node hashes its two
+ * children. A node without a sibling is carried to the next level as it is.
+ * Leaves and inner nodes are hashed with different prefixes, so an inner
+ * node cannot pass for a record.
+ *
+ * Roots are kept in the vault header, which is authenticated, so the hashes
+ * need no key: a record that is modified, removed, added or replaced with an
+ * older one changes the root. Large trees are hashed by the thread pool.
+ */
+class MerkleTree
+{
+public:
+    /**
+     * @brief Size of a root in bytes.
+     */
+    static const int HashSize;
+
+    /**
+     * @brief Computes the root over records sorted with VaultSnapshot::lessThan().
+     * @return empty array on failure.
+     */
+    static QByteArray root(const QVector<VaultSnapshot::Record> &records);
+
+    /**
+     * @brief Computes the root over records of an open snapshot.
+     * @return empty array on failure.
+     */
+    static QByteArray root(const VaultSnapshot &snapshot);
+
+private:
+    static QByteArray reduce(const QByteArray &leaves, int count);
+};
+
+#endif // MERKLETREE_H
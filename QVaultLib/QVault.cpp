@@ -1,32 +1,109 @@
 #include <CryptoContext.h>
 #include <AesCipher.h>
+#include <AeadCipher.h>
+#include <Hmac.h>
+#include <VaultSession.h>
+#include <ValueCodec.h>
+#include <VaultBlob.h>
+#include <VaultShards.h>
+#include <MerkleTree.h>
 #include "QVault.h"
 
+#include <QDir>
 #include <QFile>
+#include <QFileInfo>
+#include <QLockFile>
+#include <QSaveFile>
 #include <QDebug>
 #include <QElapsedTimer>
 #include <QDataStream>
+#include <QMutexLocker>
+#include <QReadLocker>
+#include <QWriteLocker>
+#include <QThread>
+#include <QtConcurrent>
+#include <QtEndian>
+
+#include <algorithm>
+#include <cstring>
 
 #include <openssl/rand.h>
 #include <openssl/hmac.h>
 
-const int MIN_ITERATIONS = 100;
-const int BENCHMARK_ITERATIONS = 1000;
-const quint64 TARGET_TIME_MILLIS = 50;
+#if defined(Q_OS_UNIX)
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 const int AES_KEY_SIZE = 16;
 const int IV_SIZE = 16;
 const int SALT_SIZE = 16;
 const int HMAC_KEY_SIZE = 32;
+const int SECRET_KEY_SIZE = AES_KEY_SIZE + IV_SIZE + HMAC_KEY_SIZE;
+const int KEK_SIZE = 32;
+const int EPOCH_SIZE = 16;
+const qint64 MIN_COMPACTION_SIZE = 64 * 1024;
+const int MIN_REENCRYPTION_CHUNK = 256;
+const int LOCK_TIMEOUT_MILLIS = 10000;
+
+const char HEADER_SALT[] = "salt";
+const char HEADER_ITERATIONS[] = "iterations";
+const char HEADER_KDF[] = "kdf";
+const char HEADER_EPOCH[] = "epoch";
+const char HEADER_GENERATION[] = "generation";
+const char HEADER_KEY_SLOTS[] = "keySlots";
+const char SLOT_KEY[] = "key";
+const char HEADER_CIPHER[] = "cipher";
+const char HEADER_SHARDS[] = "shards";
+const char HEADER_ROOTS[] = "roots";
+const char HEADER_KEY_MAC[] = "keyMac";
+// record keys are HMACs under a key derived from the MAC key
+const char KEY_MAC_HKDF[] = "hkdf-sha256";
+
+// indexed by QVault::CipherSuite
+const char *const CIPHER_SUITE_NAMES[] = { "aes-256-cbc", "aes-256-gcm", "chacha20-poly1305" };
 
 QVault::QVault(const QString &filepath, QObject *parent)
     : QObject(parent)
     , _filepath(filepath)
     , _locked(true)
+    , _shardCount(1)
+    , _cleared(false)
+    , _snapshotSize(0)
+    , _generation(0)
+    , _inTransaction(false)
+    , _transactionCleared(false)
+    , _syncPolicy(NoSync)
+    , _syncInterval(0)
+    , _compression(false)
+    , _writerScheduled(false)
+    , _cipherSuite(AesCbc)
+    , _keysBuilt(false)
 {
     Q_ASSERT(QFile(filepath).exists());
+
+    // a single writer thread keeps asynchronous writes in order
+    _writer.setMaxThreadCount(1);
+
+    _syncTimer.setSingleShot(true);
+    connect(&_syncTimer, &QTimer::timeout, this, [this]() {
+        QWriteLocker locker(&_lock);
+        flushJournal();
+    });
+}
+
+QVault::~QVault()
+{
+    lock();
+    _writer.waitForDone();
+}
+
+bool QVault::create(const QString &filepath, const QString &password, Kdf::Algorithm algorithm, CipherSuite suite)
+{
+    return create(filepath, password, Kdf::calibratedParameters(algorithm), suite);
 }
 
-bool QVault::create(const QString &filepath, const QString &password)
+bool QVault::create(const QString &filepath, const QString &password, const QVariantMap &kdf, CipherSuite suite)
 {
     QFile vault(filepath);
 
@@ -40,81 +117,315 @@ bool QVault::create(const QString &filepath, const QString &password)
         return false;
     }
 
-    QByteArray salt = rand(SALT_SIZE);
-    int iterations = estimateIterations(password, salt);
-    QByteArray secretKey = generateSecretKey(password, iterations, salt);
-    QByteArray macKey = secretKey.mid(AES_KEY_SIZE + IV_SIZE, HMAC_KEY_SIZE);
+    SecureArena::Buffer secretKey(SECRET_KEY_SIZE);
+    const QVariantMap keySlot = randomSecretKey(&secretKey)
+            ? wrapSecretKey(password, kdf, secretKey.view(0, SECRET_KEY_SIZE))
+            : QVariantMap();
+    if (keySlot.isEmpty()) {
+        qDebug() << "Failed to create Vault because keys cannot be derived";
+        return false;
+    }
+    const QByteArray macKey = secretKey.view(AES_KEY_SIZE + IV_SIZE, HMAC_KEY_SIZE);
+    const QList<QByteArray> roots = QList<QByteArray>() << MerkleTree::root(QVector<VaultSnapshot::Record>());
+    QByteArray header = headerData(QVariantList() << keySlot, suite, rand(EPOCH_SIZE), 0, QStringList(), roots, true);
 
-    QByteArray vaultData;
-    QDataStream out(&vaultData, QIODevice::WriteOnly);
-    out << salt
-        << iterations
-        << generateHmac(macKey, secretKey)
-        << Records();
+    // a stale journal of a removed vault must never be replayed
+    QFile::remove(VaultJournal::journalPath(filepath));
 
-    if (!vault.open(QFile::WriteOnly)) {
+    QSaveFile newVault(filepath);
+    if (!newVault.open(QFile::WriteOnly)) {
         qDebug() << "Failed to open vault file for write" << filepath;
         return false;
     }
-    vault.write(vaultData);
-    vault.close();
+    VaultSnapshot::write(&newVault, header, generateHmac(macKey, header), QVector<VaultSnapshot::Record>());
+    secretKey.wipe();
+
+    if (!newVault.commit()) {
+        qDebug() << "Failed to write vault file" << filepath;
+        return false;
+    }
 
     return true;
 }
 
-bool QVault::changePassword(const QString &newPassword)
+bool QVault::changePassword(const QString &newPassword, Kdf::Algorithm algorithm)
 {
-    QByteArray salt = rand(SALT_SIZE);
-    int iterations = estimateIterations(newPassword, salt);
-    QByteArray secretKey = generateSecretKey(newPassword, iterations, salt);
-    QByteArray aesKey = secretKey.left(AES_KEY_SIZE);
-    QByteArray iv = secretKey.mid(AES_KEY_SIZE, IV_SIZE);
-    QByteArray macKey = secretKey.mid(AES_KEY_SIZE + IV_SIZE, HMAC_KEY_SIZE);
+    return changePassword(newPassword, Kdf::calibratedParameters(algorithm));
+}
 
-    _context.reset(new CryptoContext(aesKey, iv, macKey, salt, iterations));
-    _cipher.reset(new AesCipher(_context->aesKey(), _context->iv()));
+bool QVault::changePassword(const QString &newPassword, const QVariantMap &kdf)
+{
+    const VaultMetrics::Scope scope(_metrics.load(), VaultMetrics::ChangePassword);
 
-    return save();
+    QWriteLocker locker(&_lock);
+
+    QLockFile fileLock(lockPath(_filepath));
+    if (!prepareKeyChange(&fileLock)) {
+        return false;
+    }
+
+    // the key of older vaults is derived from the password itself,
+    // so it has to be replaced by a data key first, see rotateDataKey().
+    if (!hasDataKey(_context->keySlot())) {
+        const bool replaced = replaceDataKey(newPassword, kdf);
+        _reencryptionAborted.storeRelease(0);
+        return replaced;
+    }
+
+    const int index = _keySlots.indexOf(_context->keySlot());
+    if (index < 0) {
+        qDebug() << "Cannot change password, it has been removed from the vault.";
+        return false;
+    }
+
+    const QVariantMap keySlot = wrapSecretKey(newPassword, kdf, _context->secretKey());
+    if (keySlot.isEmpty()) {
+        qDebug() << "Cannot change password, keys cannot be derived.";
+        return false;
+    }
+
+    QVariantList keySlots = _keySlots;
+    keySlots.replace(index, keySlot);
+
+    return saveKeySlots(keySlots, keySlot);
+}
+
+bool QVault::addPassword(const QString &password, Kdf::Algorithm algorithm)
+{
+    return addPassword(password, Kdf::calibratedParameters(algorithm));
+}
+
+bool QVault::addPassword(const QString &password, const QVariantMap &kdf)
+{
+    const VaultMetrics::Scope scope(_metrics.load(), VaultMetrics::AddPassword);
+
+    QWriteLocker locker(&_lock);
+
+    QLockFile fileLock(lockPath(_filepath));
+    if (!prepareKeyChange(&fileLock)) {
+        return false;
+    }
+
+    if (!hasDataKey(_context->keySlot())) {
+        qDebug() << "Cannot add password, the vault has no data key. Change its password first.";
+        return false;
+    }
+
+    if (password.isEmpty()) {
+        qDebug() << "Cannot add password, password is empty.";
+        return false;
+    }
+
+    const QVariantMap keySlot = wrapSecretKey(password, kdf, _context->secretKey());
+    if (keySlot.isEmpty()) {
+        qDebug() << "Cannot add password, keys cannot be derived.";
+        return false;
+    }
+
+    return saveKeySlots(QVariantList(_keySlots) << keySlot, _context->keySlot());
+}
+
+bool QVault::removePassword(const QString &password)
+{
+    const VaultMetrics::Scope scope(_metrics.load(), VaultMetrics::RemovePassword);
+
+    QWriteLocker locker(&_lock);
+
+    QLockFile fileLock(lockPath(_filepath));
+    if (!prepareKeyChange(&fileLock)) {
+        return false;
+    }
+
+    if (_keySlots.size() < 2) {
+        qDebug() << "Cannot remove the only password of the vault.";
+        return false;
+    }
+
+    const QByteArray secretKey = _context->secretKey();
+    for (int i = 0; i < _keySlots.size(); ++i) {
+        QByteArray unwrapped = unwrapSecretKey(password, _keySlots.at(i).toMap());
+        const bool found = unwrapped == secretKey;
+        unwrapped.fill('\0');
+
+        if (found) {
+            QVariantList keySlots = _keySlots;
+            keySlots.removeAt(i);
+            return saveKeySlots(keySlots, _context->keySlot());
+        }
+    }
+
+    qDebug() << "Cannot remove password, no such password.";
+    return false;
+}
+
+bool QVault::rotateDataKey(const QString &password, Kdf::Algorithm algorithm)
+{
+    return rotateDataKey(password, Kdf::calibratedParameters(algorithm));
+}
+
+bool QVault::rotateDataKey(const QString &password, const QVariantMap &kdf)
+{
+    const VaultMetrics::Scope scope(_metrics.load(), VaultMetrics::RotateDataKey);
+
+    QWriteLocker locker(&_lock);
+
+    QLockFile fileLock(lockPath(_filepath));
+    if (!prepareKeyChange(&fileLock)) {
+        return false;
+    }
+
+    // an abort is consumed by the re-encryption it applies to, whether it
+    // came during the re-encryption or before it started
+    const bool replaced = replaceDataKey(password, kdf);
+    _reencryptionAborted.storeRelease(0);
+
+    return replaced;
+}
+
+void QVault::abortReencryption()
+{
+    _reencryptionAborted.storeRelease(1);
 }
 
 bool QVault::unlock(const QString &password)
 {
+    return unlock(password, nullptr);
+}
+
+bool QVault::unlock(VaultSession *session)
+{
+    Q_ASSERT(session);
+
+    if (!session->isValid()) {
+        qDebug() << "Cannot unlock vault. Session has expired.";
+        return false;
+    }
+
+    return unlock(QString(), session);
+}
+
+bool QVault::startSession(VaultSession *session) const
+{
+    Q_ASSERT(session);
+
+    QReadLocker locker(&_lock);
+
+    if (_locked) {
+        qDebug() << "Cannot start session in locked state.";
+        return false;
+    }
+
+    session->seal(QFileInfo(_filepath).absoluteFilePath(), *_context);
+
+    return true;
+}
+
+bool QVault::unlock(const QString &password, VaultSession *session)
+{
+    const VaultMetrics::Scope scope(_metrics.load(), VaultMetrics::Unlock);
+
+    QWriteLocker locker(&_lock);
+
     if (!_locked) {
         return true;
     }
 
-    QFile vault(_filepath);
-    if (!vault.open(QFile::ReadOnly)) {
-        qDebug() << "Failed to open vault file to read" << _filepath;
+    // other processes must not write while the vault and journal are read,
+    // vaults in read-only locations are read without locking.
+    QLockFile fileLock(lockPath(_filepath));
+    if (!fileLock.tryLock(LOCK_TIMEOUT_MILLIS) && fileLock.error() != QLockFile::PermissionError) {
+        qDebug() << "Cannot unlock vault. Vault file is locked by another process.";
         return false;
     }
-    QByteArray vaultData = vault.readAll();
-    vault.close();
 
-    QDataStream in(vaultData);
-    QByteArray salt, mac;
-    int iterations;
-    in >> salt >> iterations >> mac;
+    // only the prefix of the vault file is read here, records are decrypted on demand.
+    QScopedPointer<VaultSnapshot> snapshot(new VaultSnapshot(_filepath));
+    if (!snapshot->open()) {
+        qDebug() << "Cannot unlock vault. Vault file is corrupted.";
+        return false;
+    }
 
-    QByteArray secretKey = generateSecretKey(password, iterations, salt);
-    if (secretKey.size() == 0) {
+    if (snapshot->version() == 1) {
+        return unlockLegacy(snapshot->data(), password, session);
+    }
+
+    const QByteArray header = snapshot->header();
+    QVariantMap properties;
+    QDataStream headerIn(header);
+    headerIn >> properties;
+
+    const QVariantList keySlots = headerKeySlots(properties);
+    const QByteArray epoch = properties.value(HEADER_EPOCH).toByteArray();
+    const quint64 generation = properties.value(HEADER_GENERATION).toULongLong();
+
+    CipherSuite suite;
+    if (!headerCipherSuite(properties, &suite)) {
+        qDebug() << "Cannot unlock vault. Cipher suite is not supported.";
+        return false;
+    }
+
+    QVariantMap keySlot;
+    SecureArena::Buffer secretKey(SECRET_KEY_SIZE);
+    if (!deriveSecretKey(password, session, keySlots, &keySlot, &secretKey) || epoch.isEmpty()) {
         qDebug() << "Cannot unlock vault. Check password and vault file integrity.";
         return false;
     }
 
-    if (mac != generateHmac(secretKey.right(HMAC_KEY_SIZE), secretKey)) {
+    if (snapshot->headerMac() != generateHmac(secretKey.view(AES_KEY_SIZE + IV_SIZE, HMAC_KEY_SIZE), header)) {
         qDebug() << "Cannot unlock vault. Check password and vault file integrity.";
         return false;
     }
 
-    _context.reset(new CryptoContext(secretKey.left(AES_KEY_SIZE),
-                                     secretKey.mid(AES_KEY_SIZE, IV_SIZE),
-                                     secretKey.right(HMAC_KEY_SIZE),
-                                     salt,
-                                     iterations));
-    _cipher.reset(new AesCipher(_context->aesKey(), _context->iv()));
+    const qint64 snapshotSize = snapshot->size();
+    Records records;
 
-    in >> _records;
+    if (snapshot->version() < VaultSnapshot::Version) {
+        // records of the previous format cannot be mapped, they are loaded
+        // as changes on top of an empty snapshot until the next compaction.
+        QDataStream in(snapshot->legacyRecords());
+        in >> records;
+        if (in.status() != QDataStream::Ok) {
+            qDebug() << "Cannot unlock vault. Vault file is corrupted.";
+            return false;
+        }
+        snapshot.reset();
+    }
+
+    setContext(new CryptoContext(secretKey.view(0, AES_KEY_SIZE),
+                                 secretKey.view(AES_KEY_SIZE, IV_SIZE),
+                                 secretKey.view(AES_KEY_SIZE + IV_SIZE, HMAC_KEY_SIZE),
+                                 keySlot,
+                                 headerSeparateKeyMac(properties)),
+               suite);
+    secretKey.wipe();
+    _journal.reset(new VaultJournal(VaultJournal::journalPath(_filepath), _context->macKey(), epoch));
+
+    QList<VaultJournal::Batch> batches;
+    if (!_journal->replay(&batches)) {
+        wipe();
+        return false;
+    }
+
+    QScopedPointer<VaultShards> shards;
+    if (!openShards(properties, &shards)) {
+        qDebug() << "Cannot unlock vault. Shard files are missing or corrupted.";
+        wipe();
+        return false;
+    }
+
+    _snapshot.swap(snapshot);
+    _shards.swap(shards);
+    _shardCount = _shards ? _shards->count() : 1;
+    _roots = headerRoots(properties);
+    _snapshotSize = snapshotSize + (_shards ? _shards->size() : 0);
+    _records = records;
+    for (const VaultJournal::Batch &batch : batches) {
+        apply(batch);
+    }
+
+    _epoch = epoch;
+    _generation = generation;
+    _keySlots = keySlots;
     _locked = false;
 
     return true;
@@ -122,192 +433,2223 @@ bool QVault::unlock(const QString &password)
 
 void QVault::lock()
 {
+    QWriteLocker locker(&_lock);
+    wipe();
+}
+
+void QVault::wipe()
+{
+    if (_inTransaction) {
+        discardTransaction();
+    }
+    if (!_locked) {
+        persistPending(VaultJournal::Batch());
+    }
+    flushJournal();
+
     _locked = true;
-    _context.reset();
-    _cipher.reset();
+    setContext(nullptr, AesCbc);
+    _journal.reset();
+    _snapshot.reset();
+    _shards.reset();
+    _shardCount = 1;
+    _roots.clear();
     _records.clear();
+    _cleared = false;
+    _epoch.clear();
+    _generation = 0;
+    _keySlots.clear();
+    _snapshotSize = 0;
 }
 
 bool QVault::isLocked() const
 {
+    QReadLocker locker(&_lock);
     return _locked;
 }
 
+QVault::CipherSuite QVault::cipherSuite() const
+{
+    QReadLocker locker(&_lock);
+    return _cipherSuite;
+}
+
 QString QVault::filepath() const
 {
     return _filepath;
 }
 
-QVariant QVault::getValue(const QString &key, bool *ok)
+void QVault::setSyncPolicy(SyncPolicy policy, int intervalMillis)
 {
-    Q_ASSERT(ok);
-
-    if (_locked) {
-        qDebug() << "Cannot get values in locked state.";
-        *ok = false;
-        return QVariant();
-    }
-
-    QByteArray encryptedKey = _cipher->encrypt(key.toUtf8());
-    if (!_records.contains(encryptedKey)) {
-        qDebug() << "No such key found" << key;
-        *ok = false;
-        return QVariant();
-    }
+    Q_ASSERT(policy != GroupCommit || intervalMillis > 0);
 
-    QByteArray decryptedValue = _cipher->decrypt(_records.value(encryptedKey));
-    QVariant value = deserializeVariant(decryptedValue);
+    QWriteLocker locker(&_lock);
+    flushJournal();
 
-    *ok = true;
-    return value;
+    _syncPolicy = policy;
+    _syncInterval = intervalMillis;
 }
 
-bool QVault::setValue(const QString &key, const QVariant &value)
+QVault::SyncPolicy QVault::syncPolicy() const
 {
-    if (_locked) {
-        qDebug() << "Cannot set values in locked state.";
-        return false;
-    }
-
-    QByteArray encryptedKey = _cipher->encrypt(key.toUtf8());
-    QByteArray encryptedValue = _cipher->encrypt(serializeVariant(value));
+    QReadLocker locker(&_lock);
+    return _syncPolicy;
+}
 
-    _records[encryptedKey] = encryptedValue;
+void QVault::setCompression(bool enabled)
+{
+    QWriteLocker locker(&_lock);
+    _compression = enabled;
+}
 
-    return save();
+bool QVault::compression() const
+{
+    QReadLocker locker(&_lock);
+    return _compression;
 }
 
-bool QVault::removeValue(const QString &key)
+void QVault::setCacheBudget(int bytes)
 {
-    if (_locked) {
-        qDebug() << "Cannot get values in locked state.";
-        return false;
-    }
+    _cache.setBudget(bytes);
+}
 
-    QByteArray encryptedKey = _cipher->encrypt(key.toUtf8());
-    if (!_records.contains(encryptedKey)) {
-        return true;
-    }
+int QVault::cacheBudget() const
+{
+    return _cache.budget();
+}
 
-    _records.remove(encryptedKey);
+quint64 QVault::cacheHits() const
+{
+    return _cache.hits();
+}
 
-    return save();
+quint64 QVault::cacheMisses() const
+{
+    return _cache.misses();
 }
 
-bool QVault::clear()
+void QVault::setMetrics(VaultMetrics *metrics)
 {
-    if (_locked) {
-        qDebug() << "Cannot clear values in locked state.";
-        return false;
-    }
+    _metrics.storeRelease(metrics);
+}
 
-    _records.clear();
-    return save();
+VaultMetrics *QVault::metrics() const
+{
+    return _metrics.loadAcquire();
 }
 
-QByteArray QVault::rand(int size)
+bool QVault::setShardCount(int count)
 {
-    Q_ASSERT(size > 0);
+    const VaultMetrics::Scope scope(_metrics.load(), VaultMetrics::SetShardCount);
 
-    QByteArray buffer(size, '\0');
+    QWriteLocker locker(&_lock);
 
-    if (RAND_bytes(reinterpret_cast<unsigned char*>(buffer.data()), buffer.size()) != 1) {
-        qDebug() << "Failed to generate random bytes, size" << size;
+    if (count < 1 || count > VaultShards::MaxCount) {
+        qDebug() << "Cannot shard vault, number of shards is out of range" << count;
+        return false;
     }
 
-    return buffer;
-}
-
-int QVault::estimateIterations(const QString &password, const QByteArray &salt)
-{
-    QByteArray secretKey(AES_KEY_SIZE + IV_SIZE + HMAC_KEY_SIZE, '\0');
-    QElapsedTimer timer;
-    timer.start();
+    if (_locked) {
+        qDebug() << "Cannot shard vault in locked state.";
+        return false;
+    }
 
-    if (PKCS5_PBKDF2_HMAC_SHA1(
-                password.toUtf8().data(), password.size(),
-                reinterpret_cast<const unsigned char*>(salt.data()), salt.size(), BENCHMARK_ITERATIONS,
-                secretKey.size(), reinterpret_cast<unsigned char*>(secretKey.data())) != 1) {
-        qDebug() << "Failed to benchmark iterations.";
-        return MIN_ITERATIONS;
+    if (_inTransaction) {
+        qDebug() << "Cannot shard vault during a transaction.";
+        return false;
     }
 
-    const qint64 milliseconds = timer.elapsed();
-    const int iterations = (TARGET_TIME_MILLIS * BENCHMARK_ITERATIONS) / milliseconds;
-    if (iterations < MIN_ITERATIONS) {
-        return MIN_ITERATIONS;
+    // another process may have sharded the vault in the meantime
+    QLockFile fileLock(lockPath(_filepath));
+    if (!persistPending(VaultJournal::Batch()) ||
+            !lockVaultFile(&fileLock) ||
+            !refreshState(VaultJournal::Batch(), false)) {
+        return false;
     }
 
-    return iterations;
-}
+    if (count == _shardCount) {
+        return true;
+    }
 
-QByteArray QVault::generateHmac(const QByteArray &macKey, const QByteArray &secretKey)
-{
-    QByteArray result(HMAC_KEY_SIZE, '\0');
-    unsigned int length = HMAC_KEY_SIZE;
+    const int oldCount = _shardCount;
+    _shardCount = count;
 
-    HMAC(EVP_sha256(),
-         reinterpret_cast<const unsigned char*>(macKey.data()),
-         macKey.size(),
-         reinterpret_cast<const unsigned char*>(secretKey.data()),
-         secretKey.size(),
-         reinterpret_cast<unsigned char*>(result.data()),
-         &length);
+    if (!save()) {
+        if (!_locked) {
+            _shardCount = oldCount;
+        }
+        return false;
+    }
 
-    return result;
+    return true;
 }
 
-QByteArray QVault::serializeVariant(const QVariant &value)
+int QVault::shardCount() const
 {
-    QByteArray serialized;
-    QDataStream out(&serialized, QIODevice::WriteOnly);
-    out << value;
-    return serialized;
+    QReadLocker locker(&_lock);
+    return _shardCount;
 }
 
-QVariant QVault::deserializeVariant(const QByteArray &data)
+QVariant QVault::getValue(const QString &key, bool *ok)
 {
+    Q_ASSERT(ok);
+
+    const VaultMetrics::Scope scope(_metrics.load(), VaultMetrics::GetValue);
+
+    QReadLocker locker(&_lock);
+
+    if (_locked) {
+        qDebug() << "Cannot get values in locked state.";
+        *ok = false;
+        return QVariant();
+    }
+
+    CipherPool::Lease lease(_ciphers.data());
+
+    const QByteArray encryptedKey = recordKey(key, lease);
     QVariant value;
-    QDataStream in(data);
-    in >> value;
-    return value;
-}
+    if (_cache.value(encryptedKey, &value)) {
+        *ok = true;
+        return value;
+    }
 
-QByteArray QVault::generateSecretKey(const QString &password, int iterations, const QByteArray &salt)
-{
-    QByteArray secretKey(AES_KEY_SIZE + IV_SIZE + HMAC_KEY_SIZE, '\0');
+    QByteArray encryptedValue;
+    if (!findRecord(encryptedKey, &encryptedValue)) {
+        qDebug() << "No such key found" << key;
+        *ok = false;
+        return QVariant();
+    }
 
-    if (PKCS5_PBKDF2_HMAC_SHA1(
-                password.toUtf8().data(), password.size(),
-                (const unsigned char*)salt.data(), salt.size(),
-                iterations,
-                secretKey.size(), reinterpret_cast<unsigned char*>(secretKey.data())) != 1) {
-        qDebug() << "Failed to generate secret key.";
-        return QByteArray();
+    QByteArray decryptedValue = decryptValue(_cipherSuite, lease, encryptedKey, encryptedValue);
+    if (decryptedValue.isEmpty()) {
+        qDebug() << "Cannot decrypt value, vault record is corrupted" << key;
+        *ok = false;
+        return QVariant();
+    }
+    if (!ValueCodec::decode(decryptedValue, &value)) {
+        qDebug() << "Cannot decode value, vault record is corrupted" << key;
+        *ok = false;
+        return QVariant();
     }
+    _cache.insert(encryptedKey, decryptedValue.constData(), decryptedValue.size());
 
-    return secretKey;
+    *ok = true;
+    return value;
 }
 
-bool QVault::save() const
+bool QVault::readValue(const QString &key, QByteArray *value)
 {
-    QByteArray vaultData;
-    QDataStream out(&vaultData, QIODevice::WriteOnly);
-    out << _context->salt()
-        << _context->iterations()
-        << generateHmac(_context->macKey(), _context->secretKey())
-        << _records;
+    Q_ASSERT(value);
 
-    QFile vault(_filepath);
-    vault.remove();
+    const VaultMetrics::Scope scope(_metrics.load(), VaultMetrics::ReadValue);
 
-    if (!vault.open(QFile::WriteOnly)) {
-        qDebug() << "Failed to open vault file for write" << _filepath;
+    QReadLocker locker(&_lock);
+
+    if (_locked) {
+        qDebug() << "Cannot read values in locked state.";
         return false;
     }
-    vault.write(vaultData);
-    vault.close();
 
-    return true;
-}
+    // buffers of the calling thread are reused by every read, so reads
+    // allocate nothing once the buffers have grown to the size of values.
+    static thread_local QByteArray utf8Key;
+    static thread_local QByteArray digest;
+    static thread_local QByteArray record;
 
+    CipherPool::Lease lease(_ciphers.data());
+    toUtf8(key, &utf8Key);
+    const QByteArray encryptedKey = lease.keyMac()->digest(utf8Key, &digest)
+            ? recordKey(utf8Key, digest, lease)
+            : QByteArray();
+    utf8Key.fill('\0');
+
+    if (!encryptedKey.isEmpty() && _cache.bytes(encryptedKey, value)) {
+        return true;
+    }
+
+    const char *encryptedValue = nullptr;
+    int size = 0;
+    if (encryptedKey.isEmpty() || !findRecord(encryptedKey, &encryptedValue, &size)) {
+        qDebug() << "No such key found" << key;
+        return false;
+    }
+
+    int offset = 0;
+    bool success = decryptRecord(_cipherSuite, lease, encryptedKey, encryptedValue, size, &record, &offset);
+    if (!success) {
+        qDebug() << "Cannot decrypt value, vault record is corrupted" << key;
+    } else if (!ValueCodec::decodeBytes(record.constData() + offset, record.size() - offset, value)) {
+        qDebug() << "Value is not a byte array" << key;
+        success = false;
+    } else {
+        _cache.insert(encryptedKey, record.constData() + offset, record.size() - offset);
+    }
+    record.fill('\0');
+
+    return success;
+}
+
+bool QVault::writeStream(const QString &key, QIODevice *source)
+{
+    Q_ASSERT(source);
+
+    const VaultMetrics::Scope scope(_metrics.load(), VaultMetrics::WriteStream);
+
+    AeadCipher::Algorithm algorithm;
+    {
+        QReadLocker locker(&_lock);
+        if (!canWriteStream()) {
+            return false;
+        }
+        algorithm = aeadAlgorithm(_cipherSuite);
+    }
+
+    const QString blobs = blobsPath(_filepath);
+    if (!QDir().mkpath(blobs)) {
+        qDebug() << "Failed to create blobs directory" << blobs;
+        return false;
+    }
+
+    // blobs have their own keys, so they survive replacing the data key.
+    // The blob is written and synced without the lock, only the record
+    // referring to it is written exclusively.
+    VaultBlob blob(algorithm);
+    const QString path = QDir(blobs).filePath(blob.fileName());
+    if (!blob.isValid() || !blob.write(path, source)) {
+        return false;
+    }
+
+    QWriteLocker locker(&_lock);
+
+    // the vault may have been locked or a transaction started meanwhile
+    if (!canWriteStream()) {
+        QFile::remove(path);
+        return false;
+    }
+
+    // clear() deletes all blob files, including one written meanwhile
+    if (!QFile::exists(path)) {
+        qDebug() << "Blob file was deleted before its value was written" << path;
+        return false;
+    }
+
+    CipherPool::Lease lease(_ciphers.data());
+    const QByteArray encryptedKey = recordKey(key, lease);
+    VaultBlob previous;
+    const bool replaced = findBlob(lease, encryptedKey, &previous);
+
+    QByteArray reference = ValueCodec::encodeStream(blob.reference());
+    VaultJournal::Entry entry = { VaultJournal::Set,
+                                  encryptedKey,
+                                  encryptValue(_cipherSuite, lease, encryptedKey, key.toUtf8(), reference) };
+    reference.fill('\0');
+    VaultJournal::Batch batch;
+    batch.append(entry);
+
+    if (!write(batch)) {
+        QFile::remove(path);
+        return false;
+    }
+
+    if (replaced) {
+        removeBlob(previous);
+    }
+
+    return true;
+}
+
+bool QVault::canWriteStream() const
+{
+    if (_locked) {
+        qDebug() << "Cannot write streams in locked state.";
+        return false;
+    }
+
+    if (_inTransaction) {
+        qDebug() << "Cannot write streams during a transaction.";
+        return false;
+    }
+
+    return true;
+}
+
+bool QVault::readStream(const QString &key, QIODevice *output)
+{
+    Q_ASSERT(output);
+
+    const VaultMetrics::Scope scope(_metrics.load(), VaultMetrics::ReadStream);
+
+    QReadLocker locker(&_lock);
+
+    if (_locked) {
+        qDebug() << "Cannot read streams in locked state.";
+        return false;
+    }
+
+    VaultBlob blob;
+    {
+        CipherPool::Lease lease(_ciphers.data());
+        const QByteArray encryptedKey = recordKey(key, lease);
+        QByteArray encryptedValue;
+        if (!findRecord(encryptedKey, &encryptedValue)) {
+            qDebug() << "No such key found" << key;
+            return false;
+        }
+
+        if (!streamBlob(_cipherSuite, lease, encryptedKey, encryptedValue, &blob)) {
+            qDebug() << "Value is not a stream" << key;
+            return false;
+        }
+    }
+    const QString path = blobPath(blob);
+
+    // the blob is read without the lock, so a slow output does not stall writers
+    // or lock(). The local blob holds its own copy of the key, which its
+    // destructor zeroes. The read fails if the stream is replaced before the file is opened.
+    locker.unlock();
+    return blob.read(path, output);
+}
+
+bool QVault::contains(const QString &key)
+{
+    const VaultMetrics::Scope scope(_metrics.load(), VaultMetrics::Contains);
+
+    QReadLocker locker(&_lock);
+
+    if (_locked) {
+        qDebug() << "Cannot check keys in locked state.";
+        return false;
+    }
+
+    // the record key is found directly, so the index is not needed
+    CipherPool::Lease lease(_ciphers.data());
+    QByteArray encryptedValue;
+    return findRecord(recordKey(key, lease), &encryptedValue);
+}
+
+QStringList QVault::keys(const QString &prefix)
+{
+    const VaultMetrics::Scope scope(_metrics.load(), VaultMetrics::Keys);
+
+    QReadLocker locker(&_lock);
+
+    if (_locked) {
+        qDebug() << "Cannot list keys in locked state.";
+        return QStringList();
+    }
+
+    // readers share the vault lock, so the index has its own one
+    QMutexLocker keysLocker(&_keysMutex);
+    if (!buildKeys()) {
+        return QStringList();
+    }
+
+    return _keys.keys(prefix);
+}
+
+bool QVault::setValue(const QString &key, const QVariant &value)
+{
+    const VaultMetrics::Scope scope(_metrics.load(), VaultMetrics::SetValue);
+
+    QWriteLocker locker(&_lock);
+
+    if (_locked) {
+        qDebug() << "Cannot set values in locked state.";
+        return false;
+    }
+
+    CipherPool::Lease lease(_ciphers.data());
+    QByteArray encryptedKey = recordKey(key, lease);
+    VaultBlob previous;
+    const bool replaced = findBlob(lease, encryptedKey, &previous);
+    QByteArray encryptedValue = encryptValue(_cipherSuite, lease, encryptedKey, key.toUtf8(), ValueCodec::encode(value, _compression));
+
+    VaultJournal::Entry entry = { VaultJournal::Set, encryptedKey, encryptedValue };
+    VaultJournal::Batch batch;
+    batch.append(entry);
+
+    if (!write(batch)) {
+        return false;
+    }
+
+    if (replaced) {
+        removeBlob(previous);
+    }
+
+    return true;
+}
+
+QFuture<bool> QVault::setValueAsync(const QString &key, const QVariant &value)
+{
+    const VaultMetrics::Scope scope(_metrics.load(), VaultMetrics::SetValue);
+
+    QWriteLocker locker(&_lock);
+
+    if (_locked) {
+        qDebug() << "Cannot set values in locked state.";
+        return finishedFuture(false);
+    }
+
+    CipherPool::Lease lease(_ciphers.data());
+    const QByteArray encryptedKey = recordKey(key, lease);
+    QStringList blobs;
+    VaultBlob previous;
+    if (findBlob(lease, encryptedKey, &previous)) {
+        blobs.append(blobPath(previous));
+    }
+
+    VaultJournal::Entry entry = { VaultJournal::Set,
+                                  encryptedKey,
+                                  encryptValue(_cipherSuite, lease, encryptedKey, key.toUtf8(), ValueCodec::encode(value, _compression)) };
+    VaultJournal::Batch batch;
+    batch.append(entry);
+
+    return writeBehind(batch, blobs);
+}
+
+bool QVault::setValues(const QVariantMap &values)
+{
+    const VaultMetrics::Scope scope(_metrics.load(), VaultMetrics::SetValues);
+
+    QWriteLocker locker(&_lock);
+
+    if (_locked) {
+        qDebug() << "Cannot set values in locked state.";
+        return false;
+    }
+
+    CipherPool::Lease lease(_ciphers.data());
+    VaultJournal::Batch batch;
+    batch.reserve(values.size());
+    QList<VaultBlob> replaced;
+
+    for (auto it = values.constBegin(); it != values.constEnd(); ++it) {
+        const QByteArray encryptedKey = recordKey(it.key(), lease);
+        VaultBlob previous;
+        if (findBlob(lease, encryptedKey, &previous)) {
+            replaced.append(previous);
+        }
+
+        VaultJournal::Entry entry = { VaultJournal::Set,
+                                      encryptedKey,
+                                      encryptValue(_cipherSuite,
+                                                   lease,
+                                                   encryptedKey,
+                                                   it.key().toUtf8(),
+                                                   ValueCodec::encode(it.value(), _compression)) };
+        batch.append(entry);
+    }
+
+    if (batch.isEmpty()) {
+        return true;
+    }
+
+    if (!write(batch)) {
+        return false;
+    }
+
+    for (const VaultBlob &blob : replaced) {
+        removeBlob(blob);
+    }
+
+    return true;
+}
+
+bool QVault::removeValue(const QString &key)
+{
+    const VaultMetrics::Scope scope(_metrics.load(), VaultMetrics::RemoveValue);
+
+    QWriteLocker locker(&_lock);
+
+    if (_locked) {
+        qDebug() << "Cannot get values in locked state.";
+        return false;
+    }
+
+    CipherPool::Lease lease(_ciphers.data());
+    QByteArray encryptedKey = recordKey(key, lease);
+    QByteArray encryptedValue;
+    if (!findRecord(encryptedKey, &encryptedValue)) {
+        return true;
+    }
+
+    VaultBlob blob;
+    const bool stream = streamBlob(_cipherSuite, lease, encryptedKey, encryptedValue, &blob);
+
+    VaultJournal::Entry entry = { VaultJournal::Remove, encryptedKey, QByteArray() };
+    VaultJournal::Batch batch;
+    batch.append(entry);
+
+    if (!write(batch)) {
+        return false;
+    }
+
+    if (stream) {
+        removeBlob(blob);
+    }
+
+    return true;
+}
+
+QFuture<bool> QVault::removeValueAsync(const QString &key)
+{
+    const VaultMetrics::Scope scope(_metrics.load(), VaultMetrics::RemoveValue);
+
+    QWriteLocker locker(&_lock);
+
+    if (_locked) {
+        qDebug() << "Cannot remove values in locked state.";
+        return finishedFuture(false);
+    }
+
+    CipherPool::Lease lease(_ciphers.data());
+    QByteArray encryptedKey = recordKey(key, lease);
+    QByteArray encryptedValue;
+    if (!findRecord(encryptedKey, &encryptedValue)) {
+        return finishedFuture(true);
+    }
+
+    QStringList blobs;
+    VaultBlob blob;
+    if (streamBlob(_cipherSuite, lease, encryptedKey, encryptedValue, &blob)) {
+        blobs.append(blobPath(blob));
+    }
+
+    VaultJournal::Entry entry = { VaultJournal::Remove, encryptedKey, QByteArray() };
+    VaultJournal::Batch batch;
+    batch.append(entry);
+
+    return writeBehind(batch, blobs);
+}
+
+bool QVault::flush()
+{
+    const VaultMetrics::Scope scope(_metrics.load(), VaultMetrics::Flush);
+
+    QWriteLocker locker(&_lock);
+
+    if (_locked) {
+        return true;
+    }
+
+    if (_inTransaction) {
+        qDebug() << "Cannot flush during a transaction.";
+        return false;
+    }
+
+    const bool success = persistPending(VaultJournal::Batch());
+    if (_journal && !_journal->sync()) {
+        return false;
+    }
+
+    return success;
+}
+
+bool QVault::refresh()
+{
+    const VaultMetrics::Scope scope(_metrics.load(), VaultMetrics::Refresh);
+
+    QWriteLocker locker(&_lock);
+
+    if (_locked) {
+        qDebug() << "Cannot refresh in locked state.";
+        return false;
+    }
+
+    if (_inTransaction) {
+        qDebug() << "Cannot refresh during a transaction.";
+        return false;
+    }
+
+    VaultJournal::Batch pending;
+    for (const PendingWrite &write : _pending) {
+        pending.append(write.batch);
+    }
+
+    QLockFile fileLock(lockPath(_filepath));
+    return lockVaultFile(&fileLock) && refreshState(pending, false);
+}
+
+bool QVault::verify()
+{
+    const VaultMetrics::Scope scope(_metrics.load(), VaultMetrics::Verify);
+
+    QReadLocker locker(&_lock);
+
+    if (_locked) {
+        qDebug() << "Cannot verify vault in locked state.";
+        return false;
+    }
+
+    if (_roots.isEmpty()) {
+        qDebug() << "Vault records cannot be verified, the vault header has no roots yet.";
+        return false;
+    }
+
+    const QVector<const VaultSnapshot*> files = sources();
+    if (_roots.size() != files.size()) {
+        qDebug() << "Vault records are corrupted, the vault header does not match its files.";
+        return false;
+    }
+
+    // files are hashed again rather than trusting roots computed when they were first read,
+    // every file is hashed by its own task and large ones are split further
+    QList<QFuture<QByteArray>> futures;
+    for (const VaultSnapshot *file : files) {
+        futures.append(QtConcurrent::run([file]() {
+            return MerkleTree::root(*file);
+        }));
+    }
+
+    bool verified = true;
+    for (int i = 0; i < futures.size(); ++i) {
+        if (futures[i].result() != _roots.at(i)) {
+            qDebug() << "Vault records are corrupted or have been tampered with" << i;
+            verified = false;
+        }
+    }
+
+    return verified;
+}
+
+bool QVault::clear()
+{
+    const VaultMetrics::Scope scope(_metrics.load(), VaultMetrics::Clear);
+
+    QWriteLocker locker(&_lock);
+
+    if (_locked) {
+        qDebug() << "Cannot clear values in locked state.";
+        return false;
+    }
+
+    VaultJournal::Entry entry = { VaultJournal::Clear, QByteArray(), QByteArray() };
+    VaultJournal::Batch batch;
+    batch.append(entry);
+
+    if (!write(batch)) {
+        return false;
+    }
+
+    const QDir blobs(blobsPath(_filepath));
+    if (_inTransaction) {
+        // streams are not written during a transaction, so these are all blobs the commit drops
+        for (const QString &name : blobs.entryList(QDir::Files)) {
+            _transactionBlobs.append(blobs.filePath(name));
+        }
+    } else if (blobs.exists() && !QDir(blobs).removeRecursively()) {
+        qDebug() << "Failed to delete blobs directory" << blobs.path();
+    }
+
+    return true;
+}
+
+bool QVault::beginTransaction()
+{
+    QWriteLocker locker(&_lock);
+
+    if (_locked) {
+        qDebug() << "Cannot begin transaction in locked state.";
+        return false;
+    }
+
+    if (_inTransaction) {
+        qDebug() << "Transaction is already started.";
+        return false;
+    }
+
+    _inTransaction = true;
+    _transaction.clear();
+    _transactionRecords = _records;
+    _transactionCleared = _cleared;
+
+    return true;
+}
+
+bool QVault::commit()
+{
+    const VaultMetrics::Scope scope(_metrics.load(), VaultMetrics::Commit);
+
+    QWriteLocker locker(&_lock);
+
+    if (!_inTransaction) {
+        qDebug() << "Cannot commit, no transaction is started.";
+        return false;
+    }
+
+    const VaultJournal::Batch batch = _transaction;
+    const QStringList blobs = _transactionBlobs;
+    _inTransaction = false;
+    _transaction.clear();
+    _transactionRecords.clear();
+    _transactionBlobs.clear();
+
+    if (batch.isEmpty()) {
+        return true;
+    }
+
+    if (!persistPending(batch)) {
+        // the state may have been refreshed before the write failed,
+        // so it is read from disk again rather than restored.
+        qDebug() << "Failed to commit transaction, changes are rolled back.";
+        if (!_locked) {
+            QLockFile fileLock(lockPath(_filepath));
+            if (!lockVaultFile(&fileLock) || !refreshState(VaultJournal::Batch(), true)) {
+                wipe();
+            }
+        }
+        return false;
+    }
+
+    for (const QString &blob : blobs) {
+        QFile::remove(blob);
+    }
+
+    return true;
+}
+
+bool QVault::rollback()
+{
+    QWriteLocker locker(&_lock);
+
+    if (!_inTransaction) {
+        qDebug() << "Cannot rollback, no transaction is started.";
+        return false;
+    }
+
+    discardTransaction();
+
+    return true;
+}
+
+bool QVault::isInTransaction() const
+{
+    QReadLocker locker(&_lock);
+    return _inTransaction;
+}
+
+void QVault::discardTransaction()
+{
+    _records = _transactionRecords;
+    _cleared = _transactionCleared;
+    _cache.clear();
+    resetKeys();
+    _inTransaction = false;
+    _transaction.clear();
+    _transactionRecords.clear();
+    _transactionBlobs.clear();
+
+    // asynchronous writes made before the transaction are still to be written
+    if (!_pending.isEmpty()) {
+        scheduleWriter();
+    }
+}
+
+void QVault::syncDirectory(const QString &path)
+{
+#if defined(Q_OS_UNIX)
+    // persists the rename of the vault file itself
+    const int fd = ::open(QFile::encodeName(path).constData(), O_RDONLY);
+    if (fd < 0) {
+        qDebug() << "Failed to open directory to sync" << path;
+        return;
+    }
+    ::fsync(fd);
+    ::close(fd);
+#else
+    Q_UNUSED(path);
+#endif
+}
+
+QByteArray QVault::rand(int size)
+{
+    Q_ASSERT(size > 0);
+
+    QByteArray buffer(size, '\0');
+
+    if (RAND_bytes(reinterpret_cast<unsigned char*>(buffer.data()), buffer.size()) != 1) {
+        qDebug() << "Failed to generate random bytes, size" << size;
+    }
+
+    return buffer;
+}
+
+bool QVault::randomSecretKey(SecureArena::Buffer *secretKey)
+{
+    Q_ASSERT(secretKey->size() == SECRET_KEY_SIZE);
+
+    // the key is generated in the arena, so it never reaches the heap
+    if (RAND_bytes(reinterpret_cast<unsigned char*>(secretKey->data()), secretKey->size()) != 1) {
+        qDebug() << "Failed to generate secret key.";
+        return false;
+    }
+
+    return true;
+}
+
+QByteArray QVault::generateHmac(const QByteArray &macKey, const QByteArray &secretKey)
+{
+    QByteArray result(HMAC_KEY_SIZE, '\0');
+    unsigned int length = HMAC_KEY_SIZE;
+
+    HMAC(EVP_sha256(),
+         reinterpret_cast<const unsigned char*>(macKey.data()),
+         macKey.size(),
+         reinterpret_cast<const unsigned char*>(secretKey.data()),
+         secretKey.size(),
+         reinterpret_cast<unsigned char*>(result.data()),
+         &length);
+
+    return result;
+}
+
+void QVault::toUtf8(const QString &key, QByteArray *utf8Key)
+{
+    const QChar *chars = key.constData();
+    const int size = key.size();
+    utf8Key->resize(size);
+    char *dest = utf8Key->data();
+
+    // ASCII is the same in UTF-8, so such keys are copied into the buffer
+    for (int i = 0; i < size; ++i) {
+        const ushort c = chars[i].unicode();
+        if (c >= 0x80) {
+            utf8Key->fill('\0');
+            *utf8Key = key.toUtf8();
+            return;
+        }
+        dest[i] = char(c);
+    }
+}
+
+QByteArray QVault::packRecord(const QByteArray &key, const QByteArray &value)
+{
+    QByteArray record(int(sizeof(quint32)) + key.size() + value.size(), '\0');
+    qToBigEndian<quint32>(quint32(key.size()), reinterpret_cast<uchar*>(record.data()));
+    memcpy(record.data() + sizeof(quint32), key.constData(), size_t(key.size()));
+    memcpy(record.data() + sizeof(quint32) + key.size(), value.constData(), size_t(value.size()));
+
+    return record;
+}
+
+bool QVault::unpackRecord(const QByteArray &record, QByteArray *key, QByteArray *value)
+{
+    const int offset = packedValueOffset(record);
+    if (offset < 0) {
+        return false;
+    }
+
+    if (key) {
+        *key = record.mid(int(sizeof(quint32)), offset - int(sizeof(quint32)));
+    }
+    *value = record.mid(offset);
+
+    return true;
+}
+
+int QVault::packedValueOffset(const QByteArray &record)
+{
+    if (record.size() < int(sizeof(quint32))) {
+        return -1;
+    }
+
+    const quint32 keySize = qFromBigEndian<quint32>(reinterpret_cast<const uchar*>(record.constData()));
+    if (keySize > quint32(record.size()) - sizeof(quint32)) {
+        return -1;
+    }
+
+    return int(sizeof(quint32) + keySize);
+}
+
+AeadCipher::Algorithm QVault::aeadAlgorithm(CipherSuite suite)
+{
+    return suite == ChaCha20Poly1305 ? AeadCipher::ChaCha20Poly1305 : AeadCipher::AesGcm;
+}
+
+QByteArray QVault::encryptRecordKey(CipherSuite suite, const CipherPool::Lease &lease, const QByteArray &key)
+{
+    if (suite == AesCbc) {
+        return lease.cipher()->encrypt(key);
+    }
+
+    return lease.keyMac()->digest(key);
+}
+
+QByteArray QVault::encryptValue(CipherSuite suite,
+                                const CipherPool::Lease &lease,
+                                const QByteArray &recordKey,
+                                const QByteArray &key,
+                                const QByteArray &value)
+{
+    const VaultMetrics::Scope scope(VaultMetrics::Encryption);
+
+    if (suite == AesCbc) {
+        return lease.cipher()->encrypt(value);
+    }
+
+    // the plain key travels with the value, so records can be re-encrypted
+    // under a new key, and the record key binds the value to its place.
+    QByteArray record = packRecord(key, value);
+    const QByteArray encrypted = lease.aead()->encrypt(record, recordKey);
+    record.fill('\0');
+
+    return encrypted;
+}
+
+QByteArray QVault::decryptValue(CipherSuite suite,
+                                const CipherPool::Lease &lease,
+                                const QByteArray &recordKey,
+                                const QByteArray &encryptedValue,
+                                QByteArray *key)
+{
+    const VaultMetrics::Scope scope(VaultMetrics::Encryption);
+
+    if (suite == AesCbc) {
+        if (key) {
+            *key = lease.cipher()->decrypt(recordKey);
+        }
+        return lease.cipher()->decrypt(encryptedValue);
+    }
+
+    QByteArray record = lease.aead()->decrypt(encryptedValue, recordKey);
+    QByteArray value;
+    const bool unpacked = unpackRecord(record, key, &value);
+    record.fill('\0');
+
+    return unpacked ? value : QByteArray();
+}
+
+bool QVault::decryptRecord(CipherSuite suite,
+                           const CipherPool::Lease &lease,
+                           const QByteArray &recordKey,
+                           const char *encryptedValue,
+                           int size,
+                           QByteArray *record,
+                           int *valueOffset)
+{
+    const VaultMetrics::Scope scope(VaultMetrics::Encryption);
+
+    if (suite == AesCbc) {
+        *valueOffset = 0;
+        return lease.cipher()->decrypt(encryptedValue, size, record);
+    }
+
+    if (!lease.aead()->decrypt(encryptedValue, size, recordKey, record)) {
+        return false;
+    }
+
+    *valueOffset = packedValueOffset(*record);
+    return *valueOffset >= 0;
+}
+
+QByteArray QVault::generateSecretKey(const QString &password,
+                                     const QVariantMap &kdfParameters,
+                                     const QByteArray &salt,
+                                     int size)
+{
+    const VaultMetrics::Scope scope(VaultMetrics::KeyDerivation);
+
+    QScopedPointer<Kdf> kdf(Kdf::create(kdfParameters));
+    if (!kdf) {
+        qDebug() << "Failed to generate secret key.";
+        return QByteArray();
+    }
+
+    return kdf->derive(password, salt, size);
+}
+
+QVariantMap QVault::wrapSecretKey(const QString &password, const QVariantMap &kdf, const QByteArray &secretKey)
+{
+    const QByteArray salt = rand(SALT_SIZE);
+    QByteArray kek = generateSecretKey(password, kdf, salt, KEK_SIZE);
+    if (kek.isEmpty()) {
+        return QVariantMap();
+    }
+
+    const QByteArray wrappedKey = AesCipher::wrap(kek, secretKey);
+    kek.fill('\0');
+    if (wrappedKey.isEmpty()) {
+        return QVariantMap();
+    }
+
+    QVariantMap keySlot;
+    keySlot.insert(HEADER_SALT, salt);
+    keySlot.insert(HEADER_KDF, kdf);
+    keySlot.insert(SLOT_KEY, wrappedKey);
+
+    return keySlot;
+}
+
+QByteArray QVault::unwrapSecretKey(const QString &password, const QVariantMap &keySlot)
+{
+    const QByteArray salt = keySlot.value(HEADER_SALT).toByteArray();
+    const QVariantMap kdf = headerKdf(keySlot);
+
+    // without a data key the secret key is derived from the password, and the
+    // header MAC tells whether it is right. Wrapped keys are checked on unwrap.
+    if (!hasDataKey(keySlot)) {
+        return generateSecretKey(password, kdf, salt, SECRET_KEY_SIZE);
+    }
+
+    QByteArray kek = generateSecretKey(password, kdf, salt, KEK_SIZE);
+    if (kek.isEmpty()) {
+        return QByteArray();
+    }
+
+    const QByteArray secretKey = AesCipher::unwrap(kek, keySlot.value(SLOT_KEY).toByteArray());
+    kek.fill('\0');
+
+    return secretKey.size() == SECRET_KEY_SIZE ? secretKey : QByteArray();
+}
+
+bool QVault::hasDataKey(const QVariantMap &keySlot)
+{
+    return keySlot.contains(SLOT_KEY);
+}
+
+QString QVault::lockPath(const QString &vaultPath)
+{
+    return vaultPath + ".lock";
+}
+
+QString QVault::blobsPath(const QString &filepath)
+{
+    return filepath + ".blobs";
+}
+
+bool QVault::decryptKey(CipherSuite suite,
+                        const CipherPool::Lease &lease,
+                        const QByteArray &recordKey,
+                        const QByteArray &encryptedValue,
+                        QByteArray *key)
+{
+    if (suite == AesCbc) {
+        *key = lease.cipher()->decrypt(recordKey);
+        return !key->isEmpty();
+    }
+
+    // authenticated records keep the plain key next to the value
+    QByteArray value = decryptValue(suite, lease, recordKey, encryptedValue, key);
+    const bool success = !value.isEmpty();
+    value.fill('\0');
+
+    return success;
+}
+
+bool QVault::buildKeys()
+{
+    if (_keysBuilt) {
+        return true;
+    }
+
+    QVector<VaultSnapshot::Record> records;
+    if (!mergedRecords(&records)) {
+        qDebug() << "Cannot list keys, vault records are corrupted.";
+        return false;
+    }
+
+    CipherPool::Lease lease(_ciphers.data());
+    for (const VaultSnapshot::Record &record : records) {
+        QByteArray key;
+        if (!decryptKey(_cipherSuite, lease, record.first, record.second, &key)) {
+            qDebug() << "Cannot list keys, vault record is corrupted.";
+            _keys.clear();
+            return false;
+        }
+
+        _keys.insert(QString::fromUtf8(key), record.first);
+        key.fill('\0');
+    }
+
+    _keysBuilt = true;
+    return true;
+}
+
+void QVault::resetKeys()
+{
+    _keys.clear();
+    _keysBuilt = false;
+}
+
+void QVault::indexKey(const QByteArray &recordKey, const QByteArray &encryptedValue)
+{
+    CipherPool::Lease lease(_ciphers.data());
+    QByteArray key;
+    if (decryptKey(_cipherSuite, lease, recordKey, encryptedValue, &key)) {
+        _keys.insert(QString::fromUtf8(key), recordKey);
+    } else {
+        // the index is built again from records on the next query
+        resetKeys();
+    }
+    key.fill('\0');
+}
+
+bool QVault::streamBlob(CipherSuite suite,
+                        const CipherPool::Lease &lease,
+                        const QByteArray &recordKey,
+                        const QByteArray &encryptedValue,
+                        VaultBlob *blob)
+{
+    QByteArray value = decryptValue(suite, lease, recordKey, encryptedValue);
+    QByteArray reference;
+    const bool stream = ValueCodec::decodeStream(value, &reference) && VaultBlob::fromReference(reference, blob);
+    value.fill('\0');
+    reference.fill('\0');
+
+    return stream;
+}
+
+bool QVault::findBlob(const CipherPool::Lease &lease, const QByteArray &recordKey, VaultBlob *blob)
+{
+    QByteArray encryptedValue;
+    return findRecord(recordKey, &encryptedValue) &&
+            streamBlob(_cipherSuite, lease, recordKey, encryptedValue, blob);
+}
+
+QString QVault::blobPath(const VaultBlob &blob) const
+{
+    return QDir(blobsPath(_filepath)).filePath(blob.fileName());
+}
+
+void QVault::removeBlob(const VaultBlob &blob)
+{
+    const QString path = blobPath(blob);
+
+    // the value may come back on rollback, so its blob is kept until commit
+    if (_inTransaction) {
+        _transactionBlobs.append(path);
+    } else {
+        QFile::remove(path);
+    }
+}
+
+QVariantMap QVault::headerKdf(const QVariantMap &properties)
+{
+    // headers written before the KDF became configurable hold PBKDF2-SHA1 iterations only
+    if (!properties.contains(HEADER_KDF)) {
+        return Kdf::legacyParameters(properties.value(HEADER_ITERATIONS).toInt());
+    }
+
+    return properties.value(HEADER_KDF).toMap();
+}
+
+QVariantList QVault::headerKeySlots(const QVariantMap &properties)
+{
+    if (properties.contains(HEADER_KEY_SLOTS)) {
+        return properties.value(HEADER_KEY_SLOTS).toList();
+    }
+
+    // headers without a data key describe the key derivation by themselves
+    QVariantMap keySlot;
+    keySlot.insert(HEADER_SALT, properties.value(HEADER_SALT));
+    keySlot.insert(HEADER_KDF, headerKdf(properties));
+
+    return QVariantList() << keySlot;
+}
+
+bool QVault::headerCipherSuite(const QVariantMap &properties, CipherSuite *suite)
+{
+    // headers written before the cipher suite became configurable hold no name
+    const QString name = properties.value(HEADER_CIPHER, CIPHER_SUITE_NAMES[AesCbc]).toString();
+
+    for (int i = AesCbc; i <= ChaCha20Poly1305; ++i) {
+        if (name == QLatin1String(CIPHER_SUITE_NAMES[i])) {
+            *suite = CipherSuite(i);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool QVault::headerSeparateKeyMac(const QVariantMap &properties)
+{
+    return properties.value(HEADER_KEY_MAC).toString() == KEY_MAC_HKDF;
+}
+
+QList<QByteArray> QVault::headerRoots(const QVariantMap &properties)
+{
+    QList<QByteArray> roots;
+    for (const QVariant &root : properties.value(HEADER_ROOTS).toList()) {
+        roots.append(root.toByteArray());
+    }
+
+    return roots;
+}
+
+QByteArray QVault::headerData(const QVariantList &keySlots,
+                              CipherSuite suite,
+                              const QByteArray &epoch,
+                              quint64 generation,
+                              const QStringList &shards,
+                              const QList<QByteArray> &roots,
+                              bool separateKeyMac)
+{
+    QVariantMap properties;
+    if (keySlots.size() == 1 && !hasDataKey(keySlots.first().toMap())) {
+        const QVariantMap keySlot = keySlots.first().toMap();
+        properties.insert(HEADER_SALT, keySlot.value(HEADER_SALT));
+        properties.insert(HEADER_KDF, keySlot.value(HEADER_KDF));
+    } else {
+        properties.insert(HEADER_KEY_SLOTS, keySlots);
+    }
+    if (suite != AesCbc) {
+        properties.insert(HEADER_CIPHER, CIPHER_SUITE_NAMES[suite]);
+    }
+    properties.insert(HEADER_EPOCH, epoch);
+    properties.insert(HEADER_GENERATION, generation);
+    if (!shards.isEmpty()) {
+        properties.insert(HEADER_SHARDS, shards);
+    }
+    if (separateKeyMac) {
+        properties.insert(HEADER_KEY_MAC, KEY_MAC_HKDF);
+    }
+    if (!roots.isEmpty()) {
+        QVariantList rootList;
+        for (const QByteArray &root : roots) {
+            rootList.append(root);
+        }
+        properties.insert(HEADER_ROOTS, rootList);
+    }
+
+    QByteArray header;
+    QDataStream out(&header, QIODevice::WriteOnly);
+    out << properties;
+
+    return header;
+}
+
+bool QVault::deriveSecretKey(const QString &password,
+                             VaultSession *session,
+                             const QVariantList &keySlots,
+                             QVariantMap *keySlot,
+                             SecureArena::Buffer *secretKey) const
+{
+    Q_ASSERT(secretKey->size() == SECRET_KEY_SIZE);
+
+    QByteArray derived;
+    if (session) {
+        derived = session->secretKey(QFileInfo(_filepath).absoluteFilePath(), keySlots, keySlot);
+    } else {
+        // every password has its own slot, the one that unwraps is the password's
+        for (const QVariant &slot : keySlots) {
+            derived = unwrapSecretKey(password, slot.toMap());
+            if (!derived.isEmpty()) {
+                *keySlot = slot.toMap();
+                break;
+            }
+        }
+    }
+
+    // the key is moved into the arena right away, the heap copy is zeroed
+    const bool found = derived.size() == SECRET_KEY_SIZE;
+    if (found) {
+        memcpy(secretKey->data(), derived.constData(), size_t(SECRET_KEY_SIZE));
+    }
+    derived.fill('\0');
+
+    return found;
+}
+
+bool QVault::unlockLegacy(const QByteArray &vaultData, const QString &password, VaultSession *session)
+{
+    QDataStream in(vaultData);
+    QByteArray salt, mac;
+    int iterations;
+    in >> salt >> iterations >> mac;
+
+    QVariantMap properties;
+    properties.insert(HEADER_SALT, salt);
+    properties.insert(HEADER_ITERATIONS, iterations);
+    const QVariantList keySlots = headerKeySlots(properties);
+
+    QVariantMap keySlot;
+    SecureArena::Buffer secretKey(SECRET_KEY_SIZE);
+    if (!deriveSecretKey(password, session, keySlots, &keySlot, &secretKey)) {
+        qDebug() << "Cannot unlock vault. Check password and vault file integrity.";
+        return false;
+    }
+
+    if (mac != generateHmac(secretKey.view(AES_KEY_SIZE + IV_SIZE, HMAC_KEY_SIZE), secretKey.view(0, SECRET_KEY_SIZE))) {
+        qDebug() << "Cannot unlock vault. Check password and vault file integrity.";
+        return false;
+    }
+
+    setContext(new CryptoContext(secretKey.view(0, AES_KEY_SIZE),
+                                 secretKey.view(AES_KEY_SIZE, IV_SIZE),
+                                 secretKey.view(AES_KEY_SIZE + IV_SIZE, HMAC_KEY_SIZE),
+                                 keySlot),
+               AesCbc);
+    secretKey.wipe();
+    _keySlots = keySlots;
+
+    // legacy vaults have no epoch to chain a journal from,
+    // so the first write upgrades the vault to the current format.
+    in >> _records;
+    _snapshotSize = vaultData.size();
+    _locked = false;
+
+    return true;
+}
+
+bool QVault::prepareKeyChange(QLockFile *fileLock)
+{
+    if (_locked) {
+        qDebug() << "Cannot change vault keys in locked state.";
+        return false;
+    }
+
+    if (_inTransaction) {
+        qDebug() << "Cannot change vault keys during a transaction.";
+        return false;
+    }
+
+    // pending changes are written with the current key, then the state
+    // is brought up to date with changes made by other processes.
+    return persistPending(VaultJournal::Batch()) &&
+            lockVaultFile(fileLock) &&
+            refreshState(VaultJournal::Batch(), false);
+}
+
+bool QVault::saveKeySlots(const QVariantList &keySlots, const QVariantMap &keySlot)
+{
+    const QVariantList oldKeySlots = _keySlots;
+    _keySlots = keySlots;
+
+    // records are not decrypted, but the vault file is rewritten as a whole,
+    // with records copied as they are. Only shard files are left untouched.
+    if (!save()) {
+        if (!_locked) {
+            _keySlots = oldKeySlots;
+        }
+        return false;
+    }
+
+    if (keySlot != _context->keySlot()) {
+        setContext(new CryptoContext(_context->aesKey(),
+                                     _context->iv(),
+                                     _context->macKey(),
+                                     keySlot,
+                                     _context->hasSeparateKeyMac()),
+                   _cipherSuite);
+    }
+
+    return true;
+}
+
+bool QVault::replaceDataKey(const QString &password, const QVariantMap &kdf)
+{
+    SecureArena::Buffer secretKey(SECRET_KEY_SIZE);
+    const QVariantMap keySlot = randomSecretKey(&secretKey)
+            ? wrapSecretKey(password, kdf, secretKey.view(0, SECRET_KEY_SIZE))
+            : QVariantMap();
+    if (keySlot.isEmpty()) {
+        qDebug() << "Cannot replace data key, keys cannot be derived.";
+        return false;
+    }
+
+    QScopedPointer<CryptoContext> context(new CryptoContext(secretKey.view(0, AES_KEY_SIZE),
+                                                            secretKey.view(AES_KEY_SIZE, IV_SIZE),
+                                                            secretKey.view(AES_KEY_SIZE + IV_SIZE, HMAC_KEY_SIZE),
+                                                            keySlot,
+                                                            true));
+    secretKey.wipe();
+
+    // records without authentication are moved to an authenticated cipher suite
+    const CipherSuite suite = _cipherSuite == AesCbc ? AesGcm : _cipherSuite;
+
+    // nothing is changed until all records are re-encrypted, so an aborted
+    // or failed re-encryption leaves the vault with the old keys.
+    Records records;
+    if (!reencrypt(*context, suite, &records)) {
+        return false;
+    }
+
+    setContext(context.take(), suite);
+    _keySlots = QVariantList() << keySlot;
+    _journal.reset();
+    _records.swap(records);
+    _cleared = true;
+
+    return save();
+}
+
+void QVault::setContext(CryptoContext *context, CipherSuite suite)
+{
+    // the pool refers to the context, so it goes first
+    _ciphers.reset();
+    _context.reset(context);
+    _cipherSuite = suite;
+    _index.clear();
+    _cache.clear();
+    resetKeys();
+
+    if (context) {
+        _ciphers.reset(new CipherPool(context, aeadAlgorithm(suite)));
+    }
+}
+
+QByteArray QVault::recordKey(const QString &key, const CipherPool::Lease &lease)
+{
+    const QByteArray utf8Key = key.toUtf8();
+    return recordKey(utf8Key, lease.keyMac()->digest(utf8Key), lease);
+}
+
+QByteArray QVault::recordKey(const QByteArray &utf8Key, const QByteArray &digest, const CipherPool::Lease &lease)
+{
+    // authenticated suites identify records by the digest itself
+    if (_cipherSuite != AesCbc) {
+        return digest;
+    }
+
+    {
+        QReadLocker locker(&_indexLock);
+        const auto indexed = _index.constFind(digest);
+        if (indexed != _index.constEnd()) {
+            return indexed.value();
+        }
+    }
+
+    const QByteArray encryptedKey = encryptRecordKey(_cipherSuite, lease, utf8Key);
+
+    // keys of missing records are not indexed, so lookups of arbitrary keys cannot grow the index
+    const char *encryptedValue = nullptr;
+    int size = 0;
+    if (findRecord(encryptedKey, &encryptedValue, &size)) {
+        QWriteLocker locker(&_indexLock);
+        _index.insert(digest, encryptedKey);
+    }
+
+    return encryptedKey;
+}
+
+bool QVault::findRecord(const QByteArray &encryptedKey, QByteArray *encryptedValue) const
+{
+    const auto record = _records.constFind(encryptedKey);
+    if (record != _records.constEnd()) {
+        *encryptedValue = record.value();
+        return !encryptedValue->isEmpty();
+    }
+
+    if (_cleared) {
+        return false;
+    }
+
+    // a file serves no record until its root is verified, once per mapped file
+    if (_shards) {
+        const int shard = VaultShards::shardOf(encryptedKey, _shards->count());
+        return verifySource(shard, _shards->shard(shard)) && _shards->find(encryptedKey, encryptedValue);
+    }
+
+    return _snapshot && verifySource(0, *_snapshot) && _snapshot->find(encryptedKey, encryptedValue);
+}
+
+bool QVault::findRecord(const QByteArray &encryptedKey, const char **encryptedValue, int *size) const
+{
+    const auto record = _records.constFind(encryptedKey);
+    if (record != _records.constEnd()) {
+        *encryptedValue = record.value().constData();
+        *size = record.value().size();
+        return *size > 0;
+    }
+
+    if (_cleared) {
+        return false;
+    }
+
+    if (_shards) {
+        const int shard = VaultShards::shardOf(encryptedKey, _shards->count());
+        return verifySource(shard, _shards->shard(shard)) && _shards->find(encryptedKey, encryptedValue, size);
+    }
+
+    return _snapshot && verifySource(0, *_snapshot) && _snapshot->find(encryptedKey, encryptedValue, size);
+}
+
+QVector<const VaultSnapshot*> QVault::sources() const
+{
+    QVector<const VaultSnapshot*> sources;
+    if (_shards) {
+        for (int i = 0; i < _shards->count(); ++i) {
+            sources.append(&_shards->shard(i));
+        }
+    } else if (_snapshot) {
+        sources.append(_snapshot.data());
+    }
+
+    return sources;
+}
+
+bool QVault::verifySource(int index, const VaultSnapshot &source) const
+{
+    if (_roots.isEmpty()) {
+        return true;
+    }
+
+    // the root is computed once per mapped file, so it is verified once
+    if (index >= _roots.size() || source.merkleRoot() != _roots.at(index)) {
+        qDebug() << "Vault records are corrupted or have been tampered with" << index;
+        return false;
+    }
+
+    return true;
+}
+
+bool QVault::mergedRecords(QVector<VaultSnapshot::Record> *records, int shard) const
+{
+    const auto belongs = [this, shard](const QByteArray &key) {
+        return shard < 0 || VaultShards::shardOf(key, _shardCount) == shard;
+    };
+
+    // records of a shard are all in its file, unless records are redistributed
+    const QVector<const VaultSnapshot*> files = _cleared ? QVector<const VaultSnapshot*>() : sources();
+    QVector<const VaultSnapshot*> selected;
+    for (int i = 0; i < files.size(); ++i) {
+        if (_shards && shard >= 0 && files.size() == _shardCount && i != shard) {
+            continue;
+        }
+        if (!verifySource(i, *files.at(i))) {
+            return false;
+        }
+        selected.append(files.at(i));
+    }
+
+    records->clear();
+    if (shard < 0) {
+        int count = _records.size();
+        for (const VaultSnapshot *source : selected) {
+            count += int(source->count());
+        }
+        records->reserve(count);
+    }
+
+    for (const VaultSnapshot *source : selected) {
+        for (quint32 i = 0; i < source->count(); ++i) {
+            const VaultSnapshot::Record record = source->record(i);
+            if (!record.first.isEmpty() && !_records.contains(record.first) && belongs(record.first)) {
+                records->append(record);
+            }
+        }
+    }
+
+    for (auto it = _records.constBegin(); it != _records.constEnd(); ++it) {
+        if (!it.value().isEmpty() && belongs(it.key())) {
+            records->append(qMakePair(it.key(), it.value()));
+        }
+    }
+
+    std::sort(records->begin(), records->end(), [](const VaultSnapshot::Record &left, const VaultSnapshot::Record &right) {
+        return VaultSnapshot::lessThan(left.first, right.first);
+    });
+
+    return true;
+}
+
+bool QVault::reencrypt(const CryptoContext &context, CipherSuite suite, Records *records)
+{
+    QVector<VaultSnapshot::Record> oldRecords;
+    if (!mergedRecords(&oldRecords)) {
+        qDebug() << "Cannot re-encrypt vault, vault records are corrupted.";
+        return false;
+    }
+
+    const int total = oldRecords.size();
+    const int chunkSize = qMax(MIN_REENCRYPTION_CHUNK, total / (QThread::idealThreadCount() * 4) + 1);
+
+    // every chunk is re-encrypted by a worker thread with its own ciphers,
+    // all of them stop on an abort or on the first corrupted record.
+    CipherPool newCiphers(&context, aeadAlgorithm(suite));
+    VaultMetrics *metrics = VaultMetrics::current();
+    QAtomicInt corrupted(0);
+    const auto reencryptChunk = [this, &oldRecords, &newCiphers, &corrupted, suite, metrics](int begin, int end) {
+        const VaultMetrics::Scope scope(metrics);
+        CipherPool::Lease oldLease(_ciphers.data());
+        CipherPool::Lease newLease(&newCiphers);
+        QVector<VaultSnapshot::Record> chunk;
+        chunk.reserve(end - begin);
+
+        for (int i = begin; i < end && !_reencryptionAborted.loadAcquire() && !corrupted.loadAcquire(); ++i) {
+            const VaultSnapshot::Record &record = oldRecords.at(i);
+            QByteArray key;
+            QByteArray value = decryptValue(_cipherSuite, oldLease, record.first, record.second, &key);
+            if (key.isEmpty() || value.isEmpty()) {
+                corrupted.storeRelease(1);
+                break;
+            }
+
+            const QByteArray encryptedKey = encryptRecordKey(suite, newLease, key);
+            chunk.append(qMakePair(encryptedKey, encryptValue(suite, newLease, encryptedKey, key, value)));
+            key.fill('\0');
+            value.fill('\0');
+        }
+
+        return chunk;
+    };
+
+    QList<QFuture<QVector<VaultSnapshot::Record>>> futures;
+    for (int begin = 0; begin < total; begin += chunkSize) {
+        const int end = qMin(total, begin + chunkSize);
+        futures.append(QtConcurrent::run([&reencryptChunk, begin, end]() {
+            return reencryptChunk(begin, end);
+        }));
+    }
+
+    int done = 0;
+    for (QFuture<QVector<VaultSnapshot::Record>> &future : futures) {
+        const QVector<VaultSnapshot::Record> chunk = future.result();
+        for (const VaultSnapshot::Record &record : chunk) {
+            records->insert(record.first, record.second);
+        }
+
+        done += chunk.size();
+        QMetaObject::invokeMethod(this, "reencryptionProgress", Qt::QueuedConnection,
+                                  Q_ARG(int, done), Q_ARG(int, total));
+    }
+
+    if (corrupted.loadAcquire()) {
+        qDebug() << "Cannot re-encrypt vault, vault record is corrupted.";
+        records->clear();
+        return false;
+    }
+
+    if (_reencryptionAborted.loadAcquire()) {
+        qDebug() << "Re-encryption is aborted.";
+        records->clear();
+        return false;
+    }
+
+    return true;
+}
+
+bool QVault::openSnapshot()
+{
+    QScopedPointer<VaultSnapshot> snapshot(new VaultSnapshot(_filepath));
+    if (!snapshot->open() || snapshot->version() != VaultSnapshot::Version) {
+        return false;
+    }
+
+    QVariantMap properties;
+    QDataStream headerIn(snapshot->header());
+    headerIn >> properties;
+
+    QScopedPointer<VaultShards> shards;
+    if (!openShards(properties, &shards)) {
+        return false;
+    }
+
+    _snapshot.swap(snapshot);
+    _shards.swap(shards);
+    _shardCount = _shards ? _shards->count() : 1;
+    _roots = headerRoots(properties);
+    _snapshotSize = _snapshot->size() + (_shards ? _shards->size() : 0);
+
+    return true;
+}
+
+bool QVault::openShards(const QVariantMap &properties, QScopedPointer<VaultShards> *shards) const
+{
+    const QStringList names = properties.value(HEADER_SHARDS).toStringList();
+    if (names.isEmpty()) {
+        shards->reset();
+        return true;
+    }
+
+    shards->reset(new VaultShards(VaultShards::directoryPath(_filepath)));
+    if (!(*shards)->open(names, _context->macKey())) {
+        shards->reset();
+        return false;
+    }
+
+    return true;
+}
+
+bool QVault::writeShards(QStringList *names, QList<QByteArray> *roots, QStringList *written)
+{
+    const QString directory = VaultShards::directoryPath(_filepath);
+    // a view of the arena block, the key is not copied to the heap
+    const QByteArray macKey = _context->macKey();
+
+    // shards keep their files unless their records changed or all records are redistributed
+    const bool redistributed = _cleared || !_shards || _shards->count() != _shardCount;
+    QVector<bool> changed(_shardCount, redistributed);
+    for (auto it = _records.constBegin(); it != _records.constEnd(); ++it) {
+        changed[VaultShards::shardOf(it.key(), _shardCount)] = true;
+    }
+
+    // kept shards keep their roots, files written before roots were introduced get them now
+    *names = redistributed ? QStringList() : _shards->names();
+    roots->clear();
+    for (int i = 0; i < _shardCount; ++i) {
+        if (names->size() <= i) {
+            names->append(QString());
+        }
+        if (changed.at(i)) {
+            roots->append(QByteArray());
+        } else {
+            roots->append(_roots.isEmpty() ? _shards->shard(i).merkleRoot() : _roots.value(i));
+        }
+    }
+
+    // changed shards are merged, verified, sorted, hashed and written in parallel,
+    // workers report the time spent writing their files to the metrics of the save
+    using Written = QPair<QString, QByteArray>;
+    QList<QPair<int, QFuture<Written>>> futures;
+    VaultMetrics *metrics = VaultMetrics::current();
+    for (int i = 0; i < _shardCount; ++i) {
+        if (changed.at(i)) {
+            futures.append(qMakePair(i, QtConcurrent::run([this, i, &directory, &macKey, metrics]() {
+                const VaultMetrics::Scope scope(metrics);
+                QVector<VaultSnapshot::Record> records;
+                if (!mergedRecords(&records, i)) {
+                    return Written();
+                }
+                const QByteArray root = MerkleTree::root(records);
+                const QString name = root.isEmpty() ? QString() :
+                                                      VaultShards::write(directory, i, _shardCount, macKey, records);
+                return qMakePair(name, root);
+            })));
+        }
+    }
+
+    bool success = true;
+    for (QPair<int, QFuture<Written>> &future : futures) {
+        const Written shard = future.second.result();
+        if (shard.first.isEmpty()) {
+            success = false;
+            continue;
+        }
+        names->replace(future.first, shard.first);
+        roots->replace(future.first, shard.second);
+        written->append(shard.first);
+    }
+
+    if (success && _syncPolicy != NoSync) {
+        const VaultMetrics::Scope disk(VaultMetrics::Disk);
+        syncDirectory(directory);
+    }
+
+    return success;
+}
+
+void QVault::apply(const VaultJournal::Batch &batch)
+{
+    for (const VaultJournal::Entry &entry : batch) {
+        switch (entry.op) {
+        case VaultJournal::Set:
+            _records.insert(entry.key, entry.value);
+            _cache.remove(entry.key);
+            if (_keysBuilt) {
+                indexKey(entry.key, entry.value);
+            }
+            break;
+        case VaultJournal::Remove:
+            // an empty value hides the record of the snapshot
+            _records.insert(entry.key, QByteArray());
+            _cache.remove(entry.key);
+            _keys.remove(entry.key);
+            break;
+        case VaultJournal::Clear:
+            _records.clear();
+            _cleared = true;
+            _cache.clear();
+            _keys.clear();
+            break;
+        }
+    }
+}
+
+bool QVault::write(const VaultJournal::Batch &batch)
+{
+    apply(batch);
+
+    if (_inTransaction) {
+        _transaction.append(batch);
+        return true;
+    }
+
+    return persistPending(batch);
+}
+
+QFuture<bool> QVault::writeBehind(const VaultJournal::Batch &batch, const QStringList &blobs)
+{
+    apply(batch);
+
+    if (_inTransaction) {
+        _transaction.append(batch);
+        _transactionBlobs.append(blobs);
+        return finishedFuture(true);
+    }
+
+    PendingWrite pending;
+    pending.batch = batch;
+    pending.blobs = blobs;
+    pending.promise.reportStarted();
+    _pending.append(pending);
+
+    scheduleWriter();
+
+    return pending.promise.future();
+}
+
+void QVault::scheduleWriter()
+{
+    if (!_writerScheduled) {
+        _writerScheduled = true;
+        QtConcurrent::run(&_writer, [this]() { writePending(); });
+    }
+}
+
+void QVault::writePending()
+{
+    QWriteLocker locker(&_lock);
+
+    _writerScheduled = false;
+
+    // changes written behind are timed as a part of the operations that queued them
+    const VaultMetrics::Scope scope(_metrics.load());
+
+    // uncommitted changes must not reach the disk, the commit writes pending changes too
+    if (_locked || _inTransaction) {
+        return;
+    }
+
+    persistPending(VaultJournal::Batch());
+}
+
+bool QVault::persistPending(const VaultJournal::Batch &batch)
+{
+    QList<PendingWrite> pending;
+    pending.swap(_pending);
+
+    // all pending writes are coalesced into one journal frame, written before
+    // the batch so the journal keeps the order in which changes were made.
+    VaultJournal::Batch combined;
+    for (const PendingWrite &write : pending) {
+        combined.append(write.batch);
+    }
+    combined.append(batch);
+
+    bool success = true;
+    if (!combined.isEmpty()) {
+        // changes written by other processes are read first,
+        // so the vault file is never overwritten with a stale state.
+        QLockFile fileLock(lockPath(_filepath));
+        success = lockVaultFile(&fileLock) && refreshState(combined, false) && persist(combined);
+    }
+
+    for (PendingWrite &write : pending) {
+        if (success) {
+            for (const QString &blob : write.blobs) {
+                QFile::remove(blob);
+            }
+        }
+        write.promise.reportResult(success);
+        write.promise.reportFinished();
+    }
+
+    // queued, so receivers never run while the vault is locked for writing
+    if (!pending.isEmpty()) {
+        QMetaObject::invokeMethod(this, "saved", Qt::QueuedConnection, Q_ARG(bool, success));
+    }
+
+    return success;
+}
+
+QFuture<bool> QVault::finishedFuture(bool result)
+{
+    QFutureInterface<bool> promise;
+    promise.reportStarted();
+    promise.reportResult(result);
+    promise.reportFinished();
+
+    return promise.future();
+}
+
+bool QVault::lockVaultFile(QLockFile *fileLock) const
+{
+    if (!fileLock->tryLock(LOCK_TIMEOUT_MILLIS)) {
+        qDebug() << "Failed to lock vault file" << _filepath << fileLock->error();
+        return false;
+    }
+
+    return true;
+}
+
+bool QVault::refreshState(const VaultJournal::Batch &unpersisted, bool reload)
+{
+    QScopedPointer<VaultSnapshot> snapshot(new VaultSnapshot(_filepath));
+    if (!snapshot->open()) {
+        qDebug() << "Failed to refresh vault. Vault file is corrupted.";
+        return false;
+    }
+
+    QVariantMap properties;
+    QDataStream headerIn(snapshot->header());
+    headerIn >> properties;
+
+    const QByteArray epoch = properties.value(HEADER_EPOCH).toByteArray();
+    const quint64 generation = properties.value(HEADER_GENERATION).toULongLong();
+    const bool changed = reload || epoch != _epoch || generation != _generation;
+
+    QList<VaultJournal::Batch> batches;
+
+    if (changed) {
+        // a new snapshot has been written, the state is rebuilt from it
+        CipherSuite suite;
+        if (snapshot->version() != VaultSnapshot::Version ||
+                snapshot->headerMac() != generateHmac(_context->macKey(), snapshot->header()) ||
+                !headerCipherSuite(properties, &suite) || suite != _cipherSuite ||
+                headerSeparateKeyMac(properties) != _context->hasSeparateKeyMac()) {
+            qDebug() << "Failed to refresh vault. Vault data key has been replaced or vault file is corrupted.";
+            return false;
+        }
+
+        QScopedPointer<VaultJournal> journal(new VaultJournal(VaultJournal::journalPath(_filepath),
+                                                              _context->macKey(),
+                                                              epoch));
+        if (!journal->replay(&batches)) {
+            return false;
+        }
+
+        QScopedPointer<VaultShards> shards;
+        if (!openShards(properties, &shards)) {
+            qDebug() << "Failed to refresh vault. Shard files are missing or corrupted.";
+            return false;
+        }
+
+        _snapshot.swap(snapshot);
+        _shards.swap(shards);
+        _shardCount = _shards ? _shards->count() : 1;
+        _roots = headerRoots(properties);
+        _snapshotSize = _snapshot->size() + (_shards ? _shards->size() : 0);
+        _journal.swap(journal);
+        _records.clear();
+        _cleared = false;
+        _cache.clear();
+        resetKeys();
+        _epoch = epoch;
+        _generation = generation;
+        _keySlots = headerKeySlots(properties);
+    } else if (_journal && !_journal->replay(&batches)) {
+        return false;
+    }
+
+    if (!changed && batches.isEmpty()) {
+        return true;
+    }
+
+    for (const VaultJournal::Batch &batch : batches) {
+        apply(batch);
+    }
+
+    // changes not written yet are made after the ones just read
+    apply(unpersisted);
+
+    return true;
+}
+
+bool QVault::persist(const VaultJournal::Batch &batch)
+{
+    if (!_journal || _epoch.isEmpty()) {
+        return save();
+    }
+
+    const auto isClear = [](const VaultJournal::Entry &entry) {
+        return entry.op == VaultJournal::Clear;
+    };
+
+    // a cleared vault is cheaper to write as a snapshot than as a journal frame
+    if (std::any_of(batch.constBegin(), batch.constEnd(), isClear)) {
+        return save();
+    }
+
+    bool appended;
+    {
+        const VaultMetrics::Scope disk(VaultMetrics::Disk);
+        appended = _journal->append(batch);
+    }
+
+    if (!appended) {
+        qDebug() << "Failed to append to journal, writing the full snapshot.";
+        return save();
+    }
+
+    // compaction keeps the journal proportional to the snapshot,
+    // so the amortized cost of a write stays O(record size).
+    if (_journal->size() > qMax(MIN_COMPACTION_SIZE, _snapshotSize)) {
+        if (!save()) {
+            qDebug() << "Failed to compact journal, changes are kept in the journal.";
+        }
+        return !_locked;
+    }
+
+    return syncJournal();
+}
+
+bool QVault::syncJournal()
+{
+    const VaultMetrics::Scope scope(VaultMetrics::Disk);
+
+    switch (_syncPolicy) {
+    case NoSync:
+        return true;
+    case SyncEveryWrite:
+        return _journal->sync();
+    case GroupCommit:
+        // writes within the interval share one sync issued by the timer,
+        // or by the first write after the interval if there is no event loop.
+        if (_lastSync.isValid() && _lastSync.elapsed() < _syncInterval) {
+            // timers can be started only from the thread of the vault
+            if (!_syncTimer.isActive() && QThread::currentThread() == thread()) {
+                _syncTimer.start(int(_syncInterval - _lastSync.elapsed()));
+            }
+            return true;
+        }
+        _syncTimer.stop();
+        _lastSync.start();
+        return _journal->sync();
+    }
+
+    return true;
+}
+
+void QVault::flushJournal()
+{
+    const VaultMetrics::Scope scope(VaultMetrics::Disk);
+
+    _syncTimer.stop();
+
+    if (_journal && _syncPolicy != NoSync) {
+        _lastSync.start();
+        _journal->sync();
+    }
+}
+
+bool QVault::save()
+{
+    const VaultMetrics::Scope scope(_metrics.load(), VaultMetrics::Save);
+
+    // shards are written first and named by the vault file once all of them
+    // are written, files of a failed save are never named and are removed.
+    const QString shardsPath = VaultShards::directoryPath(_filepath);
+    QStringList shards;
+    QList<QByteArray> roots;
+    QStringList writtenShards;
+    const auto removeWrittenShards = [&shardsPath, &writtenShards]() {
+        for (const QString &name : writtenShards) {
+            QFile::remove(QDir(shardsPath).filePath(name));
+        }
+    };
+    if (_shardCount > 1 && !writeShards(&shards, &roots, &writtenShards)) {
+        qDebug() << "Failed to write shard files" << shardsPath;
+        removeWrittenShards();
+        return false;
+    }
+
+    // records are merged from verified files only, so tampered records are never
+    // authenticated by the new root. When there is nothing to merge, the records
+    // are copied as they are and keep their root, the file is rewritten still.
+    const bool copyRecords = _shardCount == 1 && _snapshot && !_shards && !_cleared && _records.isEmpty();
+    QVector<VaultSnapshot::Record> records;
+    if (copyRecords) {
+        roots.append(_roots.isEmpty() ? _snapshot->merkleRoot() : _roots.first());
+    } else if (_shardCount == 1) {
+        if (!mergedRecords(&records)) {
+            qDebug() << "Failed to write vault file" << _filepath;
+            return false;
+        }
+        roots.append(MerkleTree::root(records));
+    }
+
+    if (roots.contains(QByteArray())) {
+        qDebug() << "Failed to hash vault records" << _filepath;
+        removeWrittenShards();
+        return false;
+    }
+
+    const QByteArray epoch = rand(EPOCH_SIZE);
+    const quint64 generation = _generation + 1;
+    const QByteArray header = headerData(_keySlots,
+                                         _cipherSuite,
+                                         epoch,
+                                         generation,
+                                         shards,
+                                         roots,
+                                         _context->hasSeparateKeyMac());
+    const QByteArray headerMac = generateHmac(_context->macKey(), header);
+
+    qint64 size = 0;
+    {
+        // records are merged, sorted and hashed above, only the file is timed as disk work
+        const VaultMetrics::Scope disk(VaultMetrics::Disk);
+
+        // the new snapshot is written next to the old one and renamed over it,
+        // so a crash or a full disk never leaves a partially written vault.
+        QSaveFile vault(_filepath);
+        if (!vault.open(QFile::WriteOnly)) {
+            qDebug() << "Failed to open vault file for write" << _filepath;
+            removeWrittenShards();
+            return false;
+        }
+
+        // a sharded vault file holds no records
+        bool written = false;
+        if (copyRecords) {
+            written = VaultSnapshot::write(&vault, header, headerMac, *_snapshot);
+        } else {
+            written = VaultSnapshot::write(&vault, header, headerMac, records);
+        }
+
+        if (!written) {
+            qDebug() << "Failed to write vault file" << _filepath;
+            vault.cancelWriting();
+            removeWrittenShards();
+            return false;
+        }
+
+        size = vault.size();
+        for (const QString &name : writtenShards) {
+            size += QFileInfo(QDir(shardsPath).filePath(name)).size();
+        }
+
+        // the mapped snapshot must be released before the file can be replaced on all platforms.
+        _snapshot.reset();
+
+        if (!vault.commit()) {
+            qDebug() << "Failed to write vault file" << _filepath;
+            removeWrittenShards();
+            if (!openSnapshot()) {
+                qDebug() << "Failed to reopen vault file, vault is locked." << _filepath;
+                wipe();
+            }
+            return false;
+        }
+
+        if (_syncPolicy != NoSync) {
+            syncDirectory(QFileInfo(_filepath).absolutePath());
+        }
+    }
+
+    if (VaultMetrics *metrics = _metrics.load()) {
+        metrics->fileSaved(size);
+    }
+
+    _records.clear();
+    _cleared = false;
+    _epoch = epoch;
+    _generation = generation;
+
+    if (!openSnapshot()) {
+        qDebug() << "Failed to reopen vault file, vault is locked." << _filepath;
+        wipe();
+        return false;
+    }
+
+    // shard files replaced by this save are not mapped anymore
+    VaultShards::removeUnused(shardsPath, shards);
+
+    if (!_journal) {
+        _journal.reset(new VaultJournal(VaultJournal::journalPath(_filepath), _context->macKey(), epoch));
+    }
+
+    return _journal->reset(epoch);
+}
@@ -4,23 +4,83 @@
 #include <QObject>
 #include <QVariant>
 #include <QList>
+#include <QHash>
 #include <QByteArray>
 #include <QScopedPointer>
+#include <QElapsedTimer>
+#include <QTimer>
+#include <QReadWriteLock>
+#include <QMutex>
+#include <QFuture>
+#include <QFutureInterface>
+#include <QThreadPool>
+#include <QAtomicInt>
+#include <QAtomicPointer>
+#include <QStringList>
+
+#include <CipherPool.h>
+#include <ValueCache.h>
+#include <SortedKeys.h>
+#include <VaultMetrics.h>
+#include <VaultJournal.h>
+#include <VaultSnapshot.h>
+#include <Kdf.h>
+#include <SecureArena.h>
 
 class CryptoContext;
-class AesCipher;
+class QLockFile;
+class VaultSession;
+class VaultBlob;
+class VaultShards;
+class QIODevice;
 
 /**
  * @brief QVault is the encrypted key-value store.
  * @details
  * The store is encrypted with AES256 cipher (using OpenSSL library).
- * The encryption key is derived from user password and never kept in memory.
+ * Every record is encrypted and authenticated on its own with a random nonce,
+ * so it is verified when read. Records are encrypted with a random data key, kept in the vault header
+ * wrapped with keys derived from one or more passwords. Neither the
+ * passwords nor the derived keys are kept in memory.
  * Values are accessed individually, not decrypting the whole store.
+ * Mutations are appended to an authenticated journal next to the vault file
+ * and folded back into the vault snapshot once the journal grows too large.
  * The solution is optimized for ultimate security, rather than performance.
+ *
+ * All methods are thread-safe. Any number of threads may read values in
+ * parallel, while writes, lock(), unlock() and password changes are exclusive.
+ * A transaction belongs to the vault, not to the thread that started it,
+ * so writes of other threads made in the meantime become part of it.
+ *
+ * Several processes may open the same vault. Writes are serialized with
+ * a lock file next to the vault file and catch up with changes of other
+ * processes before writing, readers pick them up with refresh().
  */
 class QVault : public QObject
 {
+    Q_OBJECT
+
 public:
+    /**
+     * @brief Defines when journal writes are forced to stable storage.
+     */
+    enum SyncPolicy {
+        NoSync,         ///< the OS decides when to flush, fastest and least durable.
+        SyncEveryWrite, ///< every write is synced before it returns.
+        GroupCommit     ///< writes are synced at most once per interval.
+    };
+
+    /**
+     * @brief Defines how records are encrypted.
+     */
+    enum CipherSuite {
+        AesCbc,          ///< AES-256-CBC with a fixed IV and no record authentication, for older vaults.
+                         ///< Vaults written while the cipher read its AES-256 key from a 16-byte
+                         ///< buffer cannot be opened, their key depended on memory past it.
+        AesGcm,          ///< AES-256-GCM, the fastest one on CPUs with AES instructions.
+        ChaCha20Poly1305 ///< ChaCha20-Poly1305, the fastest one on CPUs without them.
+    };
+
     /**
      * @brief Initializes the instance.
      * @param filepath of the existing vault file.
@@ -28,23 +88,106 @@ public:
      * @note No data is read or decrypted in this call. Initial state is locked.
      */
     explicit QVault(const QString &filepath, QObject *parent = nullptr);
-    ~QVault() = default;
+    ~QVault();
 
     /**
      * @brief Creates a new vault file protected with the specified password.
      * @param filepath of a vault file to be created.
      * @param password.
+     * @param algorithm to derive keys from the password, calibrated for this machine.
+     * @param suite - cipher suite of the records.
      * @return true if the new vault file is created.
      */
-    static bool create(const QString &filepath, const QString &password);
+    static bool create(const QString &filepath,
+                       const QString &password,
+                       Kdf::Algorithm algorithm = Kdf::defaultAlgorithm(),
+                       CipherSuite suite = AesGcm);
+
+    /**
+     * @brief Creates a new vault file with explicit KDF parameters, skipping calibration.
+     * @param kdf - parameters from Kdf::calibratedParameters() or Kdf::parameters(),
+     *        possibly with a cost set by hand.
+     * @return false if the parameters are invalid or the vault file cannot be created.
+     */
+    static bool create(const QString &filepath,
+                       const QString &password,
+                       const QVariantMap &kdf,
+                       CipherSuite suite = AesGcm);
 
     /**
-     * @brief Changes the password by re-encrypting the entire vault.
+     * @brief Changes the password the vault was unlocked with.
      * @param newPassword.
+     * @param algorithm to derive keys from the new password.
+     * @return true if operation was successful.
+     * @note Only the wrapped data key changes, records are neither decrypted nor
+     *       re-encrypted. The vault file is still rewritten with the new header,
+     *       copying its records as they are, so the cost grows with the size of
+     *       the vault file, unless the vault is sharded and the file holds the
+     *       header only. Other passwords of the vault stay valid.
+     * @note Vaults created before data keys were introduced are re-encrypted
+     *       with a new data key once, as by rotateDataKey().
+     */
+    bool changePassword(const QString &newPassword,
+                        Kdf::Algorithm algorithm = Kdf::defaultAlgorithm());
+
+    /**
+     * @brief Changes the password with explicit KDF parameters, skipping calibration.
+     * @see create()
+     */
+    bool changePassword(const QString &newPassword, const QVariantMap &kdf);
+
+    /**
+     * @brief Adds another password that unlocks the vault.
+     * @param password.
+     * @param algorithm to derive keys from the password.
+     * @return false if the vault is locked or has no data key yet,
+     *         changePassword() gives it one.
+     */
+    bool addPassword(const QString &password,
+                     Kdf::Algorithm algorithm = Kdf::defaultAlgorithm());
+
+    /**
+     * @brief Adds another password with explicit KDF parameters, skipping calibration.
+     * @see create()
+     */
+    bool addPassword(const QString &password, const QVariantMap &kdf);
+
+    /**
+     * @brief Removes a password, so it no longer unlocks the vault.
+     * @param password.
+     * @return false if no such password exists or it is the only one.
+     * @note Anybody who knew the password may have kept the data key,
+     *       use rotateDataKey() to lock them out for sure.
+     */
+    bool removePassword(const QString &password);
+
+    /**
+     * @brief Replaces the data key by re-encrypting the entire vault.
+     * @param password - becomes the only password of the vault.
+     * @param algorithm to derive keys from the password.
      * @return true if operation was successful.
-     * @note All work is done synchronously.
+     * @note Records are re-encrypted by a thread pool and written at once,
+     *       reencryptionProgress() reports how many are done.
+     * @note Records of AesCbc vaults are moved to AesGcm, other suites are kept.
+     * @see abortReencryption()
+     */
+    bool rotateDataKey(const QString &password,
+                       Kdf::Algorithm algorithm = Kdf::defaultAlgorithm());
+
+    /**
+     * @brief Replaces the data key with explicit KDF parameters, skipping calibration.
+     * @see create()
      */
-    bool changePassword(const QString &newPassword);
+    bool rotateDataKey(const QString &password, const QVariantMap &kdf);
+
+    /**
+     * @brief Aborts the re-encryption in progress, or the next one if none is running.
+     *        The vault keeps its keys and passwords.
+     * @note Can be called from any thread. Applies to a rotateDataKey() already called,
+     *       also while it waits for the vault or derives keys. Without one, the next
+     *       re-encryption fails at once, so an abort is never lost to a race.
+     */
+    void abortReencryption();
 
     /**
      * @brief Unlocks vault by checking the password and preparing AES keys.
@@ -54,6 +197,22 @@ public:
      */
     bool unlock(const QString &password);
 
+    /**
+     * @brief Unlocks vault with keys kept by the session, without the password.
+     * @param session - a session started with startSession().
+     * @return false if the session has expired, belongs to another vault,
+     *         or the vault password has been changed since.
+     */
+    bool unlock(VaultSession *session);
+
+    /**
+     * @brief Keeps the keys of the unlocked vault in the session.
+     * @param session - receives the keys, replacing keys it held before.
+     * @return false if the vault is locked.
+     * @note The session is not affected by lock(), wipe it when no longer needed.
+     */
+    bool startSession(VaultSession *session) const;
+
     /**
      * @brief Locks vault by removing AES keys from memory.
      * @note In the locked state, no values can be written or read.
@@ -66,12 +225,100 @@ public:
      */
     bool isLocked() const;
 
+    /**
+     * @brief Gets the cipher suite of the records.
+     * @note Only known while the vault is unlocked, AesCbc is returned otherwise.
+     */
+    CipherSuite cipherSuite() const;
+
     /**
      * @brief Gets vault file path specified in ctor.
      * @return Vault file path.
      */
     QString filepath() const;
 
+    /**
+     * @brief Gets the directory holding blob files of values written by writeStream().
+     */
+    static QString blobsPath(const QString &filepath);
+
+    /**
+     * @brief Sets the durability policy of writes.
+     * @param policy - see SyncPolicy.
+     * @param intervalMillis - group commit interval, ignored by other policies.
+     * @note The vault file itself is always replaced atomically and synced.
+     */
+    void setSyncPolicy(SyncPolicy policy, int intervalMillis = 10);
+
+    /**
+     * @brief Gets the durability policy of writes.
+     */
+    SyncPolicy syncPolicy() const;
+
+    /**
+     * @brief Enables compression of large values before they are encrypted.
+     * @note Compressed size depends on the content, so do not enable it
+     *       when values mix secrets with data an attacker can choose.
+     */
+    void setCompression(bool enabled);
+
+    /**
+     * @brief Gets whether large values are compressed, false by default.
+     */
+    bool compression() const;
+
+    /**
+     * @brief Sets the memory budget of the cache of decrypted values.
+     * @param bytes - size of cached record keys and values, zero disables the cache.
+     * @note The cache is disabled by default. Cached values are zeroed
+     *       when they are evicted, changed or the vault is locked.
+     */
+    void setCacheBudget(int bytes);
+
+    /**
+     * @brief Gets the memory budget of the cache of decrypted values.
+     */
+    int cacheBudget() const;
+
+    /**
+     * @brief Gets the number of reads served by the cache of decrypted values.
+     */
+    quint64 cacheHits() const;
+
+    /**
+     * @brief Gets the number of reads missed by the cache of decrypted values.
+     */
+    quint64 cacheMisses() const;
+
+    /**
+     * @brief Sets the metrics receiving operation latencies and timings.
+     * @param metrics - not owned, it must outlive the vault or be unset. Null disables metrics.
+     * @note Metrics are disabled by default, nothing is timed then.
+     */
+    void setMetrics(VaultMetrics *metrics);
+
+    /**
+     * @brief Gets the metrics set with setMetrics(), or null.
+     */
+    VaultMetrics *metrics() const;
+
+    /**
+     * @brief Splits records into shard files, or merges them back into the vault file.
+     * @param count - number of shards, 1 keeps all records in the vault file.
+     * @return false if the vault is locked, in a transaction or cannot be written.
+     * @details
+     * Shard files are kept in `<vault>.shards` next to the vault file, which then
+     * holds the header only. When the journal is folded back, only shards with
+     * changed records are rewritten, in parallel, and header changes such as
+     * password changes rewrite none of them.
+     */
+    bool setShardCount(int count);
+
+    /**
+     * @brief Gets the number of shards, 1 if the vault is not sharded.
+     */
+    int shardCount() const;
+
     /**
      * @brief Gets a value idenfied by the specified key.
      * @param key to find the corresponding value.
@@ -81,16 +328,89 @@ public:
      */
     QVariant getValue(const QString &key, bool *ok);
 
+    /**
+     * @brief Reads a byte array value as it is, without a QVariant round trip.
+     * @param key to find the corresponding value.
+     * @param value - receives the bytes, its buffer is reused if large enough.
+     * @return false if the key is not found, the value is not a byte array
+     *         or the record is corrupted.
+     * @note Repeated reads into the same buffer allocate no memory in the vault,
+     *       unless the key has non-ASCII characters.
+     * @note Not allowed in locked state.
+     */
+    bool readValue(const QString &key, QByteArray *value);
+
+    /**
+     * @brief Encrypts a large value read from the device into its own blob file.
+     * @param key - an existing value of the key is replaced.
+     * @param source - an open device, read until read() returns no data.
+     * @return true if both the blob and the value referring to it are written.
+     * @note The value is encrypted in chunks, so memory use does not depend on its size.
+     *       The blob file is written without locking the vault, other threads wait
+     *       only while the value referring to it is written.
+     * @note Sequential devices are waited for more data at most 30 seconds at a time,
+     *       the write fails if none comes.
+     * @note Writes replacing or removing a stream delete its blob file once they are written,
+     *       clear() deletes the blobs directory.
+     * @note Not allowed in locked state or during a transaction.
+     */
+    bool writeStream(const QString &key, QIODevice *source);
+
+    /**
+     * @brief Decrypts a value written by writeStream() into the device.
+     * @param output - an open device to write to.
+     * @return false if the key is not found, the value is not a stream
+     *         or its blob file is corrupted.
+     * @note The output may receive a part of the value before a corrupted chunk is found.
+     * @note Not allowed in locked state. The blob file is read without holding the vault,
+     *       so a stream replaced or removed before its file is opened fails to read.
+     */
+    bool readStream(const QString &key, QIODevice *output);
+
+    /**
+     * @brief Checks whether a value with the key exists.
+     * @note Not allowed in locked state.
+     */
+    bool contains(const QString &key);
+
+    /**
+     * @brief Gets keys starting with the prefix in ascending order.
+     * @param prefix - all keys are returned if empty.
+     * @return empty list if the vault is locked or a record is corrupted.
+     * @note The first call decrypts keys of all records into an in-memory index,
+     *       later calls find keys in O(log n + k). The index is wiped on lock().
+     */
+    QStringList keys(const QString &prefix = QString());
+
     /**
      * @brief Sets a value identified by the specified key.
      * @param key that identifies the value.
-     * @return true if the value is encrypted and written to vault file.
+     * @return true if the value is encrypted and written to vault journal.
      * @note Not allowed in locked state.
      * @note Existing key will be overwritten.
      * @note All changes are written to disk synchronously.
      */
     bool setValue(const QString& key, const QVariant &value);
 
+    /**
+     * @brief Sets a value without waiting for it to be written.
+     * @param key that identifies the value.
+     * @return Future receiving true once the value is written to vault journal.
+     * @note The value is readable right away, pending writes are coalesced
+     *       into a single write by a background writer thread.
+     * @note Within a transaction, the value is staged as by setValue().
+     */
+    QFuture<bool> setValueAsync(const QString &key, const QVariant &value);
+
+    /**
+     * @brief Sets multiple values with a single write.
+     * @param values - key-value pairs to set.
+     * @return true if all values are encrypted and written to vault journal.
+     * @note Not allowed in locked state.
+     * @note Either all or none of the values are persisted.
+     */
+    bool setValues(const QVariantMap &values);
+
     /**
      * @brief Remove a value idenfied by the specified key.
      * @param key to find the corresponding value.
@@ -100,34 +420,265 @@ public:
      */
     bool removeValue(const QString& key);
 
+    /**
+     * @brief Removes a value without waiting for it to be written.
+     * @param key to find the corresponding value.
+     * @return Future receiving true once the removal is written to vault journal.
+     * @see setValueAsync()
+     */
+    QFuture<bool> removeValueAsync(const QString &key);
+
+    /**
+     * @brief Writes all pending asynchronous changes and syncs them to disk.
+     * @return true if all changes are durable.
+     * @note Not allowed during a transaction.
+     */
+    bool flush();
+
+    /**
+     * @brief Reads changes written by other processes or vault instances.
+     * @return false if the vault file cannot be read or its data key has been replaced.
+     * @note Only new journal frames are read unless the vault file itself was rewritten.
+     *       Writes always refresh the vault before writing, so no changes are lost.
+     * @note Not allowed during a transaction.
+     */
+    bool refresh();
+
+    /**
+     * @brief Checks that no record of the vault files has been modified, removed,
+     *        added or replaced with an older one.
+     * @return false if the vault is locked or its records do not match the roots
+     *         of their Merkle trees, kept in the authenticated vault header.
+     * @details
+     * Unlocking does not read records, so every vault file is verified the first
+     * time any of its records is read, and a file that fails serves no records.
+     * The first read of a file therefore hashes all of it. This call hashes every
+     * vault file again, in parallel.
+     * @note Vaults written before the roots were introduced get them when their
+     *       records are next merged into a new vault file. Until then their
+     *       records are read unverified and this call returns false.
+     */
+    bool verify();
+
     /**
      * @brief Clears all values.
      * @return true if all value were removed.
-     * @note All changes are written to disk synchronously.
+     * @note All changes are written to disk synchronously, the blobs directory
+     *       of streamed values is deleted after them.
      */
     bool clear();
 
+    /**
+     * @brief Starts a transaction.
+     * @return false if vault is locked or a transaction is already started.
+     * @details
+     * Changes made within a transaction are visible to this instance
+     * immediately, but written to disk with a single write on commit().
+     */
+    bool beginTransaction();
+
+    /**
+     * @brief Writes all changes of the current transaction.
+     * @return true if changes are written, otherwise changes are rolled back.
+     */
+    bool commit();
+
+    /**
+     * @brief Discards all changes of the current transaction.
+     * @return false if no transaction is started.
+     * @note Locking the vault rolls back the current transaction.
+     */
+    bool rollback();
+
+    /**
+     * @brief Gets whether a transaction is started.
+     */
+    bool isInTransaction() const;
+
+Q_SIGNALS:
+    /**
+     * @brief Emitted after pending asynchronous changes have been written.
+     * @param success - false if the changes could not be written.
+     */
+    void saved(bool success);
+
+    /**
+     * @brief Emitted while replacing the data key, after a part of the records is re-encrypted.
+     * @param done - number of re-encrypted records.
+     * @param total - number of records in the vault.
+     * @note Queued to the vault thread, so it is delivered after the call
+     *       returns, unless the vault is re-encrypted from another thread.
+     */
+    void reencryptionProgress(int done, int total);
+
 private:
     Q_DISABLE_COPY(QVault)
 
 private:
-    // all keys and values are kept encrypted in memory.
-    using Records = QMap<QByteArray, QByteArray>;
+    // changes on top of the mapped snapshot, an empty value marks a removed record.
+    // all keys and values are kept encrypted in memory, keys of authenticated
+    // cipher suites are HMACs of plain keys, which are encrypted with values.
+    using Records = QHash<QByteArray, QByteArray>;
+
+    // maps HMAC of a plain key to its AesCbc encrypted form, so repeated
+    // lookups neither encrypt the key nor keep it in memory. Only keys of
+    // records found in the vault are indexed.
+    using KeyIndex = QHash<QByteArray, QByteArray>;
 
+    struct PendingWrite {
+        VaultJournal::Batch batch;
+        // blob files of replaced streams, deleted once the batch is written
+        QStringList blobs;
+        QFutureInterface<bool> promise;
+    };
+
+    static void syncDirectory(const QString &path);
     static QByteArray rand(int size);
-    static int estimateIterations(const QString &password, const QByteArray &salt);
+    static bool randomSecretKey(SecureArena::Buffer *secretKey);
     static QByteArray generateHmac(const QByteArray &macKey, const QByteArray &secretKey);
-    static QByteArray serializeVariant(const QVariant &value);
-    static QVariant deserializeVariant(const QByteArray &data);
-    static QByteArray generateSecretKey(const QString &password, int iterations, const QByteArray &salt);
+    static void toUtf8(const QString &key, QByteArray *utf8Key);
+    static QByteArray packRecord(const QByteArray &key, const QByteArray &value);
+    static bool unpackRecord(const QByteArray &record, QByteArray *key, QByteArray *value);
+    static int packedValueOffset(const QByteArray &record);
+    static AeadCipher::Algorithm aeadAlgorithm(CipherSuite suite);
+    static QByteArray encryptRecordKey(CipherSuite suite, const CipherPool::Lease &lease, const QByteArray &key);
+    static QByteArray encryptValue(CipherSuite suite,
+                                   const CipherPool::Lease &lease,
+                                   const QByteArray &recordKey,
+                                   const QByteArray &key,
+                                   const QByteArray &value);
+    static QByteArray decryptValue(CipherSuite suite,
+                                   const CipherPool::Lease &lease,
+                                   const QByteArray &recordKey,
+                                   const QByteArray &encryptedValue,
+                                   QByteArray *key = nullptr);
+    static bool decryptRecord(CipherSuite suite,
+                              const CipherPool::Lease &lease,
+                              const QByteArray &recordKey,
+                              const char *encryptedValue,
+                              int size,
+                              QByteArray *record,
+                              int *valueOffset);
+    static QByteArray generateSecretKey(const QString &password,
+                                        const QVariantMap &kdfParameters,
+                                        const QByteArray &salt,
+                                        int size);
+    static QVariantMap wrapSecretKey(const QString &password, const QVariantMap &kdf, const QByteArray &secretKey);
+    static QByteArray unwrapSecretKey(const QString &password, const QVariantMap &keySlot);
+    static bool hasDataKey(const QVariantMap &keySlot);
+    static QFuture<bool> finishedFuture(bool result);
+    static QString lockPath(const QString &vaultPath);
+    static bool decryptKey(CipherSuite suite,
+                           const CipherPool::Lease &lease,
+                           const QByteArray &recordKey,
+                           const QByteArray &encryptedValue,
+                           QByteArray *key);
+    bool buildKeys();
+    void resetKeys();
+    void indexKey(const QByteArray &recordKey, const QByteArray &encryptedValue);
+    static bool streamBlob(CipherSuite suite,
+                           const CipherPool::Lease &lease,
+                           const QByteArray &recordKey,
+                           const QByteArray &encryptedValue,
+                           VaultBlob *blob);
+    bool findBlob(const CipherPool::Lease &lease, const QByteArray &recordKey, VaultBlob *blob);
+    QString blobPath(const VaultBlob &blob) const;
+    void removeBlob(const VaultBlob &blob);
+    bool canWriteStream() const;
+    static QVariantMap headerKdf(const QVariantMap &properties);
+    static QVariantList headerKeySlots(const QVariantMap &properties);
+    static bool headerCipherSuite(const QVariantMap &properties, CipherSuite *suite);
+    static QByteArray headerData(const QVariantList &keySlots,
+                                 CipherSuite suite,
+                                 const QByteArray &epoch,
+                                 quint64 generation,
+                                 const QStringList &shards,
+                                 const QList<QByteArray> &roots,
+                                 bool separateKeyMac);
+    static bool headerSeparateKeyMac(const QVariantMap &properties);
+    static QList<QByteArray> headerRoots(const QVariantMap &properties);
+
+    bool unlock(const QString &password, VaultSession *session);
+    bool deriveSecretKey(const QString &password,
+                         VaultSession *session,
+                         const QVariantList &keySlots,
+                         QVariantMap *keySlot,
+                         SecureArena::Buffer *secretKey) const;
+    bool unlockLegacy(const QByteArray &vaultData, const QString &password, VaultSession *session);
+    bool prepareKeyChange(QLockFile *fileLock);
+    bool saveKeySlots(const QVariantList &keySlots, const QVariantMap &keySlot);
+    bool replaceDataKey(const QString &password, const QVariantMap &kdf);
+    void wipe();
+    void discardTransaction();
+    void setContext(CryptoContext *context, CipherSuite suite);
+    QByteArray recordKey(const QString &key, const CipherPool::Lease &lease);
+    QByteArray recordKey(const QByteArray &utf8Key, const QByteArray &digest, const CipherPool::Lease &lease);
+    bool findRecord(const QByteArray &encryptedKey, QByteArray *encryptedValue) const;
+    bool findRecord(const QByteArray &encryptedKey, const char **encryptedValue, int *size) const;
+    // the mapped files holding records, the shards of a sharded vault or its file
+    QVector<const VaultSnapshot*> sources() const;
+    bool verifySource(int index, const VaultSnapshot &source) const;
+    // all records, or the ones of a shard when the vault has _shardCount shards,
+    // false if a file they are read from fails verification
+    bool mergedRecords(QVector<VaultSnapshot::Record> *records, int shard = -1) const;
+    bool reencrypt(const CryptoContext &context, CipherSuite suite, Records *records);
+    bool openSnapshot();
+    bool openShards(const QVariantMap &properties, QScopedPointer<VaultShards> *shards) const;
+    bool writeShards(QStringList *names, QList<QByteArray> *roots, QStringList *written);
+    bool lockVaultFile(QLockFile *fileLock) const;
+    bool refreshState(const VaultJournal::Batch &unpersisted, bool reload);
+    void apply(const VaultJournal::Batch &batch);
+    bool write(const VaultJournal::Batch &batch);
+    QFuture<bool> writeBehind(const VaultJournal::Batch &batch, const QStringList &blobs = QStringList());
+    void scheduleWriter();
+    void writePending();
+    bool persistPending(const VaultJournal::Batch &batch);
+    bool persist(const VaultJournal::Batch &batch);
+    bool syncJournal();
+    void flushJournal();
+    bool save();
 
-    bool save() const;
+    // guards all state below, readers share it and writers take it exclusively.
+    mutable QReadWriteLock _lock;
 
     QString _filepath;
     bool _locked;
+    QScopedPointer<VaultSnapshot> _snapshot;
+    QScopedPointer<VaultShards> _shards;
+    int _shardCount;
+    // Merkle roots of records in the order of sources()
+    QList<QByteArray> _roots;
     Records _records;
-    QScopedPointer<AesCipher> _cipher;
+    bool _cleared;
+    QByteArray _epoch;
+    qint64 _snapshotSize;
+    quint64 _generation;
+    QVariantList _keySlots;
+    QScopedPointer<VaultJournal> _journal;
+    bool _inTransaction;
+    VaultJournal::Batch _transaction;
+    Records _transactionRecords;
+    QStringList _transactionBlobs;
+    bool _transactionCleared;
+    SyncPolicy _syncPolicy;
+    int _syncInterval;
+    bool _compression;
+    QElapsedTimer _lastSync;
+    QTimer _syncTimer;
+    QThreadPool _writer;
+    bool _writerScheduled;
+    QList<PendingWrite> _pending;
+    QAtomicInt _reencryptionAborted;
     QScopedPointer<CryptoContext> _context;
+    CipherSuite _cipherSuite;
+    QScopedPointer<CipherPool> _ciphers;
+    QReadWriteLock _indexLock;
+    ValueCache _cache;
+    KeyIndex _index;
+    QMutex _keysMutex;
+    SortedKeys _keys;
+    bool _keysBuilt;
+    QAtomicPointer<VaultMetrics> _metrics;
 };
 
 #endif // QVAULT_H
@@ -2,4 +2,5 @@ LIBTARGET = QVaultLib
 BASEDIR   = $${PWD}
 DEPENDPATH  *= $$quote($${BASEDIR})
 INCLUDEPATH *= $$quote($${BASEDIR})
+QT *= concurrent
 LIBS += -L$${DESTDIR} -lQVaultLib
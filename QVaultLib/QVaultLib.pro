@@ -9,6 +9,7 @@
 TEMPLATE = lib
 TARGET = QVaultLib
 QT -= gui
+QT += concurrent
 CONFIG += staticlib
 DESTDIR = ../dist
 
@@ -17,12 +18,42 @@ DEFINES += QT_DEPRECATED_WARNINGS
 SOURCES += \
         QVault.cpp \
     CryptoContext.cpp \
-    AesCipher.cpp
+    AesCipher.cpp \
+    VaultJournal.cpp \
+    Hmac.cpp \
+    VaultSnapshot.cpp \
+    CipherPool.cpp \
+    VaultSession.cpp \
+    Kdf.cpp \
+    AeadCipher.cpp \
+    ValueCodec.cpp \
+    VaultBlob.cpp \
+    ValueCache.cpp \
+    SortedKeys.cpp \
+    VaultMetrics.cpp \
+    VaultShards.cpp \
+    SecureArena.cpp \
+    MerkleTree.cpp
 
 HEADERS += \
         QVault.h \
     CryptoContext.h \
-    AesCipher.h
+    AesCipher.h \
+    VaultJournal.h \
+    Hmac.h \
+    VaultSnapshot.h \
+    CipherPool.h \
+    VaultSession.h \
+    Kdf.h \
+    AeadCipher.h \
+    ValueCodec.h \
+    VaultBlob.h \
+    ValueCache.h \
+    SortedKeys.h \
+    VaultMetrics.h \
+    VaultShards.h \
+    SecureArena.h \
+    MerkleTree.h
 unix {
     target.path = /usr/lib
     INSTALLS += target
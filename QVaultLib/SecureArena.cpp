@@ -0,0 +1,215 @@
+#include "SecureArena.h"
+
+#include <QDebug>
+#include <QMutexLocker>
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+#include <openssl/crypto.h>
+
+#if defined(Q_OS_UNIX)
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+const int GRANULE_SIZE = 16;
+// keys of a vault take a few granules, so a chunk serves many vaults and sessions
+const int CHUNK_SIZE = 16 * 1024;
+
+SecureArena::Buffer::Buffer()
+    : _data(nullptr)
+    , _size(0)
+{
+}
+
+SecureArena::Buffer::Buffer(int size)
+    : _data(size > 0 ? SecureArena::instance()->allocate(size) : nullptr)
+    , _size(_data ? size : 0)
+{
+}
+
+SecureArena::Buffer::Buffer(const QByteArray &data)
+    : Buffer(data.size())
+{
+    if (_data) {
+        memcpy(_data, data.constData(), size_t(_size));
+    }
+}
+
+SecureArena::Buffer::~Buffer()
+{
+    wipe();
+}
+
+void SecureArena::Buffer::wipe()
+{
+    if (_data) {
+        SecureArena::instance()->release(_data, _size);
+        _data = nullptr;
+        _size = 0;
+    }
+}
+
+char *SecureArena::Buffer::data()
+{
+    return _data;
+}
+
+const char *SecureArena::Buffer::constData() const
+{
+    return _data;
+}
+
+int SecureArena::Buffer::size() const
+{
+    return _size;
+}
+
+bool SecureArena::Buffer::isEmpty() const
+{
+    return _size == 0;
+}
+
+QByteArray SecureArena::Buffer::view(int offset, int size) const
+{
+    Q_ASSERT(offset >= 0 && size >= 0 && offset + size <= _size);
+
+    return size > 0 ? QByteArray::fromRawData(_data + offset, size) : QByteArray();
+}
+
+SecureArena::SecureArena()
+    : _used(0)
+{
+}
+
+SecureArena::~SecureArena()
+{
+}
+
+SecureArena *SecureArena::instance()
+{
+    // never destroyed, static objects may still release blocks at exit
+    static SecureArena *arena = new SecureArena();
+    return arena;
+}
+
+char *SecureArena::allocate(int size)
+{
+    Q_ASSERT(size > 0);
+
+    const int granules = (size + GRANULE_SIZE - 1) / GRANULE_SIZE;
+
+    QMutexLocker locker(&_mutex);
+
+    for (Chunk &chunk : _chunks) {
+        if (char *data = allocateIn(&chunk, granules)) {
+            _used += granules * GRANULE_SIZE;
+            return data;
+        }
+    }
+
+    Chunk chunk;
+    if (!mapChunk(qMax(CHUNK_SIZE, granules * GRANULE_SIZE), &chunk)) {
+        qDebug() << "Failed to allocate secure memory.";
+        return nullptr;
+    }
+    _chunks.append(chunk);
+    _used += granules * GRANULE_SIZE;
+
+    return allocateIn(&_chunks.last(), granules);
+}
+
+void SecureArena::release(char *data, int size)
+{
+    Q_ASSERT(data);
+
+    const int granules = (size + GRANULE_SIZE - 1) / GRANULE_SIZE;
+
+    QMutexLocker locker(&_mutex);
+
+    for (Chunk &chunk : _chunks) {
+        if (data >= chunk.data && data < chunk.data + chunk.size) {
+            OPENSSL_cleanse(data, size_t(granules * GRANULE_SIZE));
+            const int first = int(data - chunk.data) / GRANULE_SIZE;
+            chunk.granules.fill(false, first, first + granules);
+            _used -= granules * GRANULE_SIZE;
+            return;
+        }
+    }
+
+    Q_ASSERT_X(false, "SecureArena::release", "the block does not belong to the arena");
+}
+
+bool SecureArena::isLocked() const
+{
+    QMutexLocker locker(&_mutex);
+
+    return std::all_of(_chunks.constBegin(), _chunks.constEnd(), [](const Chunk &chunk) {
+        return chunk.locked;
+    });
+}
+
+int SecureArena::used() const
+{
+    QMutexLocker locker(&_mutex);
+    return _used;
+}
+
+bool SecureArena::mapChunk(int size, Chunk *chunk)
+{
+#if defined(Q_OS_UNIX)
+    const int pageSize = int(sysconf(_SC_PAGESIZE));
+    const int mappedSize = (size + pageSize - 1) / pageSize * pageSize;
+
+    // the pages before and after the chunk stay inaccessible
+    void *mapping = mmap(nullptr, size_t(mappedSize + 2 * pageSize), PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping != MAP_FAILED) {
+        char *data = static_cast<char*>(mapping) + pageSize;
+        if (mprotect(data, size_t(mappedSize), PROT_READ | PROT_WRITE) == 0) {
+            chunk->data = data;
+            chunk->size = mappedSize;
+            chunk->locked = mlock(data, size_t(mappedSize)) == 0;
+            chunk->granules = QBitArray(mappedSize / GRANULE_SIZE);
+            if (!chunk->locked) {
+                qDebug() << "Failed to lock secure memory, keys may be swapped to disk.";
+            }
+#if defined(MADV_DONTDUMP)
+            madvise(data, size_t(mappedSize), MADV_DONTDUMP);
+#endif
+            return true;
+        }
+        munmap(mapping, size_t(mappedSize + 2 * pageSize));
+    }
+#endif
+
+    // without memory mapping, blocks are only zeroed on release
+    char *data = static_cast<char*>(calloc(size_t(size), 1));
+    if (!data) {
+        return false;
+    }
+
+    chunk->data = data;
+    chunk->size = size;
+    chunk->locked = false;
+    chunk->granules = QBitArray(size / GRANULE_SIZE);
+
+    return true;
+}
+
+char *SecureArena::allocateIn(Chunk *chunk, int granules)
+{
+    // first fit, chunks hold few and small blocks
+    int run = 0;
+    for (int i = 0; i < chunk->granules.size(); ++i) {
+        run = chunk->granules.testBit(i) ? 0 : run + 1;
+        if (run == granules) {
+            const int first = i - granules + 1;
+            chunk->granules.fill(true, first, i + 1);
+            return chunk->data + first * GRANULE_SIZE;
+        }
+    }
+
+    return nullptr;
+}
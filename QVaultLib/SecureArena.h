@@ -0,0 +1,121 @@
+#ifndef SECUREARENA_H
+#define SECUREARENA_H
+
+#include <QBitArray>
+#include <QByteArray>
+#include <QMutex>
+#include <QVector>
+
+/**
+ * @brief SecureArena holds key material in memory that is never swapped out.
+ * @details
+ * Memory is reserved in chunks of pages locked into RAM, excluded from core
+ * dumps and surrounded by inaccessible guard pages, so a buffer overrun into
+ * or out of a chunk faults instead of leaking keys. Blocks are carved from
+ * the chunks in 16-byte granules, so keying a context allocates nothing from
+ * the heap, and blocks are zeroed when they are released.
+ *
+ * If the operating system refuses to lock more memory, chunks are still used,
+ * but may be swapped, see isLocked(). On platforms without memory mapping the
+ * arena falls back to ordinary heap memory that is zeroed on release.
+ *
+ * The arena holds keys only: the keys of unlocked vaults and sessions, the
+ * journal MAC key and secret keys while they are generated or unwrapped.
+ * Values and their cipher buffers, KDF and key unwrapping outputs and the key
+ * schedules inside OpenSSL contexts stay on the heap. They are zeroed after
+ * use where the code owns them, but may be swapped.
+ *
+ * The arena lives until the process exits. All methods are thread-safe.
+ */
+class SecureArena
+{
+public:
+    /**
+     * @brief Owns a block of the arena, zeroed when it is released.
+     */
+    class Buffer
+    {
+    public:
+        Buffer();
+
+        /**
+         * @brief Allocates a zeroed block.
+         */
+        explicit Buffer(int size);
+
+        /**
+         * @brief Allocates a block holding a copy of the data.
+         */
+        explicit Buffer(const QByteArray &data);
+
+        ~Buffer();
+
+        /**
+         * @brief Zeroes and releases the block.
+         */
+        void wipe();
+
+        char *data();
+        const char *constData() const;
+        int size() const;
+        bool isEmpty() const;
+
+        /**
+         * @brief Gets a part of the block as a byte array.
+         * @note The data is not copied and is valid until the buffer is wiped or destroyed.
+         */
+        QByteArray view(int offset, int size) const;
+
+    private:
+        Q_DISABLE_COPY(Buffer)
+
+        char *_data;
+        int _size;
+    };
+
+    static SecureArena *instance();
+
+    /**
+     * @brief Allocates a zeroed block, aligned to 16 bytes.
+     */
+    char *allocate(int size);
+
+    /**
+     * @brief Zeroes and releases a block.
+     * @param size - the size the block was allocated with.
+     */
+    void release(char *data, int size);
+
+    /**
+     * @brief Gets whether all chunks are locked into RAM.
+     */
+    bool isLocked() const;
+
+    /**
+     * @brief Gets the number of bytes in allocated blocks.
+     */
+    int used() const;
+
+private:
+    Q_DISABLE_COPY(SecureArena)
+
+    struct Chunk {
+        char *data;
+        int size;
+        bool locked;
+        // one bit per granule, set for allocated ones
+        QBitArray granules;
+    };
+
+    SecureArena();
+    ~SecureArena();
+
+    static bool mapChunk(int size, Chunk *chunk);
+    static char *allocateIn(Chunk *chunk, int granules);
+
+    mutable QMutex _mutex;
+    QVector<Chunk> _chunks;
+    int _used;
+};
+
+#endif // SECUREARENA_H
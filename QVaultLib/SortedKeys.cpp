@@ -0,0 +1,69 @@
+#include "SortedKeys.h"
+
+#include <openssl/crypto.h>
+
+SortedKeys::SortedKeys()
+{
+}
+
+SortedKeys::~SortedKeys()
+{
+    clear();
+}
+
+void SortedKeys::insert(const QString &key, const QByteArray &recordKey)
+{
+    if (_recordKeys.contains(recordKey)) {
+        return;
+    }
+
+    // the key is copied, so zeroing it does not touch strings of callers
+    const QString copy(key.constData(), key.size());
+    _keys.insert(copy, recordKey);
+    _recordKeys.insert(recordKey, copy);
+}
+
+void SortedKeys::remove(const QByteArray &recordKey)
+{
+    const auto recordKeyIt = _recordKeys.find(recordKey);
+    if (recordKeyIt == _recordKeys.end()) {
+        return;
+    }
+
+    const QString key = recordKeyIt.value();
+    _keys.remove(key);
+    _recordKeys.erase(recordKeyIt);
+    wipe(key);
+}
+
+QStringList SortedKeys::keys(const QString &prefix) const
+{
+    QStringList keys;
+
+    for (auto it = _keys.lowerBound(prefix); it != _keys.constEnd() && it.key().startsWith(prefix); ++it) {
+        keys.append(QString(it.key().constData(), it.key().size()));
+    }
+
+    return keys;
+}
+
+int SortedKeys::size() const
+{
+    return _keys.size();
+}
+
+void SortedKeys::clear()
+{
+    for (auto it = _keys.constBegin(); it != _keys.constEnd(); ++it) {
+        wipe(it.key());
+    }
+
+    _keys.clear();
+    _recordKeys.clear();
+}
+
+void SortedKeys::wipe(const QString &key)
+{
+    // all copies of the key belong to the index, so it is zeroed in place
+    OPENSSL_cleanse(const_cast<QChar*>(key.constData()), size_t(key.size()) * sizeof(QChar));
+}
@@ -0,0 +1,48 @@
+#ifndef SORTEDKEYS_H
+#define SORTEDKEYS_H
+
+#include <QByteArray>
+#include <QHash>
+#include <QMap>
+#include <QString>
+#include <QStringList>
+
+/**
+ * @brief SortedKeys is an index of plain keys of vault records.
+ * @details
+ * Keys are kept sorted, so keys with a prefix are found in O(log n + k).
+ * Every key remembers its record key, so records removed by record key are
+ * removed from the index as well. Keys are zeroed when they are removed,
+ * keys returned by the index are copies that are not zeroed.
+ */
+class SortedKeys
+{
+public:
+    SortedKeys();
+    virtual ~SortedKeys();
+
+    void insert(const QString &key, const QByteArray &recordKey);
+    void remove(const QByteArray &recordKey);
+
+    /**
+     * @brief Gets keys starting with the prefix in ascending order.
+     */
+    QStringList keys(const QString &prefix) const;
+
+    int size() const;
+
+    /**
+     * @brief Removes and zeroes all keys.
+     */
+    void clear();
+
+private:
+    Q_DISABLE_COPY(SortedKeys)
+
+    static void wipe(const QString &key);
+
+    QMap<QString, QByteArray> _keys;
+    QHash<QByteArray, QString> _recordKeys;
+};
+
+#endif // SORTEDKEYS_H
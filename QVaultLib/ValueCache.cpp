@@ -0,0 +1,194 @@
+#include "ValueCache.h"
+
+#include <ValueCodec.h>
+
+#include <QMutexLocker>
+
+#include <openssl/crypto.h>
+
+// bookkeeping memory of an entry besides its keys and data
+const int ENTRY_OVERHEAD = 64;
+
+ValueCache::ValueCache()
+    : _budget(0)
+    , _first(nullptr)
+    , _last(nullptr)
+    , _size(0)
+    , _hits(0)
+    , _misses(0)
+{
+}
+
+ValueCache::~ValueCache()
+{
+    clear();
+}
+
+void ValueCache::setBudget(int bytes)
+{
+    Q_ASSERT(bytes >= 0);
+
+    QMutexLocker locker(&_mutex);
+    _budget.store(bytes);
+    shrink(bytes);
+}
+
+int ValueCache::budget() const
+{
+    return _budget.load();
+}
+
+bool ValueCache::value(const QByteArray &recordKey, QVariant *value)
+{
+    Q_ASSERT(value);
+
+    // a disabled cache neither locks nor counts
+    if (_budget.load() == 0) {
+        return false;
+    }
+
+    QMutexLocker locker(&_mutex);
+
+    Entry *entry = find(recordKey);
+    return entry && ValueCodec::decode(entry->data, value);
+}
+
+bool ValueCache::bytes(const QByteArray &recordKey, QByteArray *value)
+{
+    Q_ASSERT(value);
+
+    if (_budget.load() == 0) {
+        return false;
+    }
+
+    QMutexLocker locker(&_mutex);
+
+    Entry *entry = find(recordKey);
+    return entry && ValueCodec::decodeBytes(entry->data.constData(), entry->data.size(), value);
+}
+
+void ValueCache::insert(const QByteArray &recordKey, const char *data, int size)
+{
+    const int cost = ENTRY_OVERHEAD + recordKey.size() + size;
+    if (cost > _budget.load()) {
+        return;
+    }
+
+    QMutexLocker locker(&_mutex);
+
+    Entry *existing = _entries.value(recordKey);
+    if (existing) {
+        evict(existing);
+    }
+
+    // keys and data are copied, so wiping them does not touch buffers of callers
+    Entry *entry = new Entry;
+    entry->recordKey = QByteArray(recordKey.constData(), recordKey.size());
+    entry->data = QByteArray(data, size);
+    entry->cost = cost;
+
+    _entries.insert(entry->recordKey, entry);
+    link(entry);
+    _size += cost;
+
+    shrink(_budget.load());
+}
+
+void ValueCache::remove(const QByteArray &recordKey)
+{
+    if (_budget.load() == 0) {
+        return;
+    }
+
+    QMutexLocker locker(&_mutex);
+
+    Entry *entry = _entries.value(recordKey);
+    if (entry) {
+        evict(entry);
+    }
+}
+
+void ValueCache::clear()
+{
+    QMutexLocker locker(&_mutex);
+    shrink(0);
+}
+
+int ValueCache::size() const
+{
+    QMutexLocker locker(&_mutex);
+    return _size;
+}
+
+quint64 ValueCache::hits() const
+{
+    QMutexLocker locker(&_mutex);
+    return _hits;
+}
+
+quint64 ValueCache::misses() const
+{
+    QMutexLocker locker(&_mutex);
+    return _misses;
+}
+
+ValueCache::Entry *ValueCache::find(const QByteArray &recordKey)
+{
+    Entry *entry = _entries.value(recordKey);
+    if (!entry) {
+        ++_misses;
+        return nullptr;
+    }
+
+    ++_hits;
+    unlink(entry);
+    link(entry);
+
+    return entry;
+}
+
+void ValueCache::link(Entry *entry)
+{
+    entry->previous = nullptr;
+    entry->next = _first;
+    if (_first) {
+        _first->previous = entry;
+    }
+    _first = entry;
+    if (!_last) {
+        _last = entry;
+    }
+}
+
+void ValueCache::unlink(Entry *entry)
+{
+    if (entry->previous) {
+        entry->previous->next = entry->next;
+    } else {
+        _first = entry->next;
+    }
+
+    if (entry->next) {
+        entry->next->previous = entry->previous;
+    } else {
+        _last = entry->previous;
+    }
+}
+
+void ValueCache::evict(Entry *entry)
+{
+    unlink(entry);
+    _entries.remove(entry->recordKey);
+    _size -= entry->cost;
+
+    OPENSSL_cleanse(entry->recordKey.data(), entry->recordKey.size());
+    OPENSSL_cleanse(entry->data.data(), entry->data.size());
+    delete entry;
+}
+
+void ValueCache::shrink(int budget)
+{
+    while (_last && _size > budget) {
+        evict(_last);
+    }
+}
@@ -0,0 +1,101 @@
+#ifndef VALUECACHE_H
+#define VALUECACHE_H
+
+#include <QAtomicInt>
+#include <QByteArray>
+#include <QHash>
+#include <QMutex>
+#include <QVariant>
+
+/**
+ * @brief ValueCache keeps recently read values decrypted, up to a byte budget.
+ * @details
+ * Values are kept encoded by ValueCodec and found by their record key, so no
+ * plain key is kept and a hit costs the key HMAC, a hash lookup and a decode,
+ * with no decryption. Changes applied to records invalidate entries by the
+ * same record keys. The least recently used entries are
+ * evicted once the budget is exceeded; evicted and cleared entries are
+ * zeroed before their memory is released.
+ *
+ * The cache is disabled while its budget is zero. All methods are thread-safe.
+ */
+class ValueCache
+{
+public:
+    ValueCache();
+    virtual ~ValueCache();
+
+    /**
+     * @brief Sets the maximal size of cached record keys and values in bytes.
+     * @note Entries above the new budget are evicted, zero disables the cache.
+     */
+    void setBudget(int bytes);
+    int budget() const;
+
+    /**
+     * @brief Finds and decodes a cached value.
+     * @return false on a miss.
+     */
+    bool value(const QByteArray &recordKey, QVariant *value);
+
+    /**
+     * @brief Finds a cached byte array value, reusing the buffer.
+     * @return false on a miss or if the value is not a byte array.
+     */
+    bool bytes(const QByteArray &recordKey, QByteArray *value);
+
+    /**
+     * @brief Caches an encoded value, replacing the entry of the record.
+     * @param recordKey - key of the record the value is read from.
+     * @param data - value encoded by ValueCodec, it is copied.
+     * @param size - size of the data.
+     */
+    void insert(const QByteArray &recordKey, const char *data, int size);
+
+    /**
+     * @brief Removes the entry of a record.
+     */
+    void remove(const QByteArray &recordKey);
+
+    /**
+     * @brief Removes all entries, hit and miss counters are kept.
+     */
+    void clear();
+
+    /**
+     * @brief Gets the size of cached record keys and values in bytes.
+     */
+    int size() const;
+
+    quint64 hits() const;
+    quint64 misses() const;
+
+private:
+    Q_DISABLE_COPY(ValueCache)
+
+    struct Entry {
+        QByteArray recordKey;
+        QByteArray data;
+        int cost;
+        Entry *previous;
+        Entry *next;
+    };
+
+    Entry *find(const QByteArray &recordKey);
+    void link(Entry *entry);
+    void unlink(Entry *entry);
+    void evict(Entry *entry);
+    void shrink(int budget);
+
+    mutable QMutex _mutex;
+    QAtomicInt _budget;
+    QHash<QByteArray, Entry*> _entries;
+    // most recently used first
+    Entry *_first;
+    Entry *_last;
+    int _size;
+    quint64 _hits;
+    quint64 _misses;
+};
+
+#endif // VALUECACHE_H
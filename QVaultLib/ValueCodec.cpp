@@ -0,0 +1,292 @@
+#include "ValueCodec.h"
+
+#include <VaultMetrics.h>
+
+#include <QDataStream>
+#include <QDebug>
+#include <QtEndian>
+
+#include <cstring>
+
+const quint8 ValueCodec::Version = 1;
+const int ValueCodec::CompressionThreshold = 256;
+
+// tag byte: 3 bits of version, compression flag, 4 bits of type.
+// the version is never zero, so tags never look like a QDataStream encoding.
+const int VERSION_SHIFT = 5;
+const quint8 COMPRESSED_FLAG = 0x10;
+const quint8 TYPE_MASK = 0x0f;
+
+const quint8 TYPE_BYTES = 1;
+const quint8 TYPE_STRING = 2;
+const quint8 TYPE_INT = 3;
+const quint8 TYPE_UINT = 4;
+const quint8 TYPE_LONG_LONG = 5;
+const quint8 TYPE_ULONG_LONG = 6;
+const quint8 TYPE_BOOL = 7;
+const quint8 TYPE_STREAM = 8;
+const quint8 TYPE_VARIANT = 15;
+
+// zlib level 1 is several times faster than the default at a slightly lower ratio
+const int COMPRESSION_LEVEL = 1;
+const int MAX_NUMBER_SIZE = 10;
+
+QByteArray ValueCodec::encode(const QVariant &value, bool compress)
+{
+    const VaultMetrics::Scope scope(VaultMetrics::Encoding);
+
+    quint8 type = TYPE_VARIANT;
+    QByteArray payload;
+    QByteArray data;
+
+    // null byte arrays and strings differ from empty ones only in the QVariant encoding
+    switch (value.isNull() ? int(QMetaType::UnknownType) : value.userType()) {
+    case QMetaType::QByteArray:
+        type = TYPE_BYTES;
+        payload = value.toByteArray();
+        break;
+    case QMetaType::QString:
+        type = TYPE_STRING;
+        payload = value.toString().toUtf8();
+        break;
+    case QMetaType::Int:
+    case QMetaType::LongLong: {
+        const qint64 number = value.toLongLong();
+        data.append(char((Version << VERSION_SHIFT) | (value.userType() == QMetaType::Int ? TYPE_INT : TYPE_LONG_LONG)));
+        // zigzag encoding keeps small negative numbers short
+        appendNumber((quint64(number) << 1) ^ quint64(number >> 63), &data);
+        return data;
+    }
+    case QMetaType::UInt:
+    case QMetaType::ULongLong:
+        data.append(char((Version << VERSION_SHIFT) | (value.userType() == QMetaType::UInt ? TYPE_UINT : TYPE_ULONG_LONG)));
+        appendNumber(value.toULongLong(), &data);
+        return data;
+    case QMetaType::Bool:
+        data.append(char((Version << VERSION_SHIFT) | TYPE_BOOL));
+        data.append(char(value.toBool() ? 1 : 0));
+        return data;
+    default: {
+        QDataStream out(&payload, QIODevice::WriteOnly);
+        out << value;
+        break;
+    }
+    }
+
+    quint8 tag = quint8((Version << VERSION_SHIFT) | type);
+    if (compress && payload.size() >= CompressionThreshold) {
+        const QByteArray compressed = qCompress(payload, COMPRESSION_LEVEL);
+        if (compressed.size() < payload.size()) {
+            payload = compressed;
+            tag |= COMPRESSED_FLAG;
+        }
+    }
+
+    data.reserve(1 + payload.size());
+    data.append(char(tag));
+    data.append(payload);
+
+    return data;
+}
+
+bool ValueCodec::decode(const QByteArray &data, QVariant *value)
+{
+    Q_ASSERT(value);
+
+    const VaultMetrics::Scope scope(VaultMetrics::Encoding);
+
+    if (data.isEmpty()) {
+        return false;
+    }
+
+    const uchar *bytes = reinterpret_cast<const uchar*>(data.constData());
+    const quint8 tag = bytes[0];
+
+    if (tag == 0) {
+        QDataStream in(data);
+        in >> *value;
+        return in.status() == QDataStream::Ok;
+    }
+
+    if (tag >> VERSION_SHIFT != Version) {
+        qDebug() << "Unsupported value encoding version" << (tag >> VERSION_SHIFT);
+        return false;
+    }
+
+    const quint8 type = tag & TYPE_MASK;
+    QByteArray payload;
+    if (type == TYPE_BYTES || type == TYPE_STRING || type == TYPE_VARIANT) {
+        payload = (tag & COMPRESSED_FLAG) ? qUncompress(bytes + 1, data.size() - 1) : data.mid(1);
+        if (payload.isEmpty() && (tag & COMPRESSED_FLAG)) {
+            return false;
+        }
+    }
+    quint64 number = 0;
+
+    switch (type) {
+    case TYPE_BYTES:
+        *value = payload;
+        return true;
+    case TYPE_STRING:
+        *value = QString::fromUtf8(payload);
+        return true;
+    case TYPE_INT:
+    case TYPE_LONG_LONG:
+        if (!readNumber(bytes + 1, data.size() - 1, &number)) {
+            return false;
+        }
+        number = (number >> 1) ^ (0 - (number & 1));
+        *value = type == TYPE_INT ? QVariant(int(number)) : QVariant(qint64(number));
+        return true;
+    case TYPE_UINT:
+    case TYPE_ULONG_LONG:
+        if (!readNumber(bytes + 1, data.size() - 1, &number)) {
+            return false;
+        }
+        *value = type == TYPE_UINT ? QVariant(uint(number)) : QVariant(quint64(number));
+        return true;
+    case TYPE_BOOL:
+        if (data.size() != 2) {
+            return false;
+        }
+        *value = bytes[1] != 0;
+        return true;
+    case TYPE_VARIANT: {
+        QDataStream in(payload);
+        in >> *value;
+        return in.status() == QDataStream::Ok;
+    }
+    case TYPE_STREAM:
+        qDebug() << "Value is stored as a stream.";
+        return false;
+    default:
+        return false;
+    }
+}
+
+bool ValueCodec::decodeBytes(const char *data, int size, QByteArray *value)
+{
+    Q_ASSERT(value);
+
+    const VaultMetrics::Scope scope(VaultMetrics::Encoding);
+
+    if (size <= 0) {
+        return false;
+    }
+
+    const uchar *bytes = reinterpret_cast<const uchar*>(data);
+    const quint8 tag = bytes[0];
+
+    if (tag == 0) {
+        return decodeLegacyBytes(bytes, size, value);
+    }
+
+    if (tag >> VERSION_SHIFT != Version) {
+        return false;
+    }
+
+    if (tag & COMPRESSED_FLAG) {
+        const QByteArray payload = qUncompress(bytes + 1, size - 1);
+        switch (tag & TYPE_MASK) {
+        case TYPE_BYTES:
+            *value = payload;
+            return !payload.isEmpty();
+        case TYPE_VARIANT:
+            return decodeLegacyBytes(reinterpret_cast<const uchar*>(payload.constData()), payload.size(), value);
+        default:
+            return false;
+        }
+    }
+
+    switch (tag & TYPE_MASK) {
+    case TYPE_BYTES:
+        value->resize(size - 1);
+        if (size > 1) {
+            memcpy(value->data(), bytes + 1, size_t(size - 1));
+        }
+        return true;
+    case TYPE_VARIANT:
+        return decodeLegacyBytes(bytes + 1, size - 1, value);
+    default:
+        return false;
+    }
+}
+
+QByteArray ValueCodec::encodeStream(const QByteArray &reference)
+{
+    QByteArray data;
+    data.reserve(1 + reference.size());
+    data.append(char((Version << VERSION_SHIFT) | TYPE_STREAM));
+    data.append(reference);
+
+    return data;
+}
+
+bool ValueCodec::decodeStream(const QByteArray &data, QByteArray *reference)
+{
+    Q_ASSERT(reference);
+
+    if (data.isEmpty() || quint8(data.at(0)) != ((Version << VERSION_SHIFT) | TYPE_STREAM)) {
+        return false;
+    }
+
+    *reference = data.mid(1);
+    return true;
+}
+
+void ValueCodec::appendNumber(quint64 number, QByteArray *data)
+{
+    // 7 bits per byte, the high bit marks that more bytes follow
+    while (number >= 0x80) {
+        data->append(char((number & 0x7f) | 0x80));
+        number >>= 7;
+    }
+    data->append(char(number));
+}
+
+bool ValueCodec::readNumber(const uchar *data, int size, quint64 *number)
+{
+    *number = 0;
+
+    for (int i = 0; i < size && i < MAX_NUMBER_SIZE; ++i) {
+        *number |= quint64(data[i] & 0x7f) << (7 * i);
+        if (!(data[i] & 0x80)) {
+            // the number must fill the whole payload
+            return i == size - 1;
+        }
+    }
+
+    return false;
+}
+
+bool ValueCodec::decodeLegacyBytes(const uchar *data, int size, QByteArray *value)
+{
+    // QDataStream writes a QVariant holding a byte array as its type,
+    // a null flag, the size and the bytes, so the bytes are copied out as they are.
+    const int headerSize = int(sizeof(quint32) + sizeof(quint8) + sizeof(quint32));
+    if (size < headerSize) {
+        return false;
+    }
+
+    if (qFromBigEndian<quint32>(data) != QMetaType::QByteArray) {
+        return false;
+    }
+
+    const quint32 bytesSize = qFromBigEndian<quint32>(data + sizeof(quint32) + sizeof(quint8));
+    if (bytesSize == 0xffffffff) {
+        // a null byte array
+        value->resize(0);
+        return true;
+    }
+
+    if (bytesSize != quint32(size - headerSize)) {
+        return false;
+    }
+
+    value->resize(int(bytesSize));
+    if (bytesSize > 0) {
+        memcpy(value->data(), data + headerSize, bytesSize);
+    }
+
+    return true;
+}
@@ -0,0 +1,68 @@
+#ifndef VALUECODEC_H
+#define VALUECODEC_H
+
+#include <QByteArray>
+#include <QVariant>
+
+/**
+ * @brief ValueCodec serializes vault values before they are encrypted.
+ * @details
+ * Encoded values start with a tag byte holding the codec version, a
+ * compression flag and the value type. Byte arrays and strings are stored
+ * as they are, integers as variable-length numbers, other types fall back
+ * to the QDataStream encoding of QVariant. Values written before the codec
+ * was introduced are plain QDataStream encodings, their first byte is
+ * always zero, so both are decoded by the same code. Streamed values are
+ * stored as references to their blob files.
+ *
+ * Large values can be compressed with zlib. Compression makes the size of
+ * encrypted values depend on their content, so it is off by default.
+ */
+class ValueCodec
+{
+public:
+    static const quint8 Version;
+
+    /**
+     * @brief Values shorter than this are never compressed.
+     */
+    static const int CompressionThreshold;
+
+    /**
+     * @brief Encodes a value.
+     * @param compress - compress values of CompressionThreshold bytes or more
+     *        if that makes them shorter.
+     */
+    static QByteArray encode(const QVariant &value, bool compress = false);
+
+    /**
+     * @brief Decodes a value written by encode() or by QDataStream.
+     * @return false if the data is malformed.
+     */
+    static bool decode(const QByteArray &data, QVariant *value);
+
+    /**
+     * @brief Decodes a byte array value into the buffer, reusing it.
+     * @return false if the data is malformed or not a byte array.
+     * @note Uncompressed values are copied without allocations.
+     */
+    static bool decodeBytes(const char *data, int size, QByteArray *value);
+
+    /**
+     * @brief Encodes a reference to a value stored outside of the vault file.
+     */
+    static QByteArray encodeStream(const QByteArray &reference);
+
+    /**
+     * @brief Decodes a reference written by encodeStream().
+     * @return false if the data is not a stream reference.
+     */
+    static bool decodeStream(const QByteArray &data, QByteArray *reference);
+
+private:
+    static void appendNumber(quint64 number, QByteArray *data);
+    static bool readNumber(const uchar *data, int size, quint64 *number);
+    static bool decodeLegacyBytes(const uchar *data, int size, QByteArray *value);
+};
+
+#endif // VALUECODEC_H
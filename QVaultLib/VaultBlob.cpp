@@ -0,0 +1,261 @@
+#include "VaultBlob.h"
+
+#include <QDataStream>
+#include <QDebug>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QSaveFile>
+#include <QtEndian>
+
+#include <cstring>
+#include <limits>
+
+#include <openssl/crypto.h>
+#include <openssl/rand.h>
+
+const quint32 VaultBlob::Magic = 0x51564252; // "QVBR"
+const quint32 VaultBlob::Version = 1;
+const int VaultBlob::ChunkSize = 64 * 1024;
+
+const int ID_SIZE = 16;
+const int KEY_SIZE = 32;
+// reference: id, key, quint8 algorithm, quint64 size.
+const int REFERENCE_SIZE = ID_SIZE + KEY_SIZE + int(sizeof(quint8) + sizeof(quint64));
+// chunks written by other versions may be larger, but not unbounded
+const quint32 MAX_CHUNK_SIZE = 16 * 1024 * 1024;
+// sequential sources are given up on once they send nothing for so long
+const int READ_TIMEOUT = 30000;
+
+VaultBlob::VaultBlob()
+    : _algorithm(AeadCipher::AesGcm)
+    , _size(0)
+{
+}
+
+VaultBlob::VaultBlob(AeadCipher::Algorithm algorithm)
+    : _id(ID_SIZE, '\0')
+    , _key(KEY_SIZE, '\0')
+    , _algorithm(algorithm)
+    , _size(0)
+{
+    if (RAND_bytes(reinterpret_cast<unsigned char*>(_id.data()), ID_SIZE) != 1 ||
+            RAND_bytes(reinterpret_cast<unsigned char*>(_key.data()), KEY_SIZE) != 1) {
+        qDebug() << "Failed to generate blob key.";
+        _id.clear();
+        _key.clear();
+    }
+}
+
+VaultBlob::~VaultBlob()
+{
+    // the key is shared with copies, wiping the shared buffer would break them
+    if (_key.isDetached()) {
+        OPENSSL_cleanse(_key.data(), _key.size());
+    }
+}
+
+bool VaultBlob::fromReference(const QByteArray &reference, VaultBlob *blob)
+{
+    Q_ASSERT(blob);
+
+    if (reference.size() != REFERENCE_SIZE) {
+        return false;
+    }
+
+    const uchar *data = reinterpret_cast<const uchar*>(reference.constData());
+    const quint8 algorithm = data[ID_SIZE + KEY_SIZE];
+    const quint64 size = qFromBigEndian<quint64>(data + ID_SIZE + KEY_SIZE + sizeof(quint8));
+    if (algorithm > AeadCipher::ChaCha20Poly1305 || size > quint64(std::numeric_limits<qint64>::max())) {
+        return false;
+    }
+
+    blob->_id = reference.left(ID_SIZE);
+    blob->_key = reference.mid(ID_SIZE, KEY_SIZE);
+    blob->_algorithm = AeadCipher::Algorithm(algorithm);
+    blob->_size = qint64(size);
+
+    return true;
+}
+
+QByteArray VaultBlob::reference() const
+{
+    Q_ASSERT(isValid());
+
+    QByteArray reference(REFERENCE_SIZE, '\0');
+    uchar *data = reinterpret_cast<uchar*>(reference.data());
+    memcpy(data, _id.constData(), ID_SIZE);
+    memcpy(data + ID_SIZE, _key.constData(), KEY_SIZE);
+    data[ID_SIZE + KEY_SIZE] = quint8(_algorithm);
+    qToBigEndian<quint64>(quint64(_size), data + ID_SIZE + KEY_SIZE + sizeof(quint8));
+
+    return reference;
+}
+
+bool VaultBlob::isValid() const
+{
+    return _id.size() == ID_SIZE && _key.size() == KEY_SIZE;
+}
+
+QString VaultBlob::fileName() const
+{
+    return QString::fromLatin1(_id.toHex());
+}
+
+qint64 VaultBlob::size() const
+{
+    return _size;
+}
+
+bool VaultBlob::write(const QString &filepath, QIODevice *source)
+{
+    Q_ASSERT(isValid());
+    Q_ASSERT(source);
+
+    QSaveFile file(filepath);
+    if (!file.open(QIODevice::WriteOnly)) {
+        qDebug() << "Failed to open blob file to write" << filepath;
+        return false;
+    }
+
+    QDataStream out(&file);
+    out << Magic << Version << quint32(ChunkSize);
+
+    AeadCipher cipher(_algorithm, _key);
+    QByteArray chunk;
+    QByteArray next;
+    qint64 chunkSize = readChunk(source, &chunk);
+    qint64 nextSize = 0;
+    quint64 index = 0;
+    bool success = out.status() == QDataStream::Ok;
+    _size = 0;
+
+    // the next chunk is read ahead to know whether the current one is the last
+    while (success && chunkSize >= 0) {
+        nextSize = chunkSize == ChunkSize ? readChunk(source, &next) : 0;
+        if (nextSize < 0) {
+            break;
+        }
+
+        const bool last = nextSize == 0;
+        const QByteArray encrypted = cipher.encrypt(QByteArray::fromRawData(chunk.constData(), int(chunkSize)),
+                                                    associatedData(index, last));
+        success = !encrypted.isEmpty() && file.write(encrypted) == encrypted.size();
+        _size += chunkSize;
+
+        if (last) {
+            break;
+        }
+
+        chunk.swap(next);
+        chunkSize = nextSize;
+        ++index;
+    }
+
+    OPENSSL_cleanse(chunk.data(), chunk.size());
+    OPENSSL_cleanse(next.data(), next.size());
+
+    if (chunkSize < 0 || nextSize < 0) {
+        qDebug() << "Failed to read stream" << source->errorString();
+        return false;
+    }
+
+    if (!success || !file.commit()) {
+        qDebug() << "Failed to write blob file" << filepath;
+        return false;
+    }
+
+    return true;
+}
+
+bool VaultBlob::read(const QString &filepath, QIODevice *output) const
+{
+    Q_ASSERT(isValid());
+    Q_ASSERT(output);
+
+    QFile file(filepath);
+    if (!file.open(QIODevice::ReadOnly)) {
+        qDebug() << "Failed to open blob file to read" << filepath;
+        return false;
+    }
+
+    QDataStream in(&file);
+    quint32 magic = 0, version = 0, chunkSize = 0;
+    in >> magic >> version >> chunkSize;
+    if (in.status() != QDataStream::Ok || magic != Magic || version != Version ||
+            chunkSize == 0 || chunkSize > MAX_CHUNK_SIZE) {
+        qDebug() << "Blob file is corrupted" << filepath;
+        return false;
+    }
+
+    AeadCipher cipher(_algorithm, _key);
+    QByteArray encrypted(int(chunkSize) + AeadCipher::Overhead, '\0');
+    QByteArray chunk;
+    quint64 index = 0;
+    qint64 size = 0;
+    bool success = false;
+
+    for (;;) {
+        const qint64 encryptedSize = file.read(encrypted.data(), encrypted.size());
+        const bool last = file.atEnd();
+        if (encryptedSize < AeadCipher::Overhead ||
+                !cipher.decrypt(encrypted.constData(), int(encryptedSize), associatedData(index, last), &chunk)) {
+            qDebug() << "Blob file is corrupted" << filepath;
+            break;
+        }
+
+        if (output->write(chunk) != chunk.size()) {
+            qDebug() << "Failed to write stream" << output->errorString();
+            break;
+        }
+        size += chunk.size();
+
+        if (last) {
+            success = size == _size;
+            break;
+        }
+        ++index;
+    }
+
+    OPENSSL_cleanse(chunk.data(), chunk.size());
+
+    return success;
+}
+
+qint64 VaultBlob::readChunk(QIODevice *source, QByteArray *chunk)
+{
+    chunk->resize(ChunkSize);
+    qint64 size = 0;
+
+    while (size < ChunkSize) {
+        const qint64 read = source->read(chunk->data() + size, ChunkSize - size);
+        if (read < 0) {
+            return -1;
+        }
+        if (read == 0) {
+            // a device with no more data says so right away, a stalled peer runs into the timeout
+            QElapsedTimer waited;
+            waited.start();
+            if (source->waitForReadyRead(READ_TIMEOUT)) {
+                continue;
+            }
+            if (waited.elapsed() >= READ_TIMEOUT) {
+                return -1;
+            }
+            break;
+        }
+        size += read;
+    }
+
+    return size;
+}
+
+QByteArray VaultBlob::associatedData(quint64 index, bool last) const
+{
+    QByteArray data(_id);
+    data.resize(ID_SIZE + int(sizeof(quint64) + sizeof(quint8)));
+    uchar *dest = reinterpret_cast<uchar*>(data.data()) + ID_SIZE;
+    qToBigEndian<quint64>(index, dest);
+    dest[sizeof(quint64)] = last ? 1 : 0;
+
+    return data;
+}
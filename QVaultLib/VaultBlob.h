@@ -0,0 +1,96 @@
+#ifndef VAULTBLOB_H
+#define VAULTBLOB_H
+
+#include <AeadCipher.h>
+
+#include <QByteArray>
+#include <QString>
+
+class QIODevice;
+
+/**
+ * @brief VaultBlob is a large value encrypted into its own file in chunks.
+ * @details
+ * A blob has a random id naming its file and a random key, both are kept in
+ * the reference stored as the vault record, so blobs stay readable when the
+ * vault data key is replaced. The file holds fixed-size chunks, each one
+ * encrypted and authenticated on its own, with the blob id, the chunk index
+ * and a flag of the last chunk as associated data. Chunks cannot be moved,
+ * dropped or taken from another blob, and the memory used to write or read
+ * a blob does not depend on its size.
+ */
+class VaultBlob
+{
+public:
+    static const quint32 Magic;
+    static const quint32 Version;
+
+    /**
+     * @brief Size of the plain data in a chunk.
+     */
+    static const int ChunkSize;
+
+    /**
+     * @brief Creates an empty blob reference, see isValid().
+     */
+    VaultBlob();
+
+    /**
+     * @brief Creates a blob with a random id and key.
+     */
+    explicit VaultBlob(AeadCipher::Algorithm algorithm);
+
+    virtual ~VaultBlob();
+
+    /**
+     * @brief Restores a blob from its reference.
+     * @return false if the reference is malformed.
+     */
+    static bool fromReference(const QByteArray &reference, VaultBlob *blob);
+
+    /**
+     * @brief Gets the reference to store in the vault, it holds the blob key.
+     */
+    QByteArray reference() const;
+
+    bool isValid() const;
+
+    /**
+     * @brief Gets the blob file name, the same for all copies of the blob.
+     */
+    QString fileName() const;
+
+    /**
+     * @brief Gets the size of the plain data.
+     */
+    qint64 size() const;
+
+    /**
+     * @brief Encrypts all data read from the source into the file.
+     * @param source - an open device, read until read() returns no data.
+     * @return false if the source or the file fail, the file is not created then.
+     * @note Sequential devices are waited for more data at most 30 seconds at a time,
+     *       the source fails if none comes. The file is synced to disk when committed.
+     */
+    bool write(const QString &filepath, QIODevice *source);
+
+    /**
+     * @brief Decrypts the file into the output.
+     * @param output - an open device to write to.
+     * @return false if the file is corrupted or does not belong to the blob.
+     * @note Chunks are written to the output once they are verified,
+     *       so the output may receive a part of the data on failure.
+     */
+    bool read(const QString &filepath, QIODevice *output) const;
+
+private:
+    static qint64 readChunk(QIODevice *source, QByteArray *chunk);
+    QByteArray associatedData(quint64 index, bool last) const;
+
+    QByteArray _id;
+    QByteArray _key;
+    AeadCipher::Algorithm _algorithm;
+    qint64 _size;
+};
+
+#endif // VAULTBLOB_H
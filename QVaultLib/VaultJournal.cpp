@@ -0,0 +1,223 @@
+#include "VaultJournal.h"
+
+#include <QDebug>
+
+#include <openssl/hmac.h>
+
+#if defined(Q_OS_UNIX)
+#include <unistd.h>
+#elif defined(Q_OS_WIN)
+#include <io.h>
+#endif
+
+const int FRAME_MAC_SIZE = 32;
+const int FRAME_HEADER_SIZE = sizeof(quint32);
+
+VaultJournal::VaultJournal(const QString &filepath,
+                           const QByteArray &macKey,
+                           const QByteArray &epoch)
+    : _filepath(filepath)
+    , _macKey(macKey)
+    , _lastMac(epoch)
+    , _size(0)
+    , _unsynced(false)
+    , _file(filepath)
+{
+    Q_ASSERT(!macKey.isEmpty());
+    Q_ASSERT(!epoch.isEmpty());
+}
+
+VaultJournal::~VaultJournal()
+{
+    _file.close();
+    _macKey.wipe();
+}
+
+QString VaultJournal::journalPath(const QString &vaultPath)
+{
+    return vaultPath + ".wal";
+}
+
+bool VaultJournal::replay(QList<Batch> *batches)
+{
+    Q_ASSERT(batches);
+
+    // read through a separate handle, the append handle keeps frames to be synced
+    QFile file(_filepath);
+    if (!file.exists()) {
+        return true;
+    }
+
+    if (!file.open(QFile::ReadWrite)) {
+        qDebug() << "Failed to open journal file to read" << _filepath;
+        return false;
+    }
+
+    // frames up to _size have been read or written already, only newer ones are replayed.
+    if (!file.seek(_size)) {
+        qDebug() << "Failed to read journal file" << _filepath;
+        return false;
+    }
+    const QByteArray journalData = file.readAll();
+
+    QDataStream in(journalData);
+    QByteArray lastMac = _lastMac;
+    QList<Batch> newBatches;
+    qint64 validSize = 0;
+
+    while (!in.atEnd()) {
+        quint32 length = 0;
+        in >> length;
+        if (in.status() != QDataStream::Ok ||
+                length > journalData.size() - validSize - FRAME_HEADER_SIZE - FRAME_MAC_SIZE) {
+            break;
+        }
+
+        QByteArray payload(length, '\0');
+        QByteArray mac(FRAME_MAC_SIZE, '\0');
+        in.readRawData(payload.data(), payload.size());
+        in.readRawData(mac.data(), mac.size());
+
+        if (mac != frameMac(lastMac, payload)) {
+            break;
+        }
+
+        Batch batch;
+        QDataStream frame(payload);
+        frame >> batch;
+        if (frame.status() != QDataStream::Ok) {
+            break;
+        }
+
+        newBatches.append(batch);
+        lastMac = mac;
+        validSize += FRAME_HEADER_SIZE + length + FRAME_MAC_SIZE;
+    }
+
+    if (validSize < journalData.size()) {
+        qDebug() << "Discarding invalid journal tail" << _filepath << (journalData.size() - validSize) << "bytes";
+        if (!file.resize(_size + validSize)) {
+            qDebug() << "Failed to truncate journal file" << _filepath;
+            return false;
+        }
+    }
+
+    batches->append(newBatches);
+    _lastMac = lastMac;
+    _size += validSize;
+
+    return true;
+}
+
+bool VaultJournal::append(const Batch &batch)
+{
+    QByteArray payload;
+    QDataStream out(&payload, QIODevice::WriteOnly);
+    out << batch;
+
+    const QByteArray mac = frameMac(_lastMac, payload);
+
+    QByteArray frame;
+    QDataStream frameOut(&frame, QIODevice::WriteOnly);
+    frameOut << quint32(payload.size());
+    frameOut.writeRawData(payload.constData(), payload.size());
+    frameOut.writeRawData(mac.constData(), mac.size());
+
+    if (!_file.isOpen() && !_file.open(QFile::WriteOnly | QFile::Append)) {
+        qDebug() << "Failed to open journal file for append" << _filepath;
+        return false;
+    }
+
+    if (_file.write(frame) != frame.size() || !_file.flush()) {
+        qDebug() << "Failed to append to journal file" << _filepath;
+        _file.close();
+        _file.resize(_size);
+        return false;
+    }
+
+    _lastMac = mac;
+    _size += frame.size();
+    _unsynced = true;
+
+    return true;
+}
+
+bool VaultJournal::sync()
+{
+    if (!_unsynced) {
+        return true;
+    }
+
+    // the handle is closed after a failed append, frames written before are synced through a new one
+    if (!_file.isOpen() && !_file.open(QFile::WriteOnly | QFile::Append)) {
+        qDebug() << "Failed to open journal file to sync" << _filepath;
+        return false;
+    }
+
+#if defined(Q_OS_LINUX)
+    const bool synced = ::fdatasync(_file.handle()) == 0;
+#elif defined(Q_OS_UNIX)
+    const bool synced = ::fsync(_file.handle()) == 0;
+#elif defined(Q_OS_WIN)
+    const bool synced = ::_commit(_file.handle()) == 0;
+#else
+    const bool synced = true;
+#endif
+
+    if (!synced) {
+        qDebug() << "Failed to sync journal file" << _filepath;
+    } else {
+        _unsynced = false;
+    }
+
+    return synced;
+}
+
+bool VaultJournal::reset(const QByteArray &epoch)
+{
+    Q_ASSERT(!epoch.isEmpty());
+
+    _file.close();
+    _lastMac = epoch;
+    _size = 0;
+    _unsynced = false;
+
+    if (_file.exists() && !_file.remove()) {
+        qDebug() << "Failed to remove journal file" << _filepath;
+        return false;
+    }
+
+    return true;
+}
+
+qint64 VaultJournal::size() const
+{
+    return _size;
+}
+
+QByteArray VaultJournal::frameMac(const QByteArray &lastMac, const QByteArray &payload) const
+{
+    const QByteArray data = lastMac + payload;
+    QByteArray result(FRAME_MAC_SIZE, '\0');
+    unsigned int length = FRAME_MAC_SIZE;
+
+    HMAC(EVP_sha256(),
+         reinterpret_cast<const unsigned char*>(_macKey.constData()),
+         _macKey.size(),
+         reinterpret_cast<const unsigned char*>(data.data()),
+         data.size(),
+         reinterpret_cast<unsigned char*>(result.data()),
+         &length);
+
+    return result;
+}
+
+QDataStream &operator<<(QDataStream &out, const VaultJournal::Entry &entry)
+{
+    return out << entry.op << entry.key << entry.value;
+}
+
+QDataStream &operator>>(QDataStream &in, VaultJournal::Entry &entry)
+{
+    return in >> entry.op >> entry.key >> entry.value;
+}
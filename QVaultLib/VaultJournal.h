@@ -0,0 +1,101 @@
+#ifndef VAULTJOURNAL_H
+#define VAULTJOURNAL_H
+
+#include <SecureArena.h>
+
+#include <QByteArray>
+#include <QDataStream>
+#include <QFile>
+#include <QList>
+#include <QString>
+
+/**
+ * @brief VaultJournal is the append-only log of vault mutations.
+ * @details
+ * The journal lives next to the vault snapshot and holds frames of already
+ * encrypted records. Each frame is authenticated with HMAC chained from the
+ * snapshot epoch, so frames cannot be removed from the middle, reordered or
+ * replayed against another snapshot. A torn or forged tail is discarded on
+ * replay.
+ *
+ * The number of frames is not recorded anywhere else, so a journal cut at a
+ * frame boundary replays as a valid shorter journal: the chain cannot detect
+ * that its last frames are missing, and those changes are lost silently.
+ */
+class VaultJournal
+{
+public:
+    enum Operation : quint8 {
+        Set = 1,
+        Remove = 2,
+        Clear = 3
+    };
+
+    struct Entry {
+        quint8 op;
+        QByteArray key;
+        QByteArray value;
+    };
+
+    using Batch = QList<Entry>;
+
+    explicit VaultJournal(const QString &filepath,
+                          const QByteArray &macKey,
+                          const QByteArray &epoch);
+    virtual ~VaultJournal();
+
+    /**
+     * @brief Gets the journal file path for the vault file.
+     */
+    static QString journalPath(const QString &vaultPath);
+
+    /**
+     * @brief Reads valid batches and truncates an invalid tail.
+     * @param batches - receives the batches in order of writing.
+     * @return false if the journal file cannot be accessed.
+     * @note Only batches appended since the previous replay() or append()
+     *       are read, so it can be called again to pick up frames appended
+     *       by other processes.
+     */
+    bool replay(QList<Batch> *batches);
+
+    /**
+     * @brief Appends a batch as a single authenticated frame.
+     * @return true if the frame is written.
+     */
+    bool append(const Batch &batch);
+
+    /**
+     * @brief Forces appended frames to stable storage.
+     * @return true if the data is synced or nothing was appended since the last sync.
+     */
+    bool sync();
+
+    /**
+     * @brief Removes the journal file and starts a new chain from the epoch.
+     * @note Called after a snapshot with the same epoch has been written.
+     */
+    bool reset(const QByteArray &epoch);
+
+    /**
+     * @brief Gets the size of valid journal data in bytes.
+     */
+    qint64 size() const;
+
+private:
+    Q_DISABLE_COPY(VaultJournal)
+
+    QByteArray frameMac(const QByteArray &lastMac, const QByteArray &payload) const;
+
+    QString _filepath;
+    SecureArena::Buffer _macKey;
+    QByteArray _lastMac;
+    qint64 _size;
+    bool _unsynced;
+    QFile _file;
+};
+
+QDataStream &operator<<(QDataStream &out, const VaultJournal::Entry &entry);
+QDataStream &operator>>(QDataStream &in, VaultJournal::Entry &entry);
+
+#endif // VAULTJOURNAL_H
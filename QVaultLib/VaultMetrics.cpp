@@ -0,0 +1,187 @@
+#include "VaultMetrics.h"
+
+const int VaultMetrics::HistogramBuckets;
+
+// indexed by VaultMetrics::Operation
+const char *const OPERATION_NAMES[] = {
+    "unlock", "getValue", "readValue", "setValue", "setValues", "removeValue", "contains", "keys",
+    "writeStream", "readStream", "commit", "refresh", "changePassword", "rotateDataKey", "save", "verify",
+    "clear", "addPassword", "removePassword", "setShardCount", "flush"
+};
+
+// indexed by VaultMetrics::Phase
+const char *const PHASE_NAMES[] = { "keyDerivation", "encryption", "encoding", "disk" };
+
+const int NO_INDEX = -1;
+
+// metrics of the operation running on the thread, read by phase scopes
+static thread_local VaultMetrics *currentMetrics = nullptr;
+
+VaultMetrics::Scope::Scope(VaultMetrics *metrics, Operation operation)
+    : _metrics(metrics)
+    , _previous(currentMetrics)
+    , _operation(operation)
+    , _phase(NO_INDEX)
+{
+    currentMetrics = metrics;
+    if (_metrics) {
+        _timer.start();
+    }
+}
+
+VaultMetrics::Scope::Scope(Phase phase)
+    : _metrics(currentMetrics)
+    , _previous(currentMetrics)
+    , _operation(NO_INDEX)
+    , _phase(phase)
+{
+    if (_metrics) {
+        _timer.start();
+    }
+}
+
+VaultMetrics::Scope::Scope(VaultMetrics *metrics)
+    : _metrics(nullptr)
+    , _previous(currentMetrics)
+    , _operation(NO_INDEX)
+    , _phase(NO_INDEX)
+{
+    currentMetrics = metrics;
+}
+
+VaultMetrics::Scope::~Scope()
+{
+    currentMetrics = _previous;
+
+    if (!_metrics) {
+        return;
+    }
+
+    if (_operation != NO_INDEX) {
+        _metrics->operationFinished(Operation(_operation), _timer.nsecsElapsed());
+    } else {
+        _metrics->phaseFinished(Phase(_phase), _timer.nsecsElapsed());
+    }
+}
+
+VaultMetrics::VaultMetrics()
+{
+}
+
+VaultMetrics::~VaultMetrics()
+{
+}
+
+VaultMetrics *VaultMetrics::current()
+{
+    return currentMetrics;
+}
+
+const char *VaultMetrics::operationName(Operation operation)
+{
+    Q_ASSERT(operation >= 0 && operation < OperationCount);
+    return OPERATION_NAMES[operation];
+}
+
+const char *VaultMetrics::phaseName(Phase phase)
+{
+    Q_ASSERT(phase >= 0 && phase < PhaseCount);
+    return PHASE_NAMES[phase];
+}
+
+qint64 VaultMetrics::bucketLimit(int bucket)
+{
+    Q_ASSERT(bucket >= 0 && bucket < HistogramBuckets);
+    return bucket == HistogramBuckets - 1 ? -1 : qint64(1) << bucket;
+}
+
+void VaultMetrics::operationFinished(Operation operation, qint64 nanoseconds)
+{
+    Q_ASSERT(operation >= 0 && operation < OperationCount);
+
+    // the first bucket whose limit is above the latency
+    const qint64 microseconds = nanoseconds / 1000;
+    int bucket = 0;
+    while (bucket < HistogramBuckets - 1 && microseconds >= bucketLimit(bucket)) {
+        ++bucket;
+    }
+
+    _counts[operation].fetchAndAddRelaxed(1);
+    _times[operation].fetchAndAddRelaxed(nanoseconds);
+    _histograms[operation][bucket].fetchAndAddRelaxed(1);
+}
+
+void VaultMetrics::phaseFinished(Phase phase, qint64 nanoseconds)
+{
+    Q_ASSERT(phase >= 0 && phase < PhaseCount);
+    _phaseTimes[phase].fetchAndAddRelaxed(nanoseconds);
+}
+
+void VaultMetrics::fileSaved(qint64 bytes)
+{
+    _saves.fetchAndAddRelaxed(1);
+    _savedBytes.fetchAndAddRelaxed(bytes);
+    _lastSavedBytes.store(bytes);
+}
+
+quint64 VaultMetrics::count(Operation operation) const
+{
+    Q_ASSERT(operation >= 0 && operation < OperationCount);
+    return _counts[operation].load();
+}
+
+qint64 VaultMetrics::totalTime(Operation operation) const
+{
+    Q_ASSERT(operation >= 0 && operation < OperationCount);
+    return _times[operation].load();
+}
+
+QVector<quint64> VaultMetrics::histogram(Operation operation) const
+{
+    Q_ASSERT(operation >= 0 && operation < OperationCount);
+
+    QVector<quint64> histogram(HistogramBuckets);
+    for (int i = 0; i < HistogramBuckets; ++i) {
+        histogram[i] = _histograms[operation][i].load();
+    }
+
+    return histogram;
+}
+
+qint64 VaultMetrics::phaseTime(Phase phase) const
+{
+    Q_ASSERT(phase >= 0 && phase < PhaseCount);
+    return _phaseTimes[phase].load();
+}
+
+quint64 VaultMetrics::saves() const
+{
+    return _saves.load();
+}
+
+qint64 VaultMetrics::savedBytes() const
+{
+    return _savedBytes.load();
+}
+
+qint64 VaultMetrics::lastSavedBytes() const
+{
+    return _lastSavedBytes.load();
+}
+
+void VaultMetrics::reset()
+{
+    for (int i = 0; i < OperationCount; ++i) {
+        _counts[i].store(0);
+        _times[i].store(0);
+        for (int j = 0; j < HistogramBuckets; ++j) {
+            _histograms[i][j].store(0);
+        }
+    }
+    for (int i = 0; i < PhaseCount; ++i) {
+        _phaseTimes[i].store(0);
+    }
+    _saves.store(0);
+    _savedBytes.store(0);
+    _lastSavedBytes.store(0);
+}
@@ -0,0 +1,180 @@
+#ifndef VAULTMETRICS_H
+#define VAULTMETRICS_H
+
+#include <QAtomicInteger>
+#include <QElapsedTimer>
+#include <QVector>
+
+/**
+ * @brief VaultMetrics counts vault operations and the time they spend.
+ * @details
+ * A vault reports to the metrics set with QVault::setMetrics(): the latency
+ * of every operation, the time spent in key derivation, encryption, value
+ * encoding and disk writes, and the size of every vault file it writes.
+ * The default implementation keeps counters and latency histograms, which
+ * may be read at any time. Subclasses may override the report methods to
+ * forward them to a tracing system, calling the base ones to keep counting.
+ *
+ * Nothing is timed while a vault has no metrics set. All methods are
+ * thread-safe, reports may come from any thread using the vault.
+ */
+class VaultMetrics
+{
+public:
+    enum Operation {
+        Unlock,
+        GetValue,
+        ReadValue,
+        SetValue,       ///< also counts setValueAsync(), until the change is queued.
+        SetValues,
+        RemoveValue,    ///< also counts removeValueAsync(), until the change is queued.
+        Contains,
+        Keys,
+        WriteStream,
+        ReadStream,
+        Commit,
+        Refresh,
+        ChangePassword,
+        RotateDataKey,
+        Save,           ///< a vault file rewrite, done by other operations.
+        Verify,
+        Clear,
+        AddPassword,
+        RemovePassword,
+        SetShardCount,
+        Flush,
+        OperationCount
+    };
+
+    /**
+     * @brief Defines parts of the work done within operations.
+     */
+    enum Phase {
+        KeyDerivation, ///< deriving keys from passwords.
+        Encryption,    ///< encrypting and decrypting records.
+        Encoding,      ///< encoding and decoding values.
+        Disk,          ///< writing and syncing the vault file and journal.
+        PhaseCount
+    };
+
+    /**
+     * @brief Number of latency histogram buckets.
+     * @see bucketLimit()
+     */
+    static const int HistogramBuckets = 24;
+
+    /**
+     * @brief Times an operation or a phase until it goes out of scope.
+     * @details
+     * An operation scope makes its metrics current for the calling thread,
+     * so phase scopes within it report to the same metrics. Scopes do not
+     * read the clock if there are no metrics.
+     */
+    class Scope
+    {
+    public:
+        /**
+         * @brief Times an operation, metrics may be null.
+         */
+        Scope(VaultMetrics *metrics, Operation operation);
+
+        /**
+         * @brief Times a phase of the current operation of the thread.
+         */
+        explicit Scope(Phase phase);
+
+        /**
+         * @brief Makes metrics current for the thread without timing anything,
+         *        for work done by other threads on behalf of an operation.
+         */
+        explicit Scope(VaultMetrics *metrics);
+
+        ~Scope();
+
+    private:
+        Q_DISABLE_COPY(Scope)
+
+        VaultMetrics *_metrics;
+        VaultMetrics *_previous;
+        int _operation;
+        int _phase;
+        QElapsedTimer _timer;
+    };
+
+    VaultMetrics();
+    virtual ~VaultMetrics();
+
+    /**
+     * @brief Gets the metrics current for the calling thread, or null.
+     */
+    static VaultMetrics *current();
+
+    static const char *operationName(Operation operation);
+    static const char *phaseName(Phase phase);
+
+    /**
+     * @brief Gets the upper latency limit of a histogram bucket in microseconds.
+     * @return -1 for the last bucket, which has no limit.
+     * @details Every bucket doubles the limit of the previous one, starting with 1.
+     */
+    static qint64 bucketLimit(int bucket);
+
+    /**
+     * @brief Reports a finished operation.
+     * @param nanoseconds - latency, including the time spent waiting for other threads.
+     */
+    virtual void operationFinished(Operation operation, qint64 nanoseconds);
+
+    /**
+     * @brief Reports a finished phase of an operation.
+     */
+    virtual void phaseFinished(Phase phase, qint64 nanoseconds);
+
+    /**
+     * @brief Reports a written vault file.
+     */
+    virtual void fileSaved(qint64 bytes);
+
+    quint64 count(Operation operation) const;
+    qint64 totalTime(Operation operation) const;
+
+    /**
+     * @brief Gets the number of operations per latency bucket.
+     */
+    QVector<quint64> histogram(Operation operation) const;
+
+    qint64 phaseTime(Phase phase) const;
+
+    /**
+     * @brief Gets the number of written vault files.
+     */
+    quint64 saves() const;
+
+    /**
+     * @brief Gets the total size of written vault files in bytes.
+     */
+    qint64 savedBytes() const;
+
+    /**
+     * @brief Gets the size of the last written vault file in bytes.
+     */
+    qint64 lastSavedBytes() const;
+
+    /**
+     * @brief Sets all counters to zero.
+     */
+    void reset();
+
+private:
+    Q_DISABLE_COPY(VaultMetrics)
+
+    QAtomicInteger<quint64> _counts[OperationCount];
+    QAtomicInteger<qint64> _times[OperationCount];
+    QAtomicInteger<quint64> _histograms[OperationCount][HistogramBuckets];
+    QAtomicInteger<qint64> _phaseTimes[PhaseCount];
+    QAtomicInteger<quint64> _saves;
+    QAtomicInteger<qint64> _savedBytes;
+    QAtomicInteger<qint64> _lastSavedBytes;
+};
+
+#endif // VAULTMETRICS_H
@@ -0,0 +1,113 @@
+#include "VaultSession.h"
+
+#include <CryptoContext.h>
+#include <AesCipher.h>
+
+#include <QMutexLocker>
+
+#include <openssl/crypto.h>
+#include <openssl/rand.h>
+
+const int WRAPPING_KEY_SIZE = 16;
+const int WRAPPING_IV_SIZE = 16;
+
+VaultSession::VaultSession(int ttlMillis)
+    : _ttl(ttlMillis)
+    , _wrappingKey(WRAPPING_KEY_SIZE + WRAPPING_IV_SIZE)
+{
+    _expiryTimer.setSingleShot(true);
+    QObject::connect(&_expiryTimer, &QTimer::timeout, [this]() {
+        QMutexLocker locker(&_mutex);
+        if (isExpired()) {
+            clear();
+        }
+    });
+}
+
+VaultSession::~VaultSession()
+{
+    wipe();
+}
+
+bool VaultSession::isValid() const
+{
+    QMutexLocker locker(&_mutex);
+    return _sealed && !isExpired();
+}
+
+void VaultSession::wipe()
+{
+    QMutexLocker locker(&_mutex);
+    clear();
+}
+
+void VaultSession::seal(const QString &filepath, const CryptoContext &context)
+{
+    QMutexLocker locker(&_mutex);
+    clear();
+
+    RAND_bytes(reinterpret_cast<unsigned char*>(_wrappingKey.data()), _wrappingKey.size());
+
+    AesCipher cipher(_wrappingKey.view(0, WRAPPING_KEY_SIZE), _wrappingKey.view(WRAPPING_KEY_SIZE, WRAPPING_IV_SIZE));
+    _sealed.reset(new CryptoContext(cipher.encrypt(context.aesKey()),
+                                    cipher.encrypt(context.iv()),
+                                    cipher.encrypt(context.macKey()),
+                                    context.keySlot()));
+    _filepath = filepath;
+    _elapsed.start();
+
+    // expired keys are wiped right away if the timer thread runs an event loop,
+    // otherwise on the next use of the session.
+    if (_ttl >= 0) {
+        QMetaObject::invokeMethod(&_expiryTimer, "start", Q_ARG(int, _ttl));
+    }
+}
+
+QByteArray VaultSession::secretKey(const QString &filepath, const QVariantList &keySlots, QVariantMap *keySlot)
+{
+    QMutexLocker locker(&_mutex);
+
+    if (!_sealed) {
+        return QByteArray();
+    }
+
+    if (isExpired()) {
+        clear();
+        return QByteArray();
+    }
+
+    // other key slots may come and go, the one the keys were unlocked with must stay
+    if (filepath != _filepath || !keySlots.contains(_sealed->keySlot())) {
+        return QByteArray();
+    }
+
+    *keySlot = _sealed->keySlot();
+
+    AesCipher cipher(_wrappingKey.view(0, WRAPPING_KEY_SIZE), _wrappingKey.view(WRAPPING_KEY_SIZE, WRAPPING_IV_SIZE));
+    QByteArray aesKey = cipher.decrypt(_sealed->aesKey());
+    QByteArray iv = cipher.decrypt(_sealed->iv());
+    QByteArray macKey = cipher.decrypt(_sealed->macKey());
+    const QByteArray secretKey = aesKey + iv + macKey;
+    aesKey.fill('\0');
+    iv.fill('\0');
+    macKey.fill('\0');
+
+    return secretKey;
+}
+
+bool VaultSession::isExpired() const
+{
+    return _elapsed.isValid() && _elapsed.hasExpired(_ttl);
+}
+
+void VaultSession::clear()
+{
+    if (_sealed) {
+        _sealed->wipe();
+        _sealed.reset();
+    }
+
+    OPENSSL_cleanse(_wrappingKey.data(), size_t(_wrappingKey.size()));
+    _filepath.clear();
+    _elapsed.invalidate();
+}
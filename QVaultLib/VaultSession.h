@@ -0,0 +1,70 @@
+#ifndef VAULTSESSION_H
+#define VAULTSESSION_H
+
+#include <SecureArena.h>
+
+#include <QByteArray>
+#include <QElapsedTimer>
+#include <QMutex>
+#include <QScopedPointer>
+#include <QString>
+#include <QTimer>
+#include <QVariantList>
+#include <QVariantMap>
+
+class CryptoContext;
+
+/**
+ * @brief VaultSession keeps vault keys to unlock the vault without the password.
+ * @details
+ * Deriving keys from the password is slow by design. A session started with
+ * QVault::startSession() keeps the derived keys sealed with a random key that
+ * exists only in this session object, so QVault::unlock(VaultSession*) skips
+ * the key derivation until the session expires. The keys are wiped on expiry,
+ * on wipe() and when the session is destroyed.
+ *
+ * A session only unlocks the vault file it was started for, and stops working
+ * once the password it was started with is changed or removed, or the data key
+ * of the vault is rotated.
+ */
+class VaultSession
+{
+public:
+    /**
+     * @param ttlMillis - time to keep the keys after the session is started,
+     *        a negative value keeps them until wipe() is called.
+     */
+    explicit VaultSession(int ttlMillis);
+    virtual ~VaultSession();
+
+    /**
+     * @brief Checks whether the session holds keys that have not expired.
+     */
+    bool isValid() const;
+
+    /**
+     * @brief Wipes the keys, the session can be started again afterwards.
+     */
+    void wipe();
+
+private:
+    Q_DISABLE_COPY(VaultSession)
+
+    friend class QVault;
+
+    void seal(const QString &filepath, const CryptoContext &context);
+    QByteArray secretKey(const QString &filepath, const QVariantList &keySlots, QVariantMap *keySlot);
+    bool isExpired() const;
+    void clear();
+
+    mutable QMutex _mutex;
+    const int _ttl;
+    QElapsedTimer _elapsed;
+    QTimer _expiryTimer;
+    QString _filepath;
+    // the wrapping key followed by its IV
+    SecureArena::Buffer _wrappingKey;
+    QScopedPointer<CryptoContext> _sealed;
+};
+
+#endif // VAULTSESSION_H
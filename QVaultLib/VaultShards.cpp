@@ -0,0 +1,191 @@
+#include "VaultShards.h"
+
+#include <Hmac.h>
+#include <VaultMetrics.h>
+
+#include <QDataStream>
+#include <QDebug>
+#include <QDir>
+#include <QSaveFile>
+#include <QVariantMap>
+
+#include <openssl/rand.h>
+
+const int VaultShards::MaxCount = 256;
+
+const int NAME_SIZE = 16;
+const quint64 FNV_OFFSET = 14695981039346656037ULL;
+const quint64 FNV_PRIME = 1099511628211ULL;
+
+const char HEADER_SHARD[] = "shard";
+const char HEADER_COUNT[] = "count";
+
+VaultShards::VaultShards(const QString &directory)
+    : _directory(directory)
+{
+}
+
+VaultShards::~VaultShards()
+{
+    qDeleteAll(_shards);
+}
+
+QString VaultShards::directoryPath(const QString &vaultPath)
+{
+    return vaultPath + ".shards";
+}
+
+int VaultShards::shardOf(const QByteArray &recordKey, int count)
+{
+    Q_ASSERT(count > 0);
+
+    // FNV-1a over the whole key, AesCbc encrypts keys with a fixed IV,
+    // so keys sharing a prefix share their leading ciphertext blocks
+    quint64 hash = FNV_OFFSET;
+    for (const char byte : recordKey) {
+        hash ^= quint8(byte);
+        hash *= FNV_PRIME;
+    }
+    hash ^= hash >> 32;
+
+    return int(quint32(hash) % quint32(count));
+}
+
+QString VaultShards::write(const QString &directory,
+                           int shard,
+                           int count,
+                           const QByteArray &macKey,
+                           const QVector<VaultSnapshot::Record> &records)
+{
+    QByteArray name(NAME_SIZE, '\0');
+    if (RAND_bytes(reinterpret_cast<unsigned char*>(name.data()), NAME_SIZE) != 1) {
+        qDebug() << "Failed to generate shard file name.";
+        return QString();
+    }
+
+    if (!QDir().mkpath(directory)) {
+        qDebug() << "Failed to create shards directory" << directory;
+        return QString();
+    }
+
+    const QString fileName = QString::fromLatin1(name.toHex());
+    const QByteArray shardHeader = header(shard, count);
+
+    const VaultMetrics::Scope disk(VaultMetrics::Disk);
+
+    QSaveFile file(QDir(directory).filePath(fileName));
+    if (!file.open(QFile::WriteOnly)) {
+        qDebug() << "Failed to open shard file for write" << file.fileName();
+        return QString();
+    }
+
+    if (!VaultSnapshot::write(&file, shardHeader, Hmac(macKey).digest(shardHeader), records)) {
+        qDebug() << "Failed to write shard file" << file.fileName();
+        file.cancelWriting();
+        return QString();
+    }
+
+    if (!file.commit()) {
+        qDebug() << "Failed to write shard file" << file.fileName();
+        return QString();
+    }
+
+    return fileName;
+}
+
+void VaultShards::removeUnused(const QString &directory, const QStringList &names)
+{
+    QDir dir(directory);
+    if (!dir.exists()) {
+        return;
+    }
+
+    // files mapped by other processes may fail to be removed on some
+    // platforms, they are left to the next rewrite of the vault file.
+    for (const QString &fileName : dir.entryList(QDir::Files)) {
+        if (!names.contains(fileName)) {
+            dir.remove(fileName);
+        }
+    }
+
+    if (names.isEmpty()) {
+        dir.rmdir(directory);
+    }
+}
+
+bool VaultShards::open(const QStringList &names, const QByteArray &macKey)
+{
+    Q_ASSERT(_shards.isEmpty());
+
+    if (names.isEmpty() || names.size() > MaxCount) {
+        qDebug() << "Number of shards is out of range" << names.size();
+        return false;
+    }
+
+    Hmac mac(macKey);
+    _shards.reserve(names.size());
+
+    for (int i = 0; i < names.size(); ++i) {
+        VaultSnapshot *shard = new VaultSnapshot(QDir(_directory).filePath(names.at(i)));
+        _shards.append(shard);
+
+        if (!shard->open() || shard->version() != VaultSnapshot::Version ||
+                shard->header() != header(i, names.size()) ||
+                shard->headerMac() != mac.digest(shard->header())) {
+            qDebug() << "Shard file is missing or corrupted" << names.at(i);
+            return false;
+        }
+    }
+
+    _names = names;
+
+    return true;
+}
+
+int VaultShards::count() const
+{
+    return _shards.size();
+}
+
+QStringList VaultShards::names() const
+{
+    return _names;
+}
+
+const VaultSnapshot &VaultShards::shard(int index) const
+{
+    return *_shards.at(index);
+}
+
+qint64 VaultShards::size() const
+{
+    qint64 size = 0;
+    for (const VaultSnapshot *shard : _shards) {
+        size += shard->size();
+    }
+
+    return size;
+}
+
+bool VaultShards::find(const QByteArray &key, QByteArray *value) const
+{
+    return _shards.at(shardOf(key, _shards.size()))->find(key, value);
+}
+
+bool VaultShards::find(const QByteArray &key, const char **value, int *size) const
+{
+    return _shards.at(shardOf(key, _shards.size()))->find(key, value, size);
+}
+
+QByteArray VaultShards::header(int shard, int count)
+{
+    QVariantMap properties;
+    properties.insert(HEADER_SHARD, shard);
+    properties.insert(HEADER_COUNT, count);
+
+    QByteArray header;
+    QDataStream out(&header, QIODevice::WriteOnly);
+    out << properties;
+
+    return header;
+}
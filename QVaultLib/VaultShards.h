@@ -0,0 +1,98 @@
+#ifndef VAULTSHARDS_H
+#define VAULTSHARDS_H
+
+#include <VaultSnapshot.h>
+
+#include <QByteArray>
+#include <QString>
+#include <QStringList>
+#include <QVector>
+
+/**
+ * @brief VaultShards maps the shard files holding records of a sharded vault.
+ * @details
+ * The file of a sharded vault holds its header only. Records are partitioned
+ * by a hash of their whole encrypted keys into shard files in a directory
+ * next to the vault file. AesCbc keys sharing a prefix have equal leading
+ * ciphertext blocks, so the hash covers the whole key. The vault
+ * header names the shard files, each one is a VaultSnapshot whose header
+ * holds its index and is authenticated with the vault MAC key.
+ *
+ * Shard files are never modified. A shard whose records changed is written
+ * into a new file with a random name, and the vault file names the new set
+ * once all shards are written, so a crash leaves the previous set intact.
+ */
+class VaultShards
+{
+public:
+    /**
+     * @brief Maximal number of shards of a vault.
+     */
+    static const int MaxCount;
+
+    explicit VaultShards(const QString &directory);
+    virtual ~VaultShards();
+
+    /**
+     * @brief Gets the directory of shard files of a vault.
+     */
+    static QString directoryPath(const QString &vaultPath);
+
+    /**
+     * @brief Gets the index of the shard holding a record.
+     * @param recordKey - encrypted key of the record.
+     * @param count - number of shards.
+     */
+    static int shardOf(const QByteArray &recordKey, int count);
+
+    /**
+     * @brief Writes the records of a shard into a new file in the directory.
+     * @param records - records of the shard sorted with VaultSnapshot::lessThan().
+     * @return name of the new file, or an empty string on failure.
+     */
+    static QString write(const QString &directory,
+                         int shard,
+                         int count,
+                         const QByteArray &macKey,
+                         const QVector<VaultSnapshot::Record> &records);
+
+    /**
+     * @brief Removes all files of the directory except the named ones,
+     *        and the directory itself once it is empty.
+     */
+    static void removeUnused(const QString &directory, const QStringList &names);
+
+    /**
+     * @brief Maps the named shard files and verifies their headers.
+     * @param names - file names in the order of shard indexes.
+     * @return false if a file is missing, malformed or belongs to another vault.
+     */
+    bool open(const QStringList &names, const QByteArray &macKey);
+
+    int count() const;
+    QStringList names() const;
+    const VaultSnapshot &shard(int index) const;
+
+    /**
+     * @brief Gets the total size of shard files.
+     */
+    qint64 size() const;
+
+    /**
+     * @brief Finds a record by its encrypted key in its shard.
+     * @see VaultSnapshot::find()
+     */
+    bool find(const QByteArray &key, QByteArray *value) const;
+    bool find(const QByteArray &key, const char **value, int *size) const;
+
+private:
+    Q_DISABLE_COPY(VaultShards)
+
+    static QByteArray header(int shard, int count);
+
+    QString _directory;
+    QStringList _names;
+    QVector<VaultSnapshot*> _shards;
+};
+
+#endif // VAULTSHARDS_H
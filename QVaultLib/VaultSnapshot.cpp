@@ -0,0 +1,306 @@
+#include "VaultSnapshot.h"
+
+#include <MerkleTree.h>
+
+#include <QDataStream>
+#include <QDebug>
+#include <QIODevice>
+#include <QMutexLocker>
+#include <QtEndian>
+
+#include <cstring>
+#include <limits>
+
+const quint32 VaultSnapshot::Magic = 0x51564C54; // "QVLT"
+const quint32 VaultSnapshot::Version = 3;
+
+// records section: quint32 count, count table entries, record data.
+// each table entry: quint64 offset from the section start, quint32 key size, quint32 value size.
+const int COUNT_SIZE = sizeof(quint32);
+const int ENTRY_SIZE = sizeof(quint64) + 2 * sizeof(quint32);
+// records copied from another file are written in parts of this size
+const qint64 WRITE_CHUNK_SIZE = 64 * 1024 * 1024;
+
+VaultSnapshot::VaultSnapshot(const QString &filepath)
+    : _file(filepath)
+    , _data(nullptr)
+    , _size(0)
+    , _version(0)
+    , _recordsOffset(0)
+    , _count(0)
+{
+}
+
+VaultSnapshot::~VaultSnapshot()
+{
+    if (_data) {
+        _file.unmap(_data);
+    }
+    _file.close();
+}
+
+bool VaultSnapshot::write(QIODevice *device,
+                          const QByteArray &header,
+                          const QByteArray &headerMac,
+                          const QVector<Record> &records)
+{
+    Q_ASSERT(device);
+
+    QDataStream out(device);
+    out << Magic
+        << Version
+        << header
+        << headerMac
+        << quint32(records.size());
+
+    quint64 offset = COUNT_SIZE + quint64(records.size()) * ENTRY_SIZE;
+    for (const Record &record : records) {
+        out << offset
+            << quint32(record.first.size())
+            << quint32(record.second.size());
+        offset += record.first.size() + record.second.size();
+    }
+
+    for (const Record &record : records) {
+        out.writeRawData(record.first.constData(), record.first.size());
+        out.writeRawData(record.second.constData(), record.second.size());
+    }
+
+    return out.status() == QDataStream::Ok;
+}
+
+bool VaultSnapshot::write(QIODevice *device,
+                          const QByteArray &header,
+                          const QByteArray &headerMac,
+                          const VaultSnapshot &source)
+{
+    Q_ASSERT(device);
+    Q_ASSERT(source._data);
+    Q_ASSERT(source._version == Version);
+
+    QDataStream out(device);
+    out << Magic
+        << Version
+        << header
+        << headerMac;
+
+    // a single write takes at most int bytes, files may be larger
+    const char *data = reinterpret_cast<const char*>(source._data);
+    qint64 offset = source._recordsOffset;
+    while (offset < source._size) {
+        const int size = int(qMin(WRITE_CHUNK_SIZE, source._size - offset));
+        if (out.writeRawData(data + offset, size) != size) {
+            return false;
+        }
+        offset += size;
+    }
+
+    return out.status() == QDataStream::Ok;
+}
+
+bool VaultSnapshot::lessThan(const QByteArray &left, const QByteArray &right)
+{
+    return lessThan(left.constData(), left.size(), right.constData(), right.size());
+}
+
+bool VaultSnapshot::lessThan(const char *left, int leftSize, const char *right, int rightSize)
+{
+    const int result = memcmp(left, right, size_t(qMin(leftSize, rightSize)));
+    return result < 0 || (result == 0 && leftSize < rightSize);
+}
+
+bool VaultSnapshot::open()
+{
+    if (!_file.open(QFile::ReadOnly)) {
+        qDebug() << "Failed to open vault file to read" << _file.fileName();
+        return false;
+    }
+
+    _size = _file.size();
+    _data = _size > 0 ? _file.map(0, _size) : nullptr;
+    if (!_data) {
+        qDebug() << "Failed to map vault file" << _file.fileName();
+        return false;
+    }
+
+    // the header is read from the first 2 GiB, records are only reached through the mapping
+    const int prefixSize = int(qMin(_size, qint64(std::numeric_limits<int>::max())));
+    QDataStream in(QByteArray::fromRawData(reinterpret_cast<const char*>(_data), prefixSize));
+    quint32 magic = 0;
+    in >> magic >> _version;
+
+    if (magic != Magic) {
+        _version = 1;
+    } else if (_version < 2 || _version > Version) {
+        qDebug() << "Unsupported vault format version" << _version;
+        return false;
+    }
+
+    // older formats are read as a whole into byte arrays, which hold at most 2 GiB
+    if (_version < Version && _size > prefixSize) {
+        qDebug() << "Vault file of an older format is too large" << _file.fileName();
+        return false;
+    }
+
+    if (_version == 1) {
+        return true;
+    }
+
+    in >> _header >> _headerMac;
+    if (in.status() != QDataStream::Ok) {
+        qDebug() << "Vault file header is corrupted" << _file.fileName();
+        return false;
+    }
+    _recordsOffset = in.device()->pos();
+
+    if (_version == 2) {
+        return true;
+    }
+
+    const qint64 available = _size - _recordsOffset;
+    if (available < COUNT_SIZE) {
+        qDebug() << "Vault file records are corrupted" << _file.fileName();
+        return false;
+    }
+
+    _count = qFromBigEndian<quint32>(_data + _recordsOffset);
+    if ((available - COUNT_SIZE) / ENTRY_SIZE < _count) {
+        qDebug() << "Vault file records are corrupted" << _file.fileName();
+        _count = 0;
+        return false;
+    }
+
+    return true;
+}
+
+quint32 VaultSnapshot::version() const
+{
+    return _version;
+}
+
+QByteArray VaultSnapshot::header() const
+{
+    return _header;
+}
+
+QByteArray VaultSnapshot::headerMac() const
+{
+    return _headerMac;
+}
+
+QByteArray VaultSnapshot::legacyRecords() const
+{
+    Q_ASSERT(_version == 2);
+    return QByteArray::fromRawData(reinterpret_cast<const char*>(_data + _recordsOffset),
+                                   int(_size - _recordsOffset));
+}
+
+QByteArray VaultSnapshot::data() const
+{
+    Q_ASSERT(_size <= std::numeric_limits<int>::max());
+    return QByteArray::fromRawData(reinterpret_cast<const char*>(_data), int(_size));
+}
+
+qint64 VaultSnapshot::size() const
+{
+    return _size;
+}
+
+quint32 VaultSnapshot::count() const
+{
+    return _count;
+}
+
+VaultSnapshot::Record VaultSnapshot::record(quint32 index) const
+{
+    const char *key = nullptr;
+    const char *value = nullptr;
+    int keySize = 0;
+    int valueSize = 0;
+
+    if (!entry(index, &key, &keySize, &value, &valueSize)) {
+        return Record();
+    }
+
+    return Record(QByteArray::fromRawData(key, keySize),
+                  QByteArray::fromRawData(value, valueSize));
+}
+
+bool VaultSnapshot::find(const QByteArray &key, QByteArray *value) const
+{
+    Q_ASSERT(value);
+
+    const char *found = nullptr;
+    int size = 0;
+    if (!find(key, &found, &size)) {
+        return false;
+    }
+
+    *value = QByteArray::fromRawData(found, size);
+    return true;
+}
+
+bool VaultSnapshot::find(const QByteArray &key, const char **value, int *size) const
+{
+    Q_ASSERT(value);
+    Q_ASSERT(size);
+
+    const char *entryKey = nullptr;
+    int entryKeySize = 0;
+    quint32 low = 0;
+    quint32 high = _count;
+
+    // keys are compared in place, so the lookup neither copies nor allocates
+    while (low < high) {
+        const quint32 middle = low + (high - low) / 2;
+        entry(middle, &entryKey, &entryKeySize, value, size);
+        if (lessThan(entryKey, entryKeySize, key.constData(), key.size())) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    return low < _count &&
+            entry(low, &entryKey, &entryKeySize, value, size) &&
+            entryKeySize == key.size() &&
+            memcmp(entryKey, key.constData(), size_t(entryKeySize)) == 0;
+}
+
+QByteArray VaultSnapshot::merkleRoot() const
+{
+    QMutexLocker locker(&_rootMutex);
+
+    if (_merkleRoot.isEmpty()) {
+        _merkleRoot = MerkleTree::root(*this);
+    }
+
+    return _merkleRoot;
+}
+
+bool VaultSnapshot::entry(quint32 index, const char **key, int *keySize, const char **value, int *valueSize) const
+{
+    Q_ASSERT(index < _count);
+
+    const uchar *records = _data + _recordsOffset;
+    const uchar *entry = records + COUNT_SIZE + qint64(index) * ENTRY_SIZE;
+    const quint64 offset = qFromBigEndian<quint64>(entry);
+    const quint64 entryKeySize = qFromBigEndian<quint32>(entry + sizeof(quint64));
+    const quint64 entryValueSize = qFromBigEndian<quint32>(entry + sizeof(quint64) + sizeof(quint32));
+
+    // entries are validated on access, so opening does not touch the whole table
+    const quint64 available = quint64(_size - _recordsOffset);
+    if (offset > available || entryKeySize + entryValueSize > available - offset) {
+        qDebug() << "Vault file record is corrupted" << index;
+        *key = *value = nullptr;
+        *keySize = *valueSize = 0;
+        return false;
+    }
+
+    *key = reinterpret_cast<const char*>(records + offset);
+    *keySize = int(entryKeySize);
+    *value = *key + entryKeySize;
+    *valueSize = int(entryValueSize);
+
+    return true;
+}
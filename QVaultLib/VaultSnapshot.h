@@ -0,0 +1,144 @@
+#ifndef VAULTSNAPSHOT_H
+#define VAULTSNAPSHOT_H
+
+#include <QByteArray>
+#include <QFile>
+#include <QMutex>
+#include <QPair>
+#include <QString>
+#include <QVector>
+
+class QIODevice;
+
+/**
+ * @brief VaultSnapshot is a read-only, memory-mapped view of a vault file.
+ * @details
+ * The vault file starts with a fixed prefix (magic, format version, header
+ * and header MAC) followed by a table of record offsets sorted by encrypted
+ * key and the record data itself. Opening a snapshot maps the file and reads
+ * the prefix only; records are located by binary search over the table and
+ * returned without copying, so unlock time and resident memory do not depend
+ * on the vault size.
+ *
+ * Vault files written before the offset table was introduced are mapped as
+ * well, their records are returned as a whole by legacyRecords().
+ */
+class VaultSnapshot
+{
+public:
+    using Record = QPair<QByteArray, QByteArray>;
+
+    static const quint32 Magic;
+    static const quint32 Version;
+
+    explicit VaultSnapshot(const QString &filepath);
+    virtual ~VaultSnapshot();
+
+    /**
+     * @brief Writes a vault file in the current format.
+     * @param device - an open device to write to.
+     * @param header - serialized vault header.
+     * @param headerMac - MAC of the header.
+     * @param records - records sorted with lessThan().
+     * @return true if all data is written.
+     */
+    static bool write(QIODevice *device,
+                      const QByteArray &header,
+                      const QByteArray &headerMac,
+                      const QVector<Record> &records);
+
+    /**
+     * @brief Writes a vault file in the current format with records of another snapshot.
+     * @param source - an open snapshot of the current format version.
+     * @note Records are copied as they are, so only the header is replaced.
+     */
+    static bool write(QIODevice *device,
+                      const QByteArray &header,
+                      const QByteArray &headerMac,
+                      const VaultSnapshot &source);
+
+    /**
+     * @brief Defines the order of records in the offset table.
+     */
+    static bool lessThan(const QByteArray &left, const QByteArray &right);
+
+    /**
+     * @brief Maps the file and reads the prefix.
+     * @return false if the file cannot be mapped or is malformed.
+     */
+    bool open();
+
+    /**
+     * @brief Gets the format version, 1 for files without magic prefix.
+     */
+    quint32 version() const;
+
+    QByteArray header() const;
+    QByteArray headerMac() const;
+
+    /**
+     * @brief Gets the serialized records of format version 2 files.
+     * @note The data is not copied and is valid while the snapshot is open.
+     */
+    QByteArray legacyRecords() const;
+
+    /**
+     * @brief Gets the whole mapped file.
+     * @note The data is not copied and is valid while the snapshot is open.
+     * @note Files larger than 2 GiB are opened in the current format only,
+     *       which is read through find() and entry() instead.
+     */
+    QByteArray data() const;
+
+    qint64 size() const;
+    quint32 count() const;
+
+    /**
+     * @brief Gets the encrypted key and value of the record at the index.
+     * @note The data is not copied and is valid while the snapshot is open.
+     */
+    Record record(quint32 index) const;
+
+    /**
+     * @brief Finds a record by its encrypted key.
+     * @param key - encrypted key.
+     * @param value - receives the encrypted value, which is not copied.
+     * @return true if the record is found.
+     */
+    bool find(const QByteArray &key, QByteArray *value) const;
+
+    /**
+     * @brief Finds a record by its encrypted key without allocating.
+     * @param value - receives a pointer to the encrypted value in the mapped file.
+     * @param size - receives the size of the encrypted value.
+     * @return true if the record is found.
+     */
+    bool find(const QByteArray &key, const char **value, int *size) const;
+
+    /**
+     * @brief Gets the Merkle root of the records.
+     * @note Computed on the first call, later calls return the same root
+     *       while the snapshot is open.
+     * @see MerkleTree
+     */
+    QByteArray merkleRoot() const;
+
+private:
+    Q_DISABLE_COPY(VaultSnapshot)
+
+    bool entry(quint32 index, const char **key, int *keySize, const char **value, int *valueSize) const;
+    static bool lessThan(const char *left, int leftSize, const char *right, int rightSize);
+
+    QFile _file;
+    uchar *_data;
+    qint64 _size;
+    quint32 _version;
+    QByteArray _header;
+    QByteArray _headerMac;
+    qint64 _recordsOffset;
+    quint32 _count;
+    mutable QMutex _rootMutex;
+    mutable QByteArray _merkleRoot;
+};
+
+#endif // VAULTSNAPSHOT_H
@@ -0,0 +1,775 @@
+#include <QVault.h>
+#include <VaultJournal.h>
+#include <Kdf.h>
+#include <AesCipher.h>
+#include <AeadCipher.h>
+#include <ValueCodec.h>
+#include <VaultMetrics.h>
+#include <VaultSession.h>
+
+#include <QString>
+#include <QtTest>
+#include <QTemporaryDir>
+#include <QBuffer>
+#include <QThreadPool>
+#include <QtConcurrent>
+
+#include <algorithm>
+
+#include <openssl/evp.h>
+
+const char PASSWORD[] = "password";
+const char NEW_PASSWORD[] = "new password";
+const int REMOVED_RECORDS = 10;
+
+#if defined(__GLIBC__)
+// every heap allocation of the benchmark process is counted to check
+// which vault operations allocate memory
+static QBasicAtomicInt allocationCount = Q_BASIC_ATOMIC_INITIALIZER(0);
+
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size)
+{
+    allocationCount.fetchAndAddRelaxed(1);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size)
+{
+    allocationCount.fetchAndAddRelaxed(1);
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    allocationCount.fetchAndAddRelaxed(1);
+    return __libc_realloc(ptr, size);
+}
+}
+#endif
+
+class QVaultLibBenchmarks : public QObject
+{
+    Q_OBJECT
+
+public:
+    QVaultLibBenchmarks();
+
+private Q_SLOTS:
+    void initTestCase();
+    void benchmarkCreate_data();
+    void benchmarkCreate();
+    void benchmarkUnlock_data();
+    void benchmarkUnlock();
+    void benchmarkGetValue_data();
+    void benchmarkGetValue();
+    void benchmarkSetValue_data();
+    void benchmarkSetValue();
+    void benchmarkRemoveValue_data();
+    void benchmarkRemoveValue();
+    void benchmarkChangePassword_data();
+    void benchmarkChangePassword();
+    void benchmarkRotateDataKey_data();
+    void benchmarkRotateDataKey();
+    void benchmarkSyncPolicy_data();
+    void benchmarkSyncPolicy();
+    void benchmarkCipherEncrypt();
+    void benchmarkCipherDecrypt();
+    void benchmarkCipherEncryptPerCall();
+    void benchmarkCipherDecryptPerCall();
+    void benchmarkAeadEncrypt_data();
+    void benchmarkAeadEncrypt();
+    void benchmarkValueDecode_data();
+    void benchmarkValueDecode();
+    void benchmarkGetSingleValue();
+    void benchmarkCachedGetValue();
+    void benchmarkMeteredGetValue();
+    void benchmarkPrefixKeys();
+    void benchmarkVerify();
+    void benchmarkReadStream();
+    void benchmarkReadValue();
+    void benchmarkReadValueAllocations_data();
+    void benchmarkReadValueAllocations();
+    void benchmarkSessionUnlock();
+    void benchmarkConcurrentGetValue_data();
+    void benchmarkConcurrentGetValue();
+
+private:
+    static void addSizes();
+    static QVariantMap values(int records, int valueSize);
+    QString preparedVault(int records, int valueSize);
+
+    QTemporaryDir _dir;
+    QVariantMap _kdf;
+    // a small vault shared by benchmarks of single operations
+    QString _vaultPath;
+};
+
+QVaultLibBenchmarks::QVaultLibBenchmarks()
+{
+}
+
+void QVaultLibBenchmarks::initTestCase()
+{
+    QVERIFY(_dir.isValid());
+
+    // the KDF costs the least, so results show the work of the vault itself
+    QScopedPointer<Kdf> kdf(Kdf::create(Kdf::Pbkdf2Sha256));
+    QVERIFY(kdf);
+    _kdf = kdf->parameters();
+
+    _vaultPath = _dir.filePath("vault");
+    QVERIFY(QVault::create(_vaultPath, PASSWORD, _kdf));
+}
+
+void QVaultLibBenchmarks::addSizes()
+{
+    QTest::addColumn<int>("records");
+    QTest::addColumn<int>("valueSize");
+
+    for (int records : {10, 1000, 10000, 100000}) {
+        for (int valueSize : {32, 1024}) {
+            const QByteArray tag = QString("%1 records, %2 bytes").arg(records).arg(valueSize).toLatin1();
+            QTest::newRow(tag.constData()) << records << valueSize;
+        }
+    }
+}
+
+QVariantMap QVaultLibBenchmarks::values(int records, int valueSize)
+{
+    // all values share one buffer, so large vaults are cheap to describe
+    const QByteArray value(valueSize, 'v');
+    QVariantMap values;
+    for (int i = 0; i < records; ++i) {
+        values.insert(QString("key%1").arg(i), value);
+    }
+
+    return values;
+}
+
+QString QVaultLibBenchmarks::preparedVault(int records, int valueSize)
+{
+    // vaults are reused by all benchmarks of the same size
+    const QString path = _dir.filePath(QString("vault_%1_%2").arg(records).arg(valueSize));
+    if (QFile(path).exists()) {
+        return path;
+    }
+
+    if (!QVault::create(path, PASSWORD, _kdf)) {
+        return QString();
+    }
+
+    QVault vault(path);
+    if (!vault.unlock(PASSWORD) || !vault.setValues(values(records, valueSize))) {
+        return QString();
+    }
+
+    return path;
+}
+
+void QVaultLibBenchmarks::benchmarkCreate_data()
+{
+    addSizes();
+}
+
+void QVaultLibBenchmarks::benchmarkCreate()
+{
+    QFETCH(int, records);
+    QFETCH(int, valueSize);
+
+    const QString path = _dir.filePath("created");
+    const QVariantMap createdValues = values(records, valueSize);
+
+    QBENCHMARK {
+        QFile(path).remove();
+        QFile(VaultJournal::journalPath(path)).remove();
+
+        bool ok = QVault::create(path, PASSWORD, _kdf);
+        QVERIFY(ok);
+        QVault vault(path);
+        ok = vault.unlock(PASSWORD) && vault.setValues(createdValues);
+        QVERIFY(ok);
+    }
+
+    QFile(path).remove();
+    QFile(VaultJournal::journalPath(path)).remove();
+}
+
+void QVaultLibBenchmarks::benchmarkUnlock_data()
+{
+    addSizes();
+}
+
+void QVaultLibBenchmarks::benchmarkUnlock()
+{
+    QFETCH(int, records);
+    QFETCH(int, valueSize);
+
+    const QString path = preparedVault(records, valueSize);
+    QVERIFY(!path.isEmpty());
+
+    QVault vault(path);
+    bool ok = true;
+    QBENCHMARK {
+        ok = vault.unlock(PASSWORD);
+        vault.lock();
+    }
+    QVERIFY(ok);
+}
+
+void QVaultLibBenchmarks::benchmarkGetValue_data()
+{
+    addSizes();
+}
+
+void QVaultLibBenchmarks::benchmarkGetValue()
+{
+    QFETCH(int, records);
+    QFETCH(int, valueSize);
+
+    const QString path = preparedVault(records, valueSize);
+    QVERIFY(!path.isEmpty());
+
+    QVault vault(path);
+    bool ok = vault.unlock(PASSWORD);
+    QVERIFY(ok);
+
+    const QStringList keys = values(records, valueSize).keys();
+    int i = 0;
+    QBENCHMARK {
+        vault.getValue(keys.at(i++ % records), &ok);
+    }
+    QVERIFY(ok);
+}
+
+void QVaultLibBenchmarks::benchmarkSetValue_data()
+{
+    addSizes();
+}
+
+void QVaultLibBenchmarks::benchmarkSetValue()
+{
+    QFETCH(int, records);
+    QFETCH(int, valueSize);
+
+    const QString path = preparedVault(records, valueSize);
+    QVERIFY(!path.isEmpty());
+
+    QVault vault(path);
+    bool ok = vault.unlock(PASSWORD);
+    QVERIFY(ok);
+
+    // existing values are replaced, so the vault keeps its size
+    const QStringList keys = values(records, valueSize).keys();
+    const QByteArray value(valueSize, 's');
+    int i = 0;
+    QBENCHMARK {
+        ok = vault.setValue(keys.at(i++ % records), value);
+    }
+    QVERIFY(ok);
+}
+
+void QVaultLibBenchmarks::benchmarkRemoveValue_data()
+{
+    addSizes();
+}
+
+void QVaultLibBenchmarks::benchmarkRemoveValue()
+{
+    QFETCH(int, records);
+    QFETCH(int, valueSize);
+
+    const QString path = preparedVault(records, valueSize);
+    QVERIFY(!path.isEmpty());
+
+    QVault vault(path);
+    bool ok = vault.unlock(PASSWORD);
+    QVERIFY(ok);
+
+    // a value can be removed once, so the same number of values is removed at every size
+    const QStringList keys = values(records, valueSize).keys().mid(0, REMOVED_RECORDS);
+    QBENCHMARK_ONCE {
+        for (const QString &key : keys) {
+            ok = vault.removeValue(key) && ok;
+        }
+    }
+    QVERIFY(ok);
+
+    QVariantMap removed;
+    for (const QString &key : keys) {
+        removed.insert(key, QByteArray(valueSize, 'v'));
+    }
+    ok = vault.setValues(removed);
+    QVERIFY(ok);
+}
+
+void QVaultLibBenchmarks::benchmarkChangePassword_data()
+{
+    addSizes();
+}
+
+void QVaultLibBenchmarks::benchmarkChangePassword()
+{
+    QFETCH(int, records);
+    QFETCH(int, valueSize);
+
+    const QString path = preparedVault(records, valueSize);
+    QVERIFY(!path.isEmpty());
+
+    QVault vault(path);
+    bool ok = vault.unlock(PASSWORD);
+    QVERIFY(ok);
+
+    QString password = PASSWORD;
+    QBENCHMARK {
+        password = password == PASSWORD ? NEW_PASSWORD : PASSWORD;
+        ok = vault.changePassword(password, _kdf);
+    }
+    QVERIFY(ok);
+
+    if (password != PASSWORD) {
+        ok = vault.changePassword(PASSWORD, _kdf);
+        QVERIFY(ok);
+    }
+}
+
+void QVaultLibBenchmarks::benchmarkRotateDataKey_data()
+{
+    addSizes();
+}
+
+void QVaultLibBenchmarks::benchmarkRotateDataKey()
+{
+    QFETCH(int, records);
+    QFETCH(int, valueSize);
+
+    const QString path = preparedVault(records, valueSize);
+    QVERIFY(!path.isEmpty());
+
+    QVault vault(path);
+    bool ok = vault.unlock(PASSWORD);
+    QVERIFY(ok);
+
+    // all records are re-encrypted and the vault file is rewritten
+    QBENCHMARK {
+        ok = vault.rotateDataKey(PASSWORD, _kdf);
+    }
+    QVERIFY(ok);
+}
+
+void QVaultLibBenchmarks::benchmarkSyncPolicy_data()
+{
+    QTest::addColumn<int>("policy");
+
+    QTest::newRow("NoSync") << int(QVault::NoSync);
+    QTest::newRow("SyncEveryWrite") << int(QVault::SyncEveryWrite);
+    QTest::newRow("GroupCommit") << int(QVault::GroupCommit);
+}
+
+void QVaultLibBenchmarks::benchmarkSyncPolicy()
+{
+    QFETCH(int, policy);
+
+    QVault vault(_vaultPath);
+    bool ok = vault.unlock(PASSWORD);
+    QVERIFY(ok);
+    vault.setSyncPolicy(QVault::SyncPolicy(policy));
+
+    int counter = 0;
+    QBENCHMARK {
+        vault.setValue("benchmarkKey", counter++);
+    }
+}
+
+void QVaultLibBenchmarks::benchmarkCipherEncrypt()
+{
+    AesCipher cipher(QByteArray(16, 'k'), QByteArray(16, 'i'));
+    const QByteArray data("btc-wallet-key");
+
+    QBENCHMARK {
+        cipher.encrypt(data);
+    }
+}
+
+void QVaultLibBenchmarks::benchmarkCipherDecrypt()
+{
+    AesCipher cipher(QByteArray(16, 'k'), QByteArray(16, 'i'));
+    const QByteArray data = cipher.encrypt("btc-wallet-key");
+    QCOMPARE(cipher.decrypt(data), QByteArray("btc-wallet-key"));
+
+    QBENCHMARK {
+        cipher.decrypt(data);
+    }
+}
+
+void QVaultLibBenchmarks::benchmarkCipherEncryptPerCall()
+{
+    // the context is keyed on every call, as AesCipher did before it kept keyed
+    // contexts, to compare with benchmarkCipherEncrypt(). The key is the one
+    // AesCipher pads to the AES-256 key size.
+    const QByteArray key = QByteArray(16, 'k') + QByteArray(16, '\0');
+    const QByteArray iv(16, 'i');
+    const QByteArray data("btc-wallet-key");
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+
+    QBENCHMARK {
+        QByteArray buffer(data.size() + 16, '\0');
+        unsigned char *dest = reinterpret_cast<unsigned char*>(buffer.data());
+        int len = 0, finalLen = 0;
+        EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), NULL,
+                           reinterpret_cast<const unsigned char*>(key.constData()),
+                           reinterpret_cast<const unsigned char*>(iv.constData()));
+        EVP_EncryptUpdate(ctx, dest, &len, reinterpret_cast<const unsigned char*>(data.constData()), data.size());
+        EVP_EncryptFinal_ex(ctx, dest + len, &finalLen);
+        buffer.resize(len + finalLen);
+    }
+
+    EVP_CIPHER_CTX_free(ctx);
+}
+
+void QVaultLibBenchmarks::benchmarkCipherDecryptPerCall()
+{
+    const QByteArray key = QByteArray(16, 'k') + QByteArray(16, '\0');
+    const QByteArray iv(16, 'i');
+    const QByteArray data = AesCipher(QByteArray(16, 'k'), iv).encrypt("btc-wallet-key");
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+
+    QBENCHMARK {
+        QByteArray buffer(data.size(), '\0');
+        unsigned char *dest = reinterpret_cast<unsigned char*>(buffer.data());
+        int len = 0, finalLen = 0;
+        EVP_DecryptInit_ex(ctx, EVP_aes_256_cbc(), NULL,
+                           reinterpret_cast<const unsigned char*>(key.constData()),
+                           reinterpret_cast<const unsigned char*>(iv.constData()));
+        EVP_DecryptUpdate(ctx, dest, &len, reinterpret_cast<const unsigned char*>(data.constData()), data.size());
+        EVP_DecryptFinal_ex(ctx, dest + len, &finalLen);
+        buffer.resize(len + finalLen);
+    }
+
+    EVP_CIPHER_CTX_free(ctx);
+}
+
+void QVaultLibBenchmarks::benchmarkAeadEncrypt_data()
+{
+    QTest::addColumn<int>("algorithm");
+
+    QTest::newRow("AES-GCM") << int(AeadCipher::AesGcm);
+    QTest::newRow("ChaCha20-Poly1305") << int(AeadCipher::ChaCha20Poly1305);
+}
+
+void QVaultLibBenchmarks::benchmarkAeadEncrypt()
+{
+    QFETCH(int, algorithm);
+
+    AeadCipher cipher(AeadCipher::Algorithm(algorithm), QByteArray(32, 'k'));
+    const QByteArray data("btc-wallet-key");
+    const QByteArray associatedData(32, 'a');
+    QCOMPARE(cipher.decrypt(cipher.encrypt(data, associatedData), associatedData), data);
+
+    QBENCHMARK {
+        cipher.encrypt(data, associatedData);
+    }
+}
+
+void QVaultLibBenchmarks::benchmarkValueDecode_data()
+{
+    QTest::addColumn<bool>("legacy");
+    QTest::addColumn<QVariant>("value");
+
+    QTest::newRow("QDataStream bytes") << true << QVariant(QByteArray(64, 'b'));
+    QTest::newRow("ValueCodec bytes") << false << QVariant(QByteArray(64, 'b'));
+    QTest::newRow("QDataStream string") << true << QVariant(QString("btc-wallet-key"));
+    QTest::newRow("ValueCodec string") << false << QVariant(QString("btc-wallet-key"));
+    QTest::newRow("QDataStream int") << true << QVariant(42);
+    QTest::newRow("ValueCodec int") << false << QVariant(42);
+}
+
+void QVaultLibBenchmarks::benchmarkValueDecode()
+{
+    QFETCH(bool, legacy);
+    QFETCH(QVariant, value);
+
+    QByteArray encoded;
+    if (legacy) {
+        QDataStream out(&encoded, QIODevice::WriteOnly);
+        out << value;
+    } else {
+        encoded = ValueCodec::encode(value);
+    }
+    QVERIFY(!encoded.isEmpty());
+
+    QVariant decoded;
+    QBENCHMARK {
+        ValueCodec::decode(encoded, &decoded);
+    }
+    QCOMPARE(decoded, value);
+}
+
+void QVaultLibBenchmarks::benchmarkGetSingleValue()
+{
+    QVault vault(_vaultPath);
+    bool ok = vault.unlock(PASSWORD);
+    QVERIFY(ok);
+    ok = vault.setValue("benchmarkKey", QString("benchmark value"));
+    QVERIFY(ok);
+
+    QBENCHMARK {
+        vault.getValue("benchmarkKey", &ok);
+    }
+    QVERIFY(ok);
+}
+
+void QVaultLibBenchmarks::benchmarkReadValue()
+{
+    QVault vault(_vaultPath);
+    bool ok = vault.unlock(PASSWORD);
+    QVERIFY(ok);
+    ok = vault.setValue("benchmarkBytes", QByteArray("benchmark value"));
+    QVERIFY(ok);
+
+    QByteArray value;
+    QBENCHMARK {
+        ok = vault.readValue("benchmarkBytes", &value);
+    }
+    QVERIFY(ok);
+}
+
+void QVaultLibBenchmarks::benchmarkReadValueAllocations_data()
+{
+    QTest::addColumn<bool>("readValue");
+
+    QTest::newRow("getValue") << false;
+    QTest::newRow("readValue") << true;
+}
+
+void QVaultLibBenchmarks::benchmarkReadValueAllocations()
+{
+#if defined(__GLIBC__)
+    QFETCH(bool, readValue);
+
+    QVault vault(_vaultPath);
+    bool ok = vault.unlock(PASSWORD);
+    QVERIFY(ok);
+    ok = vault.setValue("benchmarkBytes", QByteArray(256, 'b'));
+    QVERIFY(ok);
+
+    const QString key("benchmarkBytes");
+    QByteArray value;
+    const int reads = 1000;
+
+    // the first read grows the buffers, the counted ones reuse them
+    ok = vault.readValue(key, &value);
+    QVERIFY(ok);
+
+    const int allocations = allocationCount.load();
+    for (int i = 0; i < reads; ++i) {
+        if (readValue) {
+            ok = vault.readValue(key, &value);
+        } else {
+            value = vault.getValue(key, &ok).toByteArray();
+        }
+    }
+    const int readAllocations = allocationCount.load() - allocations;
+    QVERIFY(ok);
+
+    QTest::setBenchmarkResult(qreal(readAllocations) / reads, QTest::Events);
+#else
+    QSKIP("Allocations are counted with glibc only");
+#endif
+}
+
+void QVaultLibBenchmarks::benchmarkCachedGetValue()
+{
+    QVault vault(_vaultPath);
+    bool ok = vault.unlock(PASSWORD);
+    QVERIFY(ok);
+    ok = vault.setValue("benchmarkKey", QString("benchmark value"));
+    QVERIFY(ok);
+    vault.setCacheBudget(1024 * 1024);
+
+    QBENCHMARK {
+        vault.getValue("benchmarkKey", &ok);
+    }
+    QVERIFY(ok);
+    QVERIFY(vault.cacheHits() > 0);
+}
+
+void QVaultLibBenchmarks::benchmarkMeteredGetValue()
+{
+    QVault vault(_vaultPath);
+    bool ok = vault.unlock(PASSWORD);
+    QVERIFY(ok);
+    ok = vault.setValue("benchmarkKey", QString("benchmark value"));
+    QVERIFY(ok);
+
+    // compared with benchmarkGetSingleValue, shows the cost of enabled metrics
+    VaultMetrics metrics;
+    vault.setMetrics(&metrics);
+
+    QBENCHMARK {
+        vault.getValue("benchmarkKey", &ok);
+    }
+    QVERIFY(ok);
+    QVERIFY(metrics.count(VaultMetrics::GetValue) > 0);
+    vault.setMetrics(nullptr);
+}
+
+void QVaultLibBenchmarks::benchmarkPrefixKeys()
+{
+    const QString keysVaultPath = _dir.filePath("keys");
+    bool ok = QVault::create(keysVaultPath, PASSWORD, _kdf);
+    QVERIFY(ok);
+
+    QVault vault(keysVaultPath);
+    ok = vault.unlock(PASSWORD);
+    QVERIFY(ok);
+    QVariantMap values;
+    for (int i = 0; i < 10000; ++i) {
+        values.insert(QString("key%1").arg(i, 5, 10, QChar('0')), i);
+    }
+    ok = vault.setValues(values);
+    QVERIFY(ok);
+
+    // the first query builds the index
+    QCOMPARE(vault.keys().size(), values.size());
+
+    QStringList keys;
+    QBENCHMARK {
+        keys = vault.keys("key050");
+    }
+    QCOMPARE(keys.size(), 10);
+}
+
+void QVaultLibBenchmarks::benchmarkVerify()
+{
+    const QString verifyVaultPath = _dir.filePath("verify");
+    bool ok = QVault::create(verifyVaultPath, PASSWORD, _kdf);
+    QVERIFY(ok);
+
+    QVault vault(verifyVaultPath);
+    ok = vault.unlock(PASSWORD);
+    QVERIFY(ok);
+    QVariantMap values;
+    for (int i = 0; i < 10000; ++i) {
+        values.insert(QString("key%1").arg(i), QString("value %1").arg(i));
+    }
+    ok = vault.setValues(values);
+    QVERIFY(ok);
+    ok = vault.changePassword(PASSWORD, _kdf);
+    QVERIFY(ok);
+
+    QBENCHMARK {
+        ok = vault.verify();
+    }
+    QVERIFY(ok);
+}
+
+void QVaultLibBenchmarks::benchmarkReadStream()
+{
+    QVault vault(_vaultPath);
+    bool ok = vault.unlock(PASSWORD);
+    QVERIFY(ok);
+
+    QByteArray data(4 * 1024 * 1024, 's');
+    QBuffer source(&data);
+    source.open(QIODevice::ReadOnly);
+    ok = vault.writeStream("benchmarkStream", &source);
+    QVERIFY(ok);
+
+    QByteArray read;
+    read.reserve(data.size());
+    QBuffer output(&read);
+    QBENCHMARK {
+        output.open(QIODevice::WriteOnly);
+        ok = vault.readStream("benchmarkStream", &output);
+        output.close();
+    }
+    QVERIFY(ok);
+    QCOMPARE(read, data);
+
+    ok = vault.removeValue("benchmarkStream");
+    QVERIFY(ok);
+}
+
+void QVaultLibBenchmarks::benchmarkSessionUnlock()
+{
+    VaultSession session(-1);
+    QVault vault(_vaultPath);
+    bool ok = vault.unlock(PASSWORD);
+    QVERIFY(ok);
+    ok = vault.startSession(&session);
+    QVERIFY(ok);
+    vault.lock();
+
+    QBENCHMARK {
+        vault.unlock(&session);
+        vault.lock();
+    }
+
+    QVERIFY(session.isValid());
+}
+
+void QVaultLibBenchmarks::benchmarkConcurrentGetValue_data()
+{
+    QTest::addColumn<int>("threads");
+
+    for (int threads = 1; threads <= QThread::idealThreadCount(); threads *= 2) {
+        QTest::newRow(QString("%1 threads").arg(threads).toLatin1().constData()) << threads;
+    }
+}
+
+void QVaultLibBenchmarks::benchmarkConcurrentGetValue()
+{
+    QFETCH(int, threads);
+
+    QVault vault(_vaultPath);
+    bool ok = vault.unlock(PASSWORD);
+    QVERIFY(ok);
+    ok = vault.setValue("benchmarkKey", QString("benchmark value"));
+    QVERIFY(ok);
+
+    // the same amount of reads is split across threads, so the time drops as reads scale
+    const int totalReads = 16000;
+    QThreadPool pool;
+    pool.setMaxThreadCount(threads);
+
+    QBENCHMARK {
+        QList<QFuture<void>> readers;
+        for (int i = 0; i < threads; ++i) {
+            readers.append(QtConcurrent::run(&pool, [&vault, threads, totalReads]() {
+                bool found = false;
+                for (int c = 0; c < totalReads / threads; ++c) {
+                    vault.getValue("benchmarkKey", &found);
+                }
+            }));
+        }
+        for (QFuture<void> &reader : readers) {
+            reader.waitForFinished();
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    QVaultLibBenchmarks benchmarks;
+
+    // results are tracked between releases, so they are printed as CSV
+    // unless another format is requested
+    QStringList arguments = app.arguments();
+    const QStringList formats = {"-txt", "-csv", "-xml", "-xunitxml", "-lightxml", "-teamcity", "-tap"};
+    const bool hasFormat = std::any_of(arguments.constBegin(), arguments.constEnd(), [&formats](const QString &argument) {
+        return formats.contains(argument) || argument == "-o";
+    });
+    if (!hasFormat) {
+        arguments.append("-csv");
+    }
+
+    return QTest::qExec(&benchmarks, arguments);
+}
+
+#include "QVaultLibBenchmarks.moc"
@@ -0,0 +1,24 @@
+#-------------------------------------------------
+# QVaultLib benchmarks
+#
+# Results are printed as CSV by default, pass
+# -txt or -xml to get another format.
+#-------------------------------------------------
+
+QT += testlib concurrent
+QT -= gui
+
+TARGET = bench_qvaultlib
+CONFIG   += console
+CONFIG   -= app_bundle
+TEMPLATE = app
+DESTDIR = ../dist
+
+DEFINES += QT_DEPRECATED_WARNINGS
+
+include(../QVaultLib/QVaultLib.pri)
+
+LIBS += -lssl -lcrypto
+
+SOURCES += \
+    QVaultLibBenchmarks.cpp
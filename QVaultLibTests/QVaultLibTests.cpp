@@ -1,11 +1,26 @@
 #include <QVault.h>
 #include <CryptoContext.h>
-#include <AesCipher.h>
+#include <AeadCipher.h>
+#include <VaultJournal.h>
+#include <VaultSession.h>
+#include <Kdf.h>
+#include <ValueCodec.h>
+#include <VaultBlob.h>
+#include <VaultMetrics.h>
+#include <VaultShards.h>
+#include <SecureArena.h>
+#include <MerkleTree.h>
 
 #include <QString>
 #include <QtTest>
 #include <QDir>
+#include <QBuffer>
 #include <QDateTime>
+#include <QTemporaryDir>
+#include <QtConcurrent>
+
+#include <limits>
+#include <numeric>
 
 class QVaultLibTest : public QObject
 {
@@ -16,6 +31,8 @@ public:
     ~QVaultLibTest();
 
 private Q_SLOTS:
+    void init();
+    void cleanup();
     void testNewVaultInstanceIsLocked();
     void testVaultFilePathMethod();
     void testGetValueInLockedState();
@@ -26,9 +43,47 @@ private Q_SLOTS:
     void testSetAndRemoveValue();
     void testLockUnlockSequence();
     void testChangePassword();
+    void testJournalReplay();
+    void testJournalTornTail();
+    void testSyncPolicy();
+    void testTransaction();
+    void testSetValues();
+    void testCompaction();
+    void testConcurrentReaders();
+    void testAsyncWrites();
+    void testMultipleInstances();
+    void testSessionUnlock();
+    void testKdfAlgorithms_data();
+    void testKdfAlgorithms();
+    void testLegacyKdf();
+    void testKdfCalibration();
+    void testPasswordSlots();
+    void testRotateDataKey();
+    void testAbortReencryption();
+    void testCipherSuites_data();
+    void testCipherSuites();
+    void testReadValue_data();
+    void testReadValue();
+    void testValueCodec_data();
+    void testValueCodec();
+    void testValueCompression();
+    void testStreams();
+    void testValueCache();
+    void testKeys_data();
+    void testKeys();
+    void testMetrics();
+    void testShards();
+    void testSecureArena();
+    void testVerify();
 
 private:
+    QString testPath(const QString &name) const;
+
     QString _vaultPath;
+    // the cheapest KDF, for vaults created by single tests
+    QVariantMap _kdf;
+    // files of the running test, removed with all sidecars after it
+    QScopedPointer<QTemporaryDir> _testDir;
 };
 
 QVaultLibTest::QVaultLibTest()
@@ -41,11 +96,34 @@ QVaultLibTest::QVaultLibTest()
 
     QVERIFY(success);
     QVERIFY(QFile(_vaultPath).size() > 0);
+
+    _kdf = Kdf::calibratedParameters(Kdf::Pbkdf2Sha256, 10);
 }
 
 QVaultLibTest::~QVaultLibTest()
 {
     QFile(_vaultPath).remove();
+    QFile(VaultJournal::journalPath(_vaultPath)).remove();
+    QDir(QVault::blobsPath(_vaultPath)).removeRecursively();
+    QDir(VaultShards::directoryPath(_vaultPath)).removeRecursively();
+    QFile(_vaultPath + ".lock").remove();
+}
+
+void QVaultLibTest::init()
+{
+    _testDir.reset(new QTemporaryDir());
+    QVERIFY(_testDir->isValid());
+}
+
+void QVaultLibTest::cleanup()
+{
+    // journals, blobs, shards and lock files go with the directory
+    _testDir.reset();
+}
+
+QString QVaultLibTest::testPath(const QString &name) const
+{
+    return _testDir->filePath(name);
 }
 
 void QVaultLibTest::testNewVaultInstanceIsLocked()
@@ -170,7 +248,7 @@ void QVaultLibTest::testLockUnlockSequence()
 
 void QVaultLibTest::testChangePassword()
 {
-    QString newVaultPath = _vaultPath + "_newPassword";
+    QString newVaultPath = testPath("newPassword");
     bool ok = QFile(_vaultPath).copy(newVaultPath);
     QVERIFY(ok);
 
@@ -187,10 +265,1401 @@ void QVaultLibTest::testChangePassword()
     ok = vault.unlock("new password");
     QVERIFY(ok);
     QVERIFY(!vault.isLocked());
+}
+
+void QVaultLibTest::testJournalReplay()
+{
+    const QString journalVaultPath = testPath("journal");
+    bool ok = QVault::create(journalVaultPath, "password", _kdf);
+    QVERIFY(ok);
+
+    QVault vault(journalVaultPath);
+    ok = vault.unlock("password");
+    QVERIFY(ok);
+
+    ok = vault.setValue("journalKey", QString("journal value"));
+    QVERIFY(ok);
+    QVERIFY(QFile(VaultJournal::journalPath(journalVaultPath)).size() > 0);
+
+    QVault other(journalVaultPath);
+    ok = other.unlock("password");
+    QVERIFY(ok);
+
+    QString stringValue = other.getValue("journalKey", &ok).toString();
+    QVERIFY(ok);
+    QCOMPARE(stringValue, "journal value");
+}
+
+void QVaultLibTest::testJournalTornTail()
+{
+    const QString tornVaultPath = testPath("torn");
+    bool ok = QVault::create(tornVaultPath, "password", _kdf);
+    QVERIFY(ok);
+    {
+        QVault writer(tornVaultPath);
+        ok = writer.unlock("password");
+        QVERIFY(ok);
+        ok = writer.setValue("journalKey", QString("journal value"));
+        QVERIFY(ok);
+    }
+
+    const QString journalPath = VaultJournal::journalPath(tornVaultPath);
+    const qint64 journalSize = QFile(journalPath).size();
+    QVERIFY(journalSize > 0);
+
+    QFile journal(journalPath);
+    QVERIFY(journal.open(QFile::WriteOnly | QFile::Append));
+    journal.write(QByteArray(10, 'x'));
+    journal.close();
+
+    QVault vault(tornVaultPath);
+    ok = vault.unlock("password");
+    QVERIFY(ok);
+    QCOMPARE(QFile(journalPath).size(), journalSize);
+
+    QString stringValue = vault.getValue("journalKey", &ok).toString();
+    QVERIFY(ok);
+    QCOMPARE(stringValue, "journal value");
+}
+
+void QVaultLibTest::testSyncPolicy()
+{
+    const QString syncVaultPath = testPath("sync");
+    bool ok = QVault::create(syncVaultPath, "password", _kdf);
+    QVERIFY(ok);
+
+    QVault vault(syncVaultPath);
+    ok = vault.unlock("password");
+    QVERIFY(ok);
+    QCOMPARE(vault.syncPolicy(), QVault::NoSync);
+
+    vault.setSyncPolicy(QVault::SyncEveryWrite);
+    QCOMPARE(vault.syncPolicy(), QVault::SyncEveryWrite);
+    ok = vault.setValue("syncedKey", QString("synced value"));
+    QVERIFY(ok);
+
+    vault.setSyncPolicy(QVault::GroupCommit, 5);
+    QCOMPARE(vault.syncPolicy(), QVault::GroupCommit);
+    ok = vault.setValue("groupKey", QString("group value"));
+    QVERIFY(ok);
+    // a write within the interval leaves its sync to the timer, which needs the event loop
+    ok = vault.setValue("groupKey2", QString("group value 2"));
+    QVERIFY(ok);
+    QTest::qWait(50);
+    ok = vault.setValue("groupKey3", QString("group value 3"));
+    QVERIFY(ok);
+    ok = vault.flush();
+    QVERIFY(ok);
+    vault.lock();
+
+    ok = vault.unlock("password");
+    QVERIFY(ok);
+    QString stringValue = vault.getValue("syncedKey", &ok).toString();
+    QVERIFY(ok);
+    QCOMPARE(stringValue, "synced value");
+    stringValue = vault.getValue("groupKey", &ok).toString();
+    QVERIFY(ok);
+    QCOMPARE(stringValue, "group value");
+    stringValue = vault.getValue("groupKey2", &ok).toString();
+    QVERIFY(ok);
+    QCOMPARE(stringValue, "group value 2");
+    stringValue = vault.getValue("groupKey3", &ok).toString();
+    QVERIFY(ok);
+    QCOMPARE(stringValue, "group value 3");
+}
+
+void QVaultLibTest::testTransaction()
+{
+    const QString transactionVaultPath = testPath("transaction");
+    bool ok = QVault::create(transactionVaultPath, "password", _kdf);
+    QVERIFY(ok);
+
+    QVault vault(transactionVaultPath);
+    ok = vault.unlock("password");
+    QVERIFY(ok);
+    ok = vault.setValue("journalKey", QString("journal value"));
+    QVERIFY(ok);
+
+    ok = vault.commit();
+    QVERIFY(!ok);
+
+    ok = vault.beginTransaction();
+    QVERIFY(ok);
+    QVERIFY(vault.isInTransaction());
+    vault.setValue("rolledBackKey", 1);
+    vault.getValue("rolledBackKey", &ok);
+    QVERIFY(ok);
+    ok = vault.rollback();
+    QVERIFY(ok);
+    vault.getValue("rolledBackKey", &ok);
+    QVERIFY(!ok);
+
+    ok = vault.beginTransaction();
+    QVERIFY(ok);
+    vault.setValue("committedKey", 2);
+    vault.removeValue("journalKey");
+    ok = vault.commit();
+    QVERIFY(ok);
+    QVERIFY(!vault.isInTransaction());
+    vault.lock();
+
+    ok = vault.unlock("password");
+    QVERIFY(ok);
+    int intValue = vault.getValue("committedKey", &ok).toInt();
+    QVERIFY(ok);
+    QCOMPARE(intValue, 2);
+    vault.getValue("journalKey", &ok);
+    QVERIFY(!ok);
+}
+
+void QVaultLibTest::testSetValues()
+{
+    QVariantMap values;
+    for (int i = 0; i < 500; ++i) {
+        values.insert(QString("bulkKey%1").arg(i), i);
+    }
+
+    QVault vault(_vaultPath);
+    bool ok = vault.unlock("password");
+    QVERIFY(ok);
+    ok = vault.setValues(values);
+    QVERIFY(ok);
+    vault.lock();
+
+    ok = vault.unlock("password");
+    QVERIFY(ok);
+    for (int i = 0; i < 500; ++i) {
+        int intValue = vault.getValue(QString("bulkKey%1").arg(i), &ok).toInt();
+        QVERIFY(ok);
+        QCOMPARE(intValue, i);
+    }
+}
+
+void QVaultLibTest::testCompaction()
+{
+    QVault vault(_vaultPath);
+    bool ok = vault.unlock("password");
+    QVERIFY(ok);
+
+    for (int i = 0; i < 2000; ++i) {
+        ok = vault.setValue(QString("compactedKey%1").arg(i), i);
+        QVERIFY(ok);
+    }
+    ok = vault.removeValue("compactedKey0");
+    QVERIFY(ok);
+
+    const qint64 journalSize = QFile(VaultJournal::journalPath(_vaultPath)).size();
+    QVERIFY(journalSize < QFile(_vaultPath).size());
+    vault.lock();
+
+    ok = vault.unlock("password");
+    QVERIFY(ok);
+    vault.getValue("compactedKey0", &ok);
+    QVERIFY(!ok);
+    for (int i = 1; i < 2000; ++i) {
+        int intValue = vault.getValue(QString("compactedKey%1").arg(i), &ok).toInt();
+        QVERIFY(ok);
+        QCOMPARE(intValue, i);
+    }
+}
+
+void QVaultLibTest::testConcurrentReaders()
+{
+    QVault vault(_vaultPath);
+    bool ok = vault.unlock("password");
+    QVERIFY(ok);
+    ok = vault.setValue("sharedKey", QString("shared value"));
+    QVERIFY(ok);
+
+    QAtomicInt failures;
+    QList<QFuture<void>> readers;
+    for (int i = 0; i < 4; ++i) {
+        readers.append(QtConcurrent::run([&vault, &failures]() {
+            for (int c = 0; c < 500; ++c) {
+                bool found = false;
+                if (vault.getValue("sharedKey", &found).toString() != "shared value" || !found) {
+                    failures.ref();
+                }
+            }
+        }));
+    }
+
+    for (int c = 0; c < 50; ++c) {
+        ok = vault.setValue(QString("writerKey%1").arg(c), c);
+        QVERIFY(ok);
+    }
+
+    for (QFuture<void> &reader : readers) {
+        reader.waitForFinished();
+    }
+    QCOMPARE(failures.load(), 0);
+}
+
+void QVaultLibTest::testAsyncWrites()
+{
+    const QString asyncVaultPath = testPath("async");
+    bool ok = QVault::create(asyncVaultPath, "password", _kdf);
+    QVERIFY(ok);
+
+    QVault vault(asyncVaultPath);
+    ok = vault.unlock("password");
+    QVERIFY(ok);
+
+    QSignalSpy savedSpy(&vault, &QVault::saved);
+    QList<QFuture<bool>> futures;
+    for (int i = 0; i < 100; ++i) {
+        futures.append(vault.setValueAsync(QString("asyncKey%1").arg(i), i));
+    }
+    futures.append(vault.removeValueAsync("asyncKey0"));
+
+    // values are readable before they are written
+    QCOMPARE(vault.getValue("asyncKey1", &ok).toInt(), 1);
+    QVERIFY(ok);
+    vault.getValue("asyncKey0", &ok);
+    QVERIFY(!ok);
+
+    ok = vault.flush();
+    QVERIFY(ok);
+    for (QFuture<bool> &future : futures) {
+        future.waitForFinished();
+        QVERIFY(future.result());
+    }
+    QTRY_VERIFY(savedSpy.count() > 0);
+    QVERIFY(savedSpy.first().first().toBool());
+
+    QVault reopened(asyncVaultPath);
+    ok = reopened.unlock("password");
+    QVERIFY(ok);
+    reopened.getValue("asyncKey0", &ok);
+    QVERIFY(!ok);
+    for (int i = 1; i < 100; ++i) {
+        QCOMPARE(reopened.getValue(QString("asyncKey%1").arg(i), &ok).toInt(), i);
+        QVERIFY(ok);
+    }
+
+    vault.lock();
+    QFuture<bool> future = vault.setValueAsync("asyncKey1", 1);
+    QVERIFY(future.isFinished());
+    QVERIFY(!future.result());
+}
+
+void QVaultLibTest::testMultipleInstances()
+{
+    // separate instances share nothing but the files, as separate processes do
+    QVault first(_vaultPath);
+    QVault second(_vaultPath);
+    bool ok = first.unlock("password") && second.unlock("password");
+    QVERIFY(ok);
+
+    ok = first.setValue("firstKey", 1);
+    QVERIFY(ok);
+    ok = second.setValue("secondKey", 2);
+    QVERIFY(ok);
+
+    // writes catch up with changes of other instances before writing
+    QCOMPARE(second.getValue("firstKey", &ok).toInt(), 1);
+    QVERIFY(ok);
+
+    // readers catch up on refresh
+    first.getValue("secondKey", &ok);
+    QVERIFY(!ok);
+    ok = first.refresh();
+    QVERIFY(ok);
+    QCOMPARE(first.getValue("secondKey", &ok).toInt(), 2);
+    QVERIFY(ok);
+
+    // a rewritten vault file is detected as well
+    ok = second.clear();
+    QVERIFY(ok);
+    ok = second.setValue("thirdKey", 3);
+    QVERIFY(ok);
+    ok = first.setValue("fourthKey", 4);
+    QVERIFY(ok);
+    first.getValue("firstKey", &ok);
+    QVERIFY(!ok);
+
+    QVault third(_vaultPath);
+    ok = third.unlock("password");
+    QVERIFY(ok);
+    third.getValue("secondKey", &ok);
+    QVERIFY(!ok);
+    QCOMPARE(third.getValue("thirdKey", &ok).toInt(), 3);
+    QVERIFY(ok);
+    QCOMPARE(third.getValue("fourthKey", &ok).toInt(), 4);
+    QVERIFY(ok);
+}
+
+void QVaultLibTest::testSessionUnlock()
+{
+    const QString sessionVaultPath = testPath("session");
+    bool ok = QVault::create(sessionVaultPath, "password", _kdf);
+    QVERIFY(ok);
+
+    VaultSession session(60000);
+    QVERIFY(!session.isValid());
+
+    QVault vault(sessionVaultPath);
+    ok = vault.startSession(&session);
+    QVERIFY(!ok);
+    ok = vault.unlock("password");
+    QVERIFY(ok);
+    ok = vault.setValue("sessionKey", "sessionValue");
+    QVERIFY(ok);
+    ok = vault.startSession(&session);
+    QVERIFY(ok);
+    QVERIFY(session.isValid());
+    vault.lock();
+
+    // the session outlives lock() and unlocks without the password
+    ok = vault.unlock(&session);
+    QVERIFY(ok);
+    QCOMPARE(vault.getValue("sessionKey", &ok).toString(), QString("sessionValue"));
+    QVERIFY(ok);
+
+    // a new password invalidates the keys held by the session
+    ok = vault.changePassword("newPassword");
+    QVERIFY(ok);
+    vault.lock();
+    ok = vault.unlock(&session);
+    QVERIFY(!ok);
+    QVERIFY(vault.isLocked());
+
+    VaultSession shortSession(1);
+    ok = vault.unlock("newPassword");
+    QVERIFY(ok);
+    ok = vault.startSession(&shortSession);
+    QVERIFY(ok);
+    vault.lock();
+    QTest::qWait(10);
+    QVERIFY(!shortSession.isValid());
+    ok = vault.unlock(&shortSession);
+    QVERIFY(!ok);
+
+    session.wipe();
+    QVERIFY(!session.isValid());
+}
+
+void QVaultLibTest::testKdfAlgorithms_data()
+{
+    QTest::addColumn<int>("algorithm");
+
+    QTest::newRow("PBKDF2-SHA1") << int(Kdf::Pbkdf2Sha1);
+    QTest::newRow("PBKDF2-SHA256") << int(Kdf::Pbkdf2Sha256);
+    QTest::newRow("PBKDF2-SHA512") << int(Kdf::Pbkdf2Sha512);
+    QTest::newRow("scrypt") << int(Kdf::Scrypt);
+    QTest::newRow("Argon2id") << int(Kdf::Argon2id);
+}
+
+void QVaultLibTest::testKdfAlgorithms()
+{
+    QFETCH(int, algorithm);
+
+    if (!Kdf::isSupported(Kdf::Algorithm(algorithm))) {
+        QSKIP("The algorithm is not provided by OpenSSL.");
+    }
+
+    QString kdfVaultPath = testPath("kdf");
+    bool ok = QVault::create(kdfVaultPath, "password", Kdf::Algorithm(algorithm));
+    QVERIFY(ok);
+
+    QVault vault(kdfVaultPath);
+    ok = vault.unlock("wrong password");
+    QVERIFY(!ok);
+    ok = vault.unlock("password");
+    QVERIFY(ok);
+    ok = vault.setValue("kdfKey", algorithm);
+    QVERIFY(ok);
+
+    ok = vault.changePassword("new password", Kdf::Pbkdf2Sha256);
+    QVERIFY(ok);
+    vault.lock();
+    ok = vault.unlock("new password");
+    QVERIFY(ok);
+    QCOMPARE(vault.getValue("kdfKey", &ok).toInt(), algorithm);
+    QVERIFY(ok);
+}
+
+void QVaultLibTest::testLegacyKdf()
+{
+    // RFC 6070 test vector, vaults without KDF parameters must keep their keys
+    QScopedPointer<Kdf> kdf(Kdf::create(Kdf::legacyParameters(1)));
+    QVERIFY(kdf);
+    QCOMPARE(kdf->algorithm(), Kdf::Pbkdf2Sha1);
+    QCOMPARE(kdf->derive("password", "salt", 20).toHex(), QByteArray("0c60c80f961f0e71f3a9b524af6012062fe037a6"));
+
+    QVariantMap parameters = kdf->parameters();
+    parameters.insert("algorithm", "unknown");
+    QVERIFY(!QScopedPointer<Kdf>(Kdf::create(parameters)));
+    parameters = Kdf::legacyParameters(0);
+    QVERIFY(!QScopedPointer<Kdf>(Kdf::create(parameters)));
+}
+
+void QVaultLibTest::testKdfCalibration()
+{
+    // calibration runs once per process, later vaults reuse its result
+    QVariantMap parameters = Kdf::calibratedParameters(Kdf::Pbkdf2Sha256, 20);
+    QVERIFY(!parameters.isEmpty());
+    QCOMPARE(Kdf::calibratedParameters(Kdf::Pbkdf2Sha256, 20), parameters);
+    QVERIFY(parameters.value("iterations").toInt() >= 100);
+
+    // the cost can be set by hand, skipping calibration
+    QString kdfVaultPath = testPath("kdf");
+    parameters.insert("iterations", 1000);
+    bool ok = QVault::create(kdfVaultPath, "password", parameters);
+    QVERIFY(ok);
+
+    QVault vault(kdfVaultPath);
+    ok = vault.unlock("password");
+    QVERIFY(ok);
+    ok = vault.changePassword("new password", Kdf::calibratedParameters(Kdf::Pbkdf2Sha512, 10));
+    QVERIFY(ok);
+    vault.lock();
+    ok = vault.unlock("new password");
+    QVERIFY(ok);
+
+    parameters.insert("iterations", 0);
+    ok = vault.changePassword("password", parameters);
+    QVERIFY(!ok);
+    vault.lock();
+    ok = vault.unlock("new password");
+    QVERIFY(ok);
+}
 
-    QFile(newVaultPath).remove();
+void QVaultLibTest::testPasswordSlots()
+{
+    QString slotsVaultPath = testPath("slots");
+    bool ok = QVault::create(slotsVaultPath, "admin password", _kdf);
+    QVERIFY(ok);
+
+    QVault vault(slotsVaultPath);
+    ok = vault.unlock("admin password");
+    QVERIFY(ok);
+    ok = vault.setValue("slotsKey", "slotsValue");
+    QVERIFY(ok);
+    ok = vault.removePassword("admin password");
+    QVERIFY(!ok);
+    ok = vault.addPassword("service password", _kdf);
+    QVERIFY(ok);
+
+    // a session is bound to its own password, not to the others
+    VaultSession session(60000);
+    ok = vault.startSession(&session);
+    QVERIFY(ok);
+
+    QVault service(slotsVaultPath);
+    ok = service.unlock("service password");
+    QVERIFY(ok);
+    QCOMPARE(service.getValue("slotsKey", &ok).toString(), QString("slotsValue"));
+    QVERIFY(ok);
+    ok = service.changePassword("new service password", _kdf);
+    QVERIFY(ok);
+    ok = service.setValue("serviceKey", "serviceValue");
+    QVERIFY(ok);
+    service.lock();
+
+    // only the changed password stops working
+    vault.lock();
+    ok = vault.unlock(&session);
+    QVERIFY(ok);
+    QCOMPARE(vault.getValue("serviceKey", &ok).toString(), QString("serviceValue"));
+    QVERIFY(ok);
+    vault.lock();
+    ok = vault.unlock("service password");
+    QVERIFY(!ok);
+    ok = vault.unlock("new service password");
+    QVERIFY(ok);
+    vault.lock();
+    ok = vault.unlock("admin password");
+    QVERIFY(ok);
+
+    ok = vault.removePassword("unknown password");
+    QVERIFY(!ok);
+    ok = vault.removePassword("new service password");
+    QVERIFY(ok);
+    vault.lock();
+    ok = vault.unlock("new service password");
+    QVERIFY(!ok);
+    ok = vault.unlock("admin password");
+    QVERIFY(ok);
+    QCOMPARE(vault.getValue("slotsKey", &ok).toString(), QString("slotsValue"));
+    QVERIFY(ok);
+}
+
+void QVaultLibTest::testRotateDataKey()
+{
+    QString newVaultPath = testPath("reencrypt");
+    bool ok = QVault::create(newVaultPath, "password", _kdf);
+    QVERIFY(ok);
+
+    QVariantMap values;
+    for (int i = 0; i < 2000; ++i) {
+        values.insert(QString("reencryptKey%1").arg(i), i);
+    }
+
+    QVault vault(newVaultPath);
+    ok = vault.unlock("password");
+    QVERIFY(ok);
+    ok = vault.setValues(values);
+    QVERIFY(ok);
+
+    ok = vault.addPassword("other password", _kdf);
+    QVERIFY(ok);
+
+    QSignalSpy progressSpy(&vault, &QVault::reencryptionProgress);
+    ok = vault.rotateDataKey("new password", _kdf);
+    QVERIFY(ok);
+    QTRY_VERIFY(!progressSpy.isEmpty());
+    QCOMPARE(progressSpy.last().at(0).toInt(), values.size());
+    QCOMPARE(progressSpy.last().at(1).toInt(), values.size());
+
+    // the new data key is protected by the new password alone
+    vault.lock();
+    ok = vault.unlock("password");
+    QVERIFY(!ok);
+    ok = vault.unlock("other password");
+    QVERIFY(!ok);
+    ok = vault.unlock("new password");
+    QVERIFY(ok);
+    for (auto it = values.constBegin(); it != values.constEnd(); ++it) {
+        QCOMPARE(vault.getValue(it.key(), &ok), it.value());
+        QVERIFY(ok);
+    }
+}
+
+void QVaultLibTest::testAbortReencryption()
+{
+    QString newVaultPath = testPath("abort");
+    bool ok = QVault::create(newVaultPath, "password", _kdf);
+    QVERIFY(ok);
+
+    QVariantMap values;
+    for (int i = 0; i < 1000; ++i) {
+        values.insert(QString("abortKey%1").arg(i), i);
+    }
+
+    QVault vault(newVaultPath);
+    ok = vault.unlock("password");
+    QVERIFY(ok);
+    ok = vault.setValues(values);
+    QVERIFY(ok);
+
+    // an abort made before the rotation applies to it, so it fails every time
+    vault.abortReencryption();
+    ok = vault.rotateDataKey("new password", _kdf);
+    QVERIFY(!ok);
+
+    // the vault keeps its keys and only the old password unlocks it
+    vault.lock();
+    ok = vault.unlock("new password");
+    QVERIFY(!ok);
+    ok = vault.unlock("password");
+    QVERIFY(ok);
+    QCOMPARE(vault.getValue("abortKey1", &ok).toInt(), 1);
+    QVERIFY(ok);
+    QCOMPARE(vault.getValue("abortKey999", &ok).toInt(), 999);
+    QVERIFY(ok);
+
+    // the abort is consumed, the next rotation succeeds
+    ok = vault.rotateDataKey("new password", _kdf);
+    QVERIFY(ok);
+    vault.lock();
+    ok = vault.unlock("new password");
+    QVERIFY(ok);
+}
+
+void QVaultLibTest::testCipherSuites_data()
+{
+    QTest::addColumn<int>("suite");
+
+    QTest::newRow("AES-CBC") << int(QVault::AesCbc);
+    QTest::newRow("AES-GCM") << int(QVault::AesGcm);
+    QTest::newRow("ChaCha20-Poly1305") << int(QVault::ChaCha20Poly1305);
+}
+
+void QVaultLibTest::testCipherSuites()
+{
+    QFETCH(int, suite);
+
+    QString suiteVaultPath = testPath("suite");
+    bool ok = QVault::create(suiteVaultPath, "password", _kdf, QVault::CipherSuite(suite));
+    QVERIFY(ok);
+
+    QVault vault(suiteVaultPath);
+    ok = vault.unlock("password");
+    QVERIFY(ok);
+    QCOMPARE(int(vault.cipherSuite()), suite);
+
+    // a cleared vault is written as a snapshot, so the record ends the vault file
+    vault.beginTransaction();
+    vault.clear();
+    vault.setValue("suiteKey", "suiteValue");
+    ok = vault.commit();
+    QVERIFY(ok);
+
+    // records without authentication are moved to AES-GCM with a new data key
+    if (suite == QVault::AesCbc) {
+        ok = vault.rotateDataKey("password", _kdf);
+        QVERIFY(ok);
+        QCOMPARE(vault.cipherSuite(), QVault::AesGcm);
+    }
+    QCOMPARE(vault.getValue("suiteKey", &ok).toString(), QString("suiteValue"));
+    QVERIFY(ok);
+    vault.lock();
+
+    QFile file(suiteVaultPath);
+    ok = file.open(QFile::ReadWrite);
+    QVERIFY(ok);
+    file.seek(file.size() - 1);
+    char last = 0;
+    file.getChar(&last);
+    file.seek(file.size() - 1);
+    file.putChar(last ^ 1);
+    file.close();
+
+    // only the header is verified on unlock, records are verified when read
+    ok = vault.unlock("password");
+    QVERIFY(ok);
+    vault.getValue("suiteKey", &ok);
+    QVERIFY(!ok);
+}
+
+void QVaultLibTest::testReadValue_data()
+{
+    testCipherSuites_data();
+}
+
+void QVaultLibTest::testReadValue()
+{
+    QFETCH(int, suite);
+
+    QString readVaultPath = testPath("read");
+    bool ok = QVault::create(readVaultPath, "password", _kdf, QVault::CipherSuite(suite));
+    QVERIFY(ok);
+
+    QVault vault(readVaultPath);
+    QByteArray value("unchanged");
+    ok = vault.readValue("bytesKey", &value);
+    QVERIFY(!ok);
+
+    ok = vault.unlock("password");
+    QVERIFY(ok);
+
+    const QByteArray bytes = QByteArray("binary\0value", 12).repeated(10);
+    const QVariantMap values = {{"bytesKey", bytes},
+                                {QString::fromUtf8("ключ"), QByteArray("utf-8 key")},
+                                {"emptyKey", QByteArray("")},
+                                {"nullKey", QByteArray()},
+                                {"stringKey", QString("string value")}};
+    ok = vault.setValues(values);
+    QVERIFY(ok);
+
+    // records are read from the journal first, then from the vault file
+    for (int pass = 0; pass < 2; ++pass) {
+        ok = vault.readValue("bytesKey", &value);
+        QVERIFY(ok);
+        QCOMPARE(value, bytes);
+
+        // the buffer is reused for a shorter value
+        ok = vault.readValue(QString::fromUtf8("ключ"), &value);
+        QVERIFY(ok);
+        QCOMPARE(value, QByteArray("utf-8 key"));
+
+        ok = vault.readValue("emptyKey", &value);
+        QVERIFY(ok);
+        QVERIFY(value.isEmpty());
+
+        ok = vault.readValue("nullKey", &value);
+        QVERIFY(ok);
+        QVERIFY(value.isEmpty());
+
+        ok = vault.readValue("stringKey", &value);
+        QVERIFY(!ok);
+        ok = vault.readValue("missingKey", &value);
+        QVERIFY(!ok);
+
+        // a cleared vault is written as a snapshot
+        vault.beginTransaction();
+        vault.clear();
+        for (auto it = values.constBegin(); it != values.constEnd(); ++it) {
+            vault.setValue(it.key(), it.value());
+        }
+        ok = vault.commit();
+        QVERIFY(ok);
+    }
+
+    vault.lock();
+    ok = vault.readValue("bytesKey", &value);
+    QVERIFY(!ok);
+}
+
+void QVaultLibTest::testValueCodec_data()
+{
+    QTest::addColumn<QVariant>("value");
+
+    QTest::newRow("bytes") << QVariant(QByteArray("binary\0value", 12));
+    QTest::newRow("empty bytes") << QVariant(QByteArray(""));
+    QTest::newRow("null bytes") << QVariant(QByteArray());
+    QTest::newRow("string") << QVariant(QString::fromUtf8("значение"));
+    QTest::newRow("int") << QVariant(-42);
+    QTest::newRow("min int") << QVariant(std::numeric_limits<int>::min());
+    QTest::newRow("uint") << QVariant(4000000000u);
+    QTest::newRow("long long") << QVariant(std::numeric_limits<qint64>::min());
+    QTest::newRow("unsigned long long") << QVariant(std::numeric_limits<quint64>::max());
+    QTest::newRow("bool") << QVariant(true);
+    QTest::newRow("double") << QVariant(3.14);
+    QTest::newRow("list") << QVariant(QVariantList({1, "two"}));
+    QTest::newRow("invalid") << QVariant();
+}
+
+void QVaultLibTest::testValueCodec()
+{
+    QFETCH(QVariant, value);
+
+    QByteArray legacy;
+    QDataStream out(&legacy, QIODevice::WriteOnly);
+    out << value;
+
+    // values written before the codec are decoded as well
+    for (const QByteArray &encoded : {ValueCodec::encode(value), ValueCodec::encode(value, true), legacy}) {
+        QVariant decoded;
+        bool ok = ValueCodec::decode(encoded, &decoded);
+        QVERIFY(ok);
+        QCOMPARE(decoded.userType(), value.userType());
+        QCOMPARE(decoded, value);
+        QCOMPARE(decoded.isNull(), value.isNull());
+
+        QByteArray bytes("unchanged");
+        ok = ValueCodec::decodeBytes(encoded.constData(), encoded.size(), &bytes);
+        QCOMPARE(ok, value.userType() == QMetaType::QByteArray);
+        if (ok) {
+            QCOMPARE(bytes, value.toByteArray());
+        }
+    }
+    QVERIFY(ValueCodec::encode(value).size() <= legacy.size());
+
+    QVariant decoded;
+    QVERIFY(!ValueCodec::decode(QByteArray(), &decoded));
+    QVERIFY(!ValueCodec::decode(QByteArray(1, char(0xff)), &decoded));
+}
+
+void QVaultLibTest::testValueCompression()
+{
+    const QByteArray bytes = QByteArray("compressible ").repeated(100);
+    const QString string = QString("compressible string ").repeated(100);
+
+    QByteArray encoded = ValueCodec::encode(bytes, true);
+    QVERIFY(encoded.size() < bytes.size() / 4);
+    QCOMPARE(ValueCodec::encode(bytes).size(), bytes.size() + 1);
+
+    QByteArray decodedBytes;
+    bool ok = ValueCodec::decodeBytes(encoded.constData(), encoded.size(), &decodedBytes);
+    QVERIFY(ok);
+    QCOMPARE(decodedBytes, bytes);
+
+    // corrupted compressed data is rejected
+    encoded.truncate(encoded.size() / 2);
+    QVariant decoded;
+    QVERIFY(!ValueCodec::decode(encoded, &decoded));
+
+    const QString compressionVaultPath = testPath("compression");
+    ok = QVault::create(compressionVaultPath, "password", _kdf);
+    QVERIFY(ok);
+    QVault vault(compressionVaultPath);
+    ok = vault.unlock("password");
+    QVERIFY(ok);
+    QVERIFY(!vault.compression());
+    vault.setCompression(true);
+
+    const qint64 journalSize = QFile(VaultJournal::journalPath(compressionVaultPath)).size();
+    ok = vault.setValues({{"compressedBytes", bytes}, {"compressedString", string}});
+    QVERIFY(ok);
+    QVERIFY(QFile(VaultJournal::journalPath(compressionVaultPath)).size() - journalSize < bytes.size());
+
+    QCOMPARE(vault.getValue("compressedString", &ok).toString(), string);
+    QVERIFY(ok);
+    ok = vault.readValue("compressedBytes", &decodedBytes);
+    QVERIFY(ok);
+    QCOMPARE(decodedBytes, bytes);
+
+    // compressed values are read regardless of the setting
+    vault.setCompression(false);
+    QCOMPARE(vault.getValue("compressedBytes", &ok).toByteArray(), bytes);
+    QVERIFY(ok);
+}
+
+void QVaultLibTest::testStreams()
+{
+    const QString streamVaultPath = testPath("stream");
+    const QDir blobs(QVault::blobsPath(streamVaultPath));
+    const auto blobFiles = [&blobs]() { return QDir(blobs.path()).entryList(QDir::Files); };
+    bool ok = QVault::create(streamVaultPath, "password", _kdf);
+    QVERIFY(ok);
+
+    // several chunks and a part of one
+    QByteArray data(3 * VaultBlob::ChunkSize + 100, '\0');
+    for (int i = 0; i < data.size(); ++i) {
+        data[i] = char(i * 31 % 251);
+    }
+    QBuffer source(&data);
+    source.open(QIODevice::ReadOnly);
+
+    QVault vault(streamVaultPath);
+    ok = vault.writeStream("streamKey", &source);
+    QVERIFY(!ok);
+    ok = vault.unlock("password");
+    QVERIFY(ok);
+    ok = vault.writeStream("streamKey", &source);
+    QVERIFY(ok);
+    QCOMPARE(blobFiles().size(), 1);
+
+    QByteArray read;
+    QBuffer output(&read);
+    output.open(QIODevice::WriteOnly);
+    ok = vault.readStream("streamKey", &output);
+    QVERIFY(ok);
+    QCOMPARE(read, data);
+
+    // streams and values are not mixed up
+    vault.getValue("streamKey", &ok);
+    QVERIFY(!ok);
+    ok = vault.setValue("valueKey", "value");
+    QVERIFY(ok);
+    ok = vault.readStream("valueKey", &output);
+    QVERIFY(!ok);
+    ok = vault.readStream("missingKey", &output);
+    QVERIFY(!ok);
+
+    // a replaced stream has its blob deleted, even if the data key is replaced meanwhile
+    ok = vault.rotateDataKey("password", _kdf);
+    QVERIFY(ok);
+    QBuffer empty;
+    empty.open(QIODevice::ReadOnly);
+    ok = vault.writeStream("streamKey", &empty);
+    QVERIFY(ok);
+    QCOMPARE(blobFiles().size(), 1);
+    output.close();
+    read.clear();
+    output.open(QIODevice::WriteOnly);
+    ok = vault.readStream("streamKey", &output);
+    QVERIFY(ok);
+    QVERIFY(read.isEmpty());
+
+    // the last chunk is authenticated as the last one, so whole chunks cannot be cut off
+    source.close();
+    data.truncate(2 * VaultBlob::ChunkSize);
+    source.open(QIODevice::ReadOnly);
+    ok = vault.writeStream("streamKey", &source);
+    QVERIFY(ok);
+    const QString blobPath = blobs.filePath(blobFiles().value(0));
+    QFile blobFile(blobPath);
+    ok = blobFile.resize(blobFile.size() - VaultBlob::ChunkSize - AeadCipher::Overhead);
+    QVERIFY(ok);
+    ok = vault.readStream("streamKey", &output);
+    QVERIFY(!ok);
+
+    source.close();
+    source.open(QIODevice::ReadOnly);
+    ok = vault.writeStream("streamKey", &source);
+    QVERIFY(ok);
+    QFile corruptedFile(blobs.filePath(blobFiles().value(0)));
+    ok = corruptedFile.open(QFile::ReadWrite);
+    QVERIFY(ok);
+    corruptedFile.seek(corruptedFile.size() / 2);
+    char byte = 0;
+    corruptedFile.getChar(&byte);
+    corruptedFile.seek(corruptedFile.size() / 2);
+    corruptedFile.putChar(byte ^ 1);
+    corruptedFile.close();
+    ok = vault.readStream("streamKey", &output);
+    QVERIFY(!ok);
+
+    ok = vault.removeValue("streamKey");
+    QVERIFY(ok);
+    QVERIFY(blobFiles().isEmpty());
+
+    // other writes replacing or removing a stream delete its blob too
+    const auto writeEmptyStream = [&vault](const QString &key) {
+        QBuffer empty;
+        empty.open(QIODevice::ReadOnly);
+        return vault.writeStream(key, &empty);
+    };
+    ok = writeEmptyStream("streamKey");
+    QVERIFY(ok);
+    ok = vault.setValue("streamKey", "value");
+    QVERIFY(ok);
+    QVERIFY(blobFiles().isEmpty());
+    ok = writeEmptyStream("streamKey");
+    QVERIFY(ok);
+    ok = vault.setValues({{"streamKey", "value"}});
+    QVERIFY(ok);
+    QVERIFY(blobFiles().isEmpty());
+    ok = writeEmptyStream("streamKey");
+    QVERIFY(ok);
+    ok = vault.setValueAsync("streamKey", "value").result();
+    QVERIFY(ok);
+    QVERIFY(blobFiles().isEmpty());
+    ok = writeEmptyStream("streamKey");
+    QVERIFY(ok);
+    ok = vault.removeValueAsync("streamKey").result();
+    QVERIFY(ok);
+    QVERIFY(blobFiles().isEmpty());
+
+    // a rolled back clear keeps blobs, a committed one deletes all of them
+    ok = writeEmptyStream("streamKey");
+    QVERIFY(ok);
+    ok = writeEmptyStream("otherStreamKey");
+    QVERIFY(ok);
+    ok = vault.beginTransaction() && vault.clear() && vault.rollback();
+    QVERIFY(ok);
+    QCOMPARE(blobFiles().size(), 2);
+    ok = vault.clear();
+    QVERIFY(ok);
+    QVERIFY(!QDir(blobs.path()).exists());
+}
+
+void QVaultLibTest::testValueCache()
+{
+    const QString cacheVaultPath = testPath("cache");
+    bool ok = QVault::create(cacheVaultPath, "password", _kdf);
+    QVERIFY(ok);
+    QVault vault(cacheVaultPath);
+    ok = vault.unlock("password");
+    QVERIFY(ok);
+    ok = vault.setValues({{"cachedKey1", QByteArray(100, '1')},
+                          {"cachedKey2", QByteArray(100, '2')},
+                          {"cachedKey3", QByteArray(100, '3')}});
+    QVERIFY(ok);
+
+    // the cache is disabled by default
+    QCOMPARE(vault.getValue("cachedKey1", &ok).toByteArray(), QByteArray(100, '1'));
+    QVERIFY(ok);
+    QCOMPARE(vault.cacheHits() + vault.cacheMisses(), quint64(0));
+
+    vault.setCacheBudget(4096);
+    QCOMPARE(vault.cacheBudget(), 4096);
+    QCOMPARE(vault.getValue("cachedKey1", &ok).toByteArray(), QByteArray(100, '1'));
+    QVERIFY(ok);
+    QCOMPARE(vault.getValue("cachedKey1", &ok).toByteArray(), QByteArray(100, '1'));
+    QVERIFY(ok);
+    QByteArray bytes;
+    ok = vault.readValue("cachedKey1", &bytes);
+    QVERIFY(ok);
+    QCOMPARE(bytes, QByteArray(100, '1'));
+    QCOMPARE(vault.cacheMisses(), quint64(1));
+    QCOMPARE(vault.cacheHits(), quint64(2));
+
+    // writes invalidate cached values
+    ok = vault.setValue("cachedKey1", QByteArray(100, 'a'));
+    QVERIFY(ok);
+    QCOMPARE(vault.getValue("cachedKey1", &ok).toByteArray(), QByteArray(100, 'a'));
+    QVERIFY(ok);
+    QCOMPARE(vault.cacheMisses(), quint64(2));
+
+    vault.beginTransaction();
+    vault.setValue("cachedKey1", QByteArray(100, 'b'));
+    QCOMPARE(vault.getValue("cachedKey1", &ok).toByteArray(), QByteArray(100, 'b'));
+    vault.rollback();
+    QCOMPARE(vault.getValue("cachedKey1", &ok).toByteArray(), QByteArray(100, 'a'));
+    QVERIFY(ok);
+
+    ok = vault.removeValue("cachedKey1");
+    QVERIFY(ok);
+    vault.getValue("cachedKey1", &ok);
+    QVERIFY(!ok);
+
+    // the least recently used value is evicted once the budget is exceeded
+    vault.setCacheBudget(500);
+    vault.getValue("cachedKey2", &ok);
+    vault.getValue("cachedKey3", &ok);
+    const quint64 misses = vault.cacheMisses();
+    vault.getValue("cachedKey3", &ok);
+    QCOMPARE(vault.cacheMisses(), misses);
+    vault.setCacheBudget(300);
+    vault.getValue("cachedKey3", &ok);
+    QCOMPARE(vault.cacheMisses(), misses);
+    vault.getValue("cachedKey2", &ok);
+    QCOMPARE(vault.cacheMisses(), misses + 1);
+
+    // locking wipes the cache, the budget is kept
+    vault.lock();
+    ok = vault.unlock("password");
+    QVERIFY(ok);
+    QCOMPARE(vault.cacheBudget(), 300);
+    QCOMPARE(vault.getValue("cachedKey2", &ok).toByteArray(), QByteArray(100, '2'));
+    QVERIFY(ok);
+    QCOMPARE(vault.cacheMisses(), misses + 2);
+
+    vault.beginTransaction();
+    vault.removeValue("cachedKey2");
+    vault.removeValue("cachedKey3");
+    ok = vault.commit();
+    QVERIFY(ok);
+}
+
+void QVaultLibTest::testKeys_data()
+{
+    testCipherSuites_data();
+}
+
+void QVaultLibTest::testKeys()
+{
+    QFETCH(int, suite);
+
+    const QString keysVaultPath = testPath("keys");
+    bool ok = QVault::create(keysVaultPath, "password", _kdf, QVault::CipherSuite(suite));
+    QVERIFY(ok);
+
+    QVault vault(keysVaultPath);
+    QVERIFY(vault.keys().isEmpty());
+    QVERIFY(!vault.contains("db/user"));
+    ok = vault.unlock("password");
+    QVERIFY(ok);
+
+    ok = vault.setValues({{"db/user", "user"},
+                          {"db/password", "password"},
+                          {"dbx", 1},
+                          {"web/token", "token"}});
+    QVERIFY(ok);
+    QCOMPARE(vault.keys(), QStringList({"db/password", "db/user", "dbx", "web/token"}));
+    QCOMPARE(vault.keys("db/"), QStringList({"db/password", "db/user"}));
+    QVERIFY(vault.keys("mail/").isEmpty());
+    QVERIFY(vault.contains("db/user"));
+    QVERIFY(!vault.contains("db/"));
+
+    // the index follows changes once it is built
+    ok = vault.setValue("db/host", "localhost");
+    QVERIFY(ok);
+    ok = vault.removeValue("db/user");
+    QVERIFY(ok);
+    QCOMPARE(vault.keys("db/"), QStringList({"db/host", "db/password"}));
+
+    vault.beginTransaction();
+    vault.setValue("db/port", 5432);
+    QCOMPARE(vault.keys("db/"), QStringList({"db/host", "db/password", "db/port"}));
+    vault.rollback();
+    QCOMPARE(vault.keys("db/"), QStringList({"db/host", "db/password"}));
+
+    // keys written to the vault file and read back after unlocking
+    vault.beginTransaction();
+    vault.clear();
+    vault.setValue("db/host", "localhost");
+    vault.setValue("web/token", "token");
+    ok = vault.commit();
+    QVERIFY(ok);
+    vault.lock();
+    QVERIFY(vault.keys().isEmpty());
+    ok = vault.unlock("password");
+    QVERIFY(ok);
+    QCOMPARE(vault.keys(), QStringList({"db/host", "web/token"}));
+}
+
+// keeps the order of reported operations on top of the counters
+class RecordingMetrics : public VaultMetrics
+{
+public:
+    void operationFinished(Operation operation, qint64 nanoseconds) override
+    {
+        VaultMetrics::operationFinished(operation, nanoseconds);
+        operations.append(operation);
+    }
+
+    QList<Operation> operations;
+};
+
+void QVaultLibTest::testMetrics()
+{
+    const QString metricsVaultPath = testPath("metrics");
+    bool ok = QVault::create(metricsVaultPath, "password", _kdf);
+    QVERIFY(ok);
+
+    RecordingMetrics metrics;
+    QVault vault(metricsVaultPath);
+    QVERIFY(!vault.metrics());
+    vault.setMetrics(&metrics);
+    QCOMPARE(vault.metrics(), &metrics);
+
+    ok = vault.unlock("password");
+    QVERIFY(ok);
+    QCOMPARE(metrics.count(VaultMetrics::Unlock), quint64(1));
+    QVERIFY(metrics.phaseTime(VaultMetrics::KeyDerivation) > 0);
+
+    ok = vault.setValue("metricsKey", QByteArray(100, 'm'));
+    QVERIFY(ok);
+    vault.getValue("metricsKey", &ok);
+    QVERIFY(ok);
+    vault.getValue("missingKey", &ok);
+    QVERIFY(!ok);
+    QByteArray bytes;
+    ok = vault.readValue("metricsKey", &bytes);
+    QVERIFY(ok);
+
+    QCOMPARE(metrics.operations, QList<VaultMetrics::Operation>({VaultMetrics::Unlock,
+                                                                 VaultMetrics::SetValue,
+                                                                 VaultMetrics::GetValue,
+                                                                 VaultMetrics::GetValue,
+                                                                 VaultMetrics::ReadValue}));
+    QCOMPARE(metrics.count(VaultMetrics::GetValue), quint64(2));
+    QVERIFY(metrics.totalTime(VaultMetrics::GetValue) > 0);
+    const QVector<quint64> histogram = metrics.histogram(VaultMetrics::GetValue);
+    QCOMPARE(histogram.size(), VaultMetrics::HistogramBuckets);
+    QCOMPARE(std::accumulate(histogram.constBegin(), histogram.constEnd(), quint64(0)), quint64(2));
+    QVERIFY(metrics.phaseTime(VaultMetrics::Encryption) > 0);
+    QVERIFY(metrics.phaseTime(VaultMetrics::Encoding) > 0);
+    QVERIFY(metrics.phaseTime(VaultMetrics::Disk) > 0);
+    QCOMPARE(metrics.saves(), quint64(0));
+
+    // a cleared vault is written as a new vault file
+    vault.beginTransaction();
+    vault.clear();
+    vault.setValue("metricsKey", QByteArray(100, 'm'));
+    ok = vault.commit();
+    QVERIFY(ok);
+    QCOMPARE(metrics.count(VaultMetrics::Clear), quint64(1));
+    QCOMPARE(metrics.count(VaultMetrics::Commit), quint64(1));
+    QCOMPARE(metrics.count(VaultMetrics::Save), quint64(1));
+    QCOMPARE(metrics.saves(), quint64(1));
+    QCOMPARE(metrics.lastSavedBytes(), QFileInfo(metricsVaultPath).size());
+    QCOMPARE(metrics.savedBytes(), metrics.lastSavedBytes());
+
+    ok = vault.flush();
+    QVERIFY(ok);
+    QCOMPARE(metrics.count(VaultMetrics::Flush), quint64(1));
+
+    // nothing is reported once metrics are unset
+    vault.setMetrics(nullptr);
+    vault.getValue("metricsKey", &ok);
+    QVERIFY(ok);
+    QCOMPARE(metrics.count(VaultMetrics::GetValue), quint64(2));
+
+    metrics.reset();
+    QCOMPARE(metrics.count(VaultMetrics::Unlock), quint64(0));
+    QCOMPARE(metrics.phaseTime(VaultMetrics::Disk), qint64(0));
+    QCOMPARE(metrics.saves(), quint64(0));
+
+    QCOMPARE(VaultMetrics::bucketLimit(0), qint64(1));
+    QCOMPARE(VaultMetrics::bucketLimit(10), qint64(1024));
+    QCOMPARE(VaultMetrics::bucketLimit(VaultMetrics::HistogramBuckets - 1), qint64(-1));
+    QCOMPARE(QByteArray(VaultMetrics::operationName(VaultMetrics::RotateDataKey)), QByteArray("rotateDataKey"));
+    QCOMPARE(QByteArray(VaultMetrics::operationName(VaultMetrics::Flush)), QByteArray("flush"));
+    QCOMPARE(QByteArray(VaultMetrics::phaseName(VaultMetrics::Disk)), QByteArray("disk"));
+}
+
+void QVaultLibTest::testShards()
+{
+    const QString shardsVaultPath = testPath("shards");
+    const QString shardsPath = VaultShards::directoryPath(shardsVaultPath);
+    const auto shardFiles = [&shardsPath]() {
+        return QDir(shardsPath).entryList(QDir::Files);
+    };
+
+    // records are routed by their whole keys, AesCbc keys may share leading blocks
+    QSet<int> routed;
+    for (int i = 0; i < 64; ++i) {
+        routed.insert(VaultShards::shardOf(QByteArray(16, 'p') + QByteArray::number(i), 4));
+    }
+    QCOMPARE(routed.size(), 4);
+
+    bool ok = QVault::create(shardsVaultPath, "password", _kdf, QVault::AesGcm);
+    QVERIFY(ok);
+
+    QVault vault(shardsVaultPath);
+    QVERIFY(!vault.setShardCount(4));
+    ok = vault.unlock("password");
+    QVERIFY(ok);
+    QCOMPARE(vault.shardCount(), 1);
+
+    QVariantMap values;
+    for (int i = 0; i < 100; ++i) {
+        values.insert(QString("key%1").arg(i), i);
+    }
+    ok = vault.setValues(values);
+    QVERIFY(ok);
+
+    QVERIFY(!vault.setShardCount(0));
+    QVERIFY(!vault.setShardCount(VaultShards::MaxCount + 1));
+    ok = vault.setShardCount(4);
+    QVERIFY(ok);
+    QCOMPARE(vault.shardCount(), 4);
+    const QStringList files = shardFiles();
+    QCOMPARE(files.size(), 4);
+    QCOMPARE(vault.getValue("key42", &ok).toInt(), 42);
+    QVERIFY(ok);
+    QCOMPARE(vault.keys().size(), values.size());
+
+    // a change goes to the journal, and only its shard is rewritten when the vault file is
+    ok = vault.setValue("key42", 4242);
+    QVERIFY(ok);
+    QCOMPARE(shardFiles(), files);
+    ok = vault.changePassword("password", _kdf);
+    QVERIFY(ok);
+    const QStringList rewritten = shardFiles();
+    QCOMPARE(rewritten.size(), 4);
+    int kept = 0;
+    for (const QString &file : rewritten) {
+        kept += files.contains(file) ? 1 : 0;
+    }
+    QCOMPARE(kept, 3);
+
+    // header changes rewrite no shards
+    ok = vault.changePassword("password", _kdf);
+    QVERIFY(ok);
+    QCOMPARE(shardFiles(), rewritten);
+
+    // shards named by the vault file must all be present
+    QVault other(shardsVaultPath);
+    const QString shardFile = QDir(shardsPath).filePath(rewritten.first());
+    QVERIFY(QFile::rename(shardFile, shardFile + ".moved"));
+    QVERIFY(!other.unlock("password"));
+    QVERIFY(QFile::rename(shardFile + ".moved", shardFile));
+
+    ok = other.unlock("password");
+    QVERIFY(ok);
+    QCOMPARE(other.shardCount(), 4);
+    QCOMPARE(other.getValue("key42", &ok).toInt(), 4242);
+    QVERIFY(ok);
+    QCOMPARE(other.getValue("key7", &ok).toInt(), 7);
+    QVERIFY(ok);
+
+    // records are merged back into the vault file, other instances follow on refresh
+    ok = vault.setShardCount(1);
+    QVERIFY(ok);
+    QVERIFY(!QDir(shardsPath).exists());
+    QCOMPARE(vault.getValue("key42", &ok).toInt(), 4242);
+    QVERIFY(ok);
+    ok = other.refresh();
+    QVERIFY(ok);
+    QCOMPARE(other.shardCount(), 1);
+    QCOMPARE(other.keys().size(), values.size());
+}
+
+void QVaultLibTest::testSecureArena()
+{
+    SecureArena *arena = SecureArena::instance();
+    const int used = arena->used();
+
+    {
+        SecureArena::Buffer zeroed(20);
+        QCOMPARE(zeroed.size(), 20);
+        QCOMPARE(QByteArray(zeroed.constData(), zeroed.size()), QByteArray(20, '\0'));
+        // blocks are taken in whole granules
+        QCOMPARE(arena->used(), used + 32);
+
+        SecureArena::Buffer copy(QByteArray("secret key material"));
+        QCOMPARE(copy.view(0, copy.size()), QByteArray("secret key material"));
+        QCOMPARE(copy.view(7, 3), QByteArray("key"));
+        QVERIFY(copy.constData() != zeroed.constData());
+
+        copy.wipe();
+        QVERIFY(copy.isEmpty());
+        QVERIFY(!copy.constData());
+        QCOMPARE(arena->used(), used + 32);
+    }
+    QCOMPARE(arena->used(), used);
+
+    // keys of a context are views of one block, gone once it is wiped
+    CryptoContext context(QByteArray(32, 'a'), QByteArray(16, 'i'), QByteArray(32, 'm'), QVariantMap());
+    QCOMPARE(context.aesKey(), QByteArray(32, 'a'));
+    QCOMPARE(context.iv(), QByteArray(16, 'i'));
+    QCOMPARE(context.macKey(), QByteArray(32, 'm'));
+    QCOMPARE(context.aeadKey(), QByteArray(32, 'a') + QByteArray(16, 'i'));
+    QCOMPARE(context.secretKey().constData(), context.aesKey().constData());
+    QCOMPARE(arena->used(), used + 80);
+
+    context.wipe();
+    QVERIFY(context.secretKey().isEmpty());
+    QVERIFY(context.aesKey().isEmpty());
+    QVERIFY(context.macKey().isEmpty());
+    QCOMPARE(arena->used(), used);
+
+    // the key of record key HMACs is derived into the same block
+    QCOMPARE(CryptoContext(QByteArray(32, 'a'), QByteArray(16, 'i'), QByteArray(32, 'm'), QVariantMap()).keyMacKey(),
+             QByteArray(32, 'm'));
+    CryptoContext separate(QByteArray(32, 'a'), QByteArray(16, 'i'), QByteArray(32, 'm'), QVariantMap(), true);
+    CryptoContext other(QByteArray(32, 'a'), QByteArray(16, 'i'), QByteArray(32, 'n'), QVariantMap(), true);
+    QVERIFY(separate.hasSeparateKeyMac());
+    QCOMPARE(separate.keyMacKey().size(), 32);
+    QVERIFY(separate.keyMacKey() != separate.macKey());
+    QVERIFY(separate.keyMacKey() != other.keyMacKey());
+    QCOMPARE(separate.secretKey(), QByteArray(32, 'a') + QByteArray(16, 'i') + QByteArray(32, 'm'));
+    QCOMPARE(arena->used(), used + 2 * 112);
+}
+
+void QVaultLibTest::testVerify()
+{
+    const QVector<VaultSnapshot::Record> records = QVector<VaultSnapshot::Record>()
+            << qMakePair(QByteArray("a"), QByteArray("1"))
+            << qMakePair(QByteArray("b"), QByteArray("2"))
+            << qMakePair(QByteArray("c"), QByteArray("3"));
+    QCOMPARE(MerkleTree::root(records).size(), MerkleTree::HashSize);
+    QVERIFY(MerkleTree::root(records) != MerkleTree::root(records.mid(0, 2)));
+    QVERIFY(MerkleTree::root(records.mid(0, 2)) != MerkleTree::root(records.mid(1, 2)));
+    // the boundary between key and value is hashed as well
+    QVERIFY(MerkleTree::root(QVector<VaultSnapshot::Record>() << qMakePair(QByteArray("ab"), QByteArray("c"))) !=
+            MerkleTree::root(QVector<VaultSnapshot::Record>() << qMakePair(QByteArray("a"), QByteArray("bc"))));
+
+    const QString verifyVaultPath = testPath("verify");
+    bool ok = QVault::create(verifyVaultPath, "password", _kdf, QVault::AesGcm);
+    QVERIFY(ok);
+
+    QVault vault(verifyVaultPath);
+    QVERIFY(!vault.verify());
+    ok = vault.unlock("password");
+    QVERIFY(ok);
+    QVERIFY(vault.verify());
+
+    QVariantMap values;
+    for (int i = 0; i < 100; ++i) {
+        values.insert(QString("key%1").arg(i), i);
+    }
+    ok = vault.setValues(values);
+    QVERIFY(ok);
+    // records are merged into the vault file together with their root
+    ok = vault.changePassword("password", _kdf);
+    QVERIFY(ok);
+    QVERIFY(vault.verify());
+    vault.lock();
+
+    // the last byte of the file belongs to a record
+    const auto flipLastByte = [&verifyVaultPath]() {
+        QFile file(verifyVaultPath);
+        QVERIFY(file.open(QFile::ReadWrite));
+        QVERIFY(file.seek(file.size() - 1));
+        char last = 0;
+        QVERIFY(file.getChar(&last));
+        QVERIFY(file.seek(file.size() - 1));
+        QVERIFY(file.putChar(char(last ^ 1)));
+    };
+    flipLastByte();
+
+    // unlocking reads no records, reading any of them verifies the file first
+    ok = vault.unlock("password");
+    QVERIFY(ok);
+    vault.getValue("key1", &ok);
+    QVERIFY(!ok);
+    QVERIFY(!vault.contains("key2"));
+    QVERIFY(!vault.verify());
+    QVERIFY(vault.keys().isEmpty());
+
+    // changes are kept in the journal, but never merged with tampered records
+    ok = vault.setValue("key0", 42);
+    QVERIFY(ok);
+    QVERIFY(!vault.changePassword("password", _kdf));
+    vault.lock();
+
+    flipLastByte();
+    ok = vault.unlock("password");
+    QVERIFY(ok);
+    QVERIFY(vault.verify());
+    QCOMPARE(vault.keys().size(), values.size());
+    QCOMPARE(vault.getValue("key0", &ok).toInt(), 42);
+    QVERIFY(ok);
+
+    // every shard has its own root
+    ok = vault.setShardCount(4);
+    QVERIFY(ok);
+    QVERIFY(vault.verify());
 }
 
-QTEST_APPLESS_MAIN(QVaultLibTest)
+QTEST_GUILESS_MAIN(QVaultLibTest)
 
 #include "QVaultLibTests.moc"
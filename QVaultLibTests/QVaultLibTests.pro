@@ -2,7 +2,7 @@
 # QVaultLib unit tests
 #-------------------------------------------------
 
-QT += testlib
+QT += testlib concurrent
 QT -= gui
 
 TARGET = tst_qvaultlibtest